@@ -22,7 +22,12 @@ class aabb {
         point3 min() const {return minimum; }
         point3 max() const {return maximum; }
 
-        bool hit(const ray& r, double t_min, double t_max) const 
+        bool hit(const ray& r, double t_min, double t_max) const {
+            return clip(r, t_min, t_max);
+        }
+
+        // Narrows [t_min, t_max] to the part of the ray inside the box; false if none is.
+        bool clip(const ray& r, double& t_min, double& t_max) const
         {
             for (int a = 0; a < 3; a++) {
                 auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
@@ -26,6 +26,8 @@ class xy_rect : public hittable {
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Z
             // dimension a small amount.
@@ -48,6 +50,8 @@ class xz_rect : public hittable {
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the Y
             // dimension a small amount.
@@ -70,6 +74,8 @@ class yz_rect : public hittable {
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             // The bounding box must have non-zero width in each dimension, so pad the X
             // dimension a small amount.
@@ -92,15 +98,24 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
 
+    rec.t = t;
+    rec.pending = this;
+
+    return true;
+}
+
+void xy_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    auto x = r.origin().x() + rec.t*r.direction().x();
+    auto y = r.origin().y() + rec.t*r.direction().y();
+
     rec.u = (x-x0)/(x1-x0);
     rec.v = (y-y0)/(y1-y0);
-    rec.t = t;
+    rec.u_rate = 1/fabs(x1-x0);
+    rec.v_rate = 1/fabs(y1-y0);
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.p = r.at(rec.t);
 }
 
 bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
@@ -113,15 +128,24 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
 
+    rec.t = t;
+    rec.pending = this;
+
+    return true;
+}
+
+void xz_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    auto x = r.origin().x() + rec.t*r.direction().x();
+    auto z = r.origin().z() + rec.t*r.direction().z();
+
     rec.u = (x-x0)/(x1-x0);
     rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    rec.u_rate = 1/fabs(x1-x0);
+    rec.v_rate = 1/fabs(z1-z0);
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.p = r.at(rec.t);
 }
 
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
@@ -134,15 +158,24 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
 
+    rec.t = t;
+    rec.pending = this;
+
+    return true;
+}
+
+void yz_rect::finalize_hit(const ray& r, hit_record& rec) const {
+    auto y = r.origin().y() + rec.t*r.direction().y();
+    auto z = r.origin().z() + rec.t*r.direction().z();
+
     rec.u = (y-y0)/(y1-y0);
     rec.v = (z-z0)/(z1-z0);
-    rec.t = t;
+    rec.u_rate = 1/fabs(y1-y0);
+    rec.v_rate = 1/fabs(z1-z0);
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mp;
-    rec.p = r.at(t);
-
-    return true;
+    rec.p = r.at(rec.t);
 }
 
 #endif
@@ -0,0 +1,173 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+// Everything a pixel has gathered so far, as running sums, together with where its random
+// sequence has got to. Adding more samples later continues exactly where the last one left
+// off, so a render stopped and resumed matches one that ran straight through.
+struct pixel_sums {
+    color radiance;
+    color albedo;
+    vec3 normal;
+    color direct;
+    double depth;
+    double luminance;
+    double luminance_squared;
+    uint64_t random;
+    int32_t samples;
+    int32_t material_id;  // of the first sample
+    int32_t object_id;
+    int32_t pad;
+
+    void add(const color& sample, const first_hit_features& features) {
+        if (samples == 0) {
+            material_id = features.material_id;
+            object_id = features.object_id;
+        }
+
+        radiance += sample;
+        albedo += features.albedo;
+        normal += features.normal;
+        direct += features.direct;
+        depth += features.depth;
+
+        auto l = ::luminance(sample);
+        luminance += l;
+        luminance_squared += l*l;
+        samples++;
+    }
+};
+
+static_assert(std::is_trivially_copyable<pixel_sums>::value, "checkpoints copy pixels bytewise");
+
+
+// Allocates like std::allocator, but leaves default-constructed elements untouched, so that
+// a large buffer's pages are not placed in memory until whoever uses them first writes them.
+template <typename T>
+struct untouched_allocator : std::allocator<T> {
+    template <typename U>
+    struct rebind { using other = untouched_allocator<U>; };
+
+    untouched_allocator() = default;
+
+    template <typename U>
+    untouched_allocator(const untouched_allocator<U>&) {}
+
+    template <typename U>
+    void construct(U*) {}
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+
+class accumulation_buffer {
+    public:
+        accumulation_buffer() {}
+
+        // Each pixel's random sequence starts from `seed` and its position in the image. With
+        // `initialize` false the pixels are left unwritten, and each of the threads that will
+        // render them should call initialize_rows for its own rows, so that on a NUMA machine
+        // they are placed on that thread's node.
+        accumulation_buffer(int w, int h, uint64_t seed, bool initialize = true);
+
+        void initialize_rows(int row_begin, int row_end);
+
+        size_t index(int x, int y) const { return size_t(y) * width + x; }
+
+        // The fewest samples any pixel has.
+        int samples_done() const;
+
+        // The means of the sums so far.
+        framebuffer resolve() const;
+
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<pixel_sums, untouched_allocator<pixel_sums>> pixels;
+
+    private:
+        uint64_t seed = 0;
+};
+
+
+accumulation_buffer::accumulation_buffer(int w, int h, uint64_t s, bool initialize)
+    : width(w), height(h), pixels(size_t(w) * h), seed(s)
+{
+    if (initialize)
+        initialize_rows(0, height);
+}
+
+
+void accumulation_buffer::initialize_rows(int row_begin, int row_end) {
+    // Pixel i starts at the i-th number of the sequence seeded with `seed`, worked out
+    // directly so that rows can be set up in any order.
+    for (auto i = index(0, row_begin); i < index(0, row_end); i++) {
+        auto& pixel = pixels[i];
+        pixel = pixel_sums{};
+        pixel.random = random_mix(seed + (i + 1) * random_increment);
+        pixel.material_id = pixel.object_id = -1;
+    }
+}
+
+
+int accumulation_buffer::samples_done() const {
+    if (pixels.empty())
+        return 0;
+
+    return std::min_element(pixels.begin(), pixels.end(),
+        [](const pixel_sums& a, const pixel_sums& b) { return a.samples < b.samples; }
+    )->samples;
+}
+
+
+framebuffer accumulation_buffer::resolve() const {
+    framebuffer image(width, height);
+
+    for (size_t i = 0; i < pixels.size(); i++) {
+        const auto& pixel = pixels[i];
+        image.samples[i] = pixel.samples;
+        image.material_id[i] = pixel.material_id;
+        image.object_id[i] = pixel.object_id;
+        if (pixel.samples == 0)
+            continue;
+
+        auto n = static_cast<double>(pixel.samples);
+        image.radiance[i] = pixel.radiance / n;
+        image.albedo[i] = pixel.albedo / n;
+        image.normal[i] = pixel.normal / n;
+        image.direct[i] = pixel.direct / n;
+        image.depth[i] = pixel.depth / n;
+
+        // The variance of the mean, from the spread of the samples.
+        auto mean = pixel.luminance / n;
+        image.variance[i] = fmax(pixel.luminance_squared / n - mean*mean, 0.0) / n;
+    }
+
+    return image;
+}
+
+
+#endif
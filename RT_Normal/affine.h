@@ -0,0 +1,160 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+
+// An affine map stored as the top three rows of a 4x4 matrix: a 3x3 linear part in the first
+// three columns and a translation in the fourth.
+class affine {
+    public:
+        affine() : m{ {1,0,0,0}, {0,1,0,0}, {0,0,1,0} } {}
+
+        static affine translation(const vec3& offset) {
+            affine a;
+            a.m[0][3] = offset.x();
+            a.m[1][3] = offset.y();
+            a.m[2][3] = offset.z();
+            return a;
+        }
+
+        // Same sense as rotate_y: positive angles turn +x towards -z.
+        static affine rotation_y(double angle) {
+            auto radians = degrees_to_radians(angle);
+            affine a;
+            a.m[0][0] =  cos(radians);  a.m[0][2] = sin(radians);
+            a.m[2][0] = -sin(radians);  a.m[2][2] = cos(radians);
+            return a;
+        }
+
+        // Rotation about an arbitrary axis through the origin (right-handed, as rotation_y).
+        static affine rotation(const vec3& axis, double angle) {
+            auto radians = degrees_to_radians(angle);
+            auto c = cos(radians);
+            auto s = sin(radians);
+            auto k = unit_vector(axis);
+            auto x = k.x(), y = k.y(), z = k.z();
+
+            affine a;
+            a.m[0][0] = c + x*x*(1-c);    a.m[0][1] = x*y*(1-c) - z*s;  a.m[0][2] = x*z*(1-c) + y*s;
+            a.m[1][0] = y*x*(1-c) + z*s;  a.m[1][1] = c + y*y*(1-c);    a.m[1][2] = y*z*(1-c) - x*s;
+            a.m[2][0] = z*x*(1-c) - y*s;  a.m[2][1] = z*y*(1-c) + x*s;  a.m[2][2] = c + z*z*(1-c);
+            return a;
+        }
+
+        static affine scaling(double s) {
+            affine a;
+            a.m[0][0] = a.m[1][1] = a.m[2][2] = s;
+            return a;
+        }
+
+        // Applies `rhs` first, then this map.
+        affine operator*(const affine& rhs) const {
+            affine a;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 4; j++) {
+                    a.m[i][j] = m[i][0]*rhs.m[0][j] + m[i][1]*rhs.m[1][j] + m[i][2]*rhs.m[2][j];
+                    if (j == 3)
+                        a.m[i][j] += m[i][3];
+                }
+            }
+            return a;
+        }
+
+        // True if the map only moves points, with no rotation or scale.
+        bool is_translation() const {
+            return m[0][0] == 1 && m[0][1] == 0 && m[0][2] == 0
+                && m[1][0] == 0 && m[1][1] == 1 && m[1][2] == 0
+                && m[2][0] == 0 && m[2][1] == 0 && m[2][2] == 1;
+        }
+
+        vec3 offset() const { return vec3(m[0][3], m[1][3], m[2][3]); }
+
+        point3 point(const point3& p) const {
+            return point3(
+                m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+                m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+                m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(
+                m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+                m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+                m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+        }
+
+        // Multiplies by the transpose of the linear part. Given the inverse of a map, this
+        // carries normals through the map itself.
+        vec3 transpose_vector(const vec3& v) const {
+            return vec3(
+                m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+                m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+                m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+        }
+
+        affine inverse() const {
+            auto det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                     - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                     + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+            auto inv_det = 1.0 / det;
+
+            affine a;
+            a.m[0][0] =  (m[1][1]*m[2][2] - m[1][2]*m[2][1]) * inv_det;
+            a.m[0][1] = -(m[0][1]*m[2][2] - m[0][2]*m[2][1]) * inv_det;
+            a.m[0][2] =  (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+            a.m[1][0] = -(m[1][0]*m[2][2] - m[1][2]*m[2][0]) * inv_det;
+            a.m[1][1] =  (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+            a.m[1][2] = -(m[0][0]*m[1][2] - m[0][2]*m[1][0]) * inv_det;
+            a.m[2][0] =  (m[1][0]*m[2][1] - m[1][1]*m[2][0]) * inv_det;
+            a.m[2][1] = -(m[0][0]*m[2][1] - m[0][1]*m[2][0]) * inv_det;
+            a.m[2][2] =  (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+            // The inverse translation is the inverse linear part applied to -t.
+            auto t = a.vector(vec3(-m[0][3], -m[1][3], -m[2][3]));
+            a.m[0][3] = t.x();
+            a.m[1][3] = t.y();
+            a.m[2][3] = t.z();
+            return a;
+        }
+
+        // The box around the eight transformed corners of `b`.
+        aabb bounds(const aabb& b) const {
+            point3 min( infinity,  infinity,  infinity);
+            point3 max(-infinity, -infinity, -infinity);
+
+            for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                    for (int k = 0; k < 2; k++) {
+                        auto corner = point(point3(
+                            i ? b.max().x() : b.min().x(),
+                            j ? b.max().y() : b.min().y(),
+                            k ? b.max().z() : b.min().z()));
+
+                        for (int c = 0; c < 3; c++) {
+                            min[c] = fmin(min[c], corner[c]);
+                            max[c] = fmax(max[c], corner[c]);
+                        }
+                    }
+                }
+            }
+
+            return aabb(min, max);
+        }
+
+    public:
+        double m[3][4];
+};
+
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+#include "denoise.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Where the camera is at one frame of an animation.
+struct camera_keyframe {
+    double frame = 0;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov = 40.0;
+};
+
+
+// A camera fly-through: keyframes in frame order, with the camera moving smoothly through
+// them. Frames before the first key or after the last hold still.
+struct camera_path {
+    std::vector<camera_keyframe> keys;
+
+    double first_frame() const { return keys.front().frame; }
+    double last_frame() const { return keys.back().frame; }
+
+    // The camera at `frame`. Positions follow a Catmull-Rom spline through the keys, and the
+    // field of view changes linearly between them.
+    camera_keyframe at(double frame) const;
+
+    // Reads one key per line, as "frame  lookfrom x y z  lookat x y z  vfov". Blank lines
+    // and lines starting with '#' are skipped. Returns false, with a message in `error`, if
+    // the file cannot be read or has no keys.
+    static bool read(const std::string& filename, camera_path& path, std::string& error);
+};
+
+
+inline point3 catmull_rom(
+    const point3& p0, const point3& p1, const point3& p2, const point3& p3, double t
+) {
+    auto t2 = t*t;
+    auto t3 = t2*t;
+    return 0.5 * (2*p1 + (p2 - p0)*t + (2*p0 - 5*p1 + 4*p2 - p3)*t2
+                  + (3*p1 - p0 - 3*p2 + p3)*t3);
+}
+
+
+camera_keyframe camera_path::at(double frame) const {
+    if (frame <= first_frame())
+        return keys.front();
+    if (frame >= last_frame())
+        return keys.back();
+
+    auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+        [](double f, const camera_keyframe& key) { return f < key.frame; }) - keys.begin();
+    auto i = static_cast<int>(next) - 1;
+    auto last = static_cast<int>(keys.size()) - 1;
+
+    const auto& k0 = keys[std::max(i - 1, 0)];
+    const auto& k1 = keys[i];
+    const auto& k2 = keys[i + 1];
+    const auto& k3 = keys[std::min(i + 2, last)];
+    auto t = (frame - k1.frame) / (k2.frame - k1.frame);
+
+    camera_keyframe key;
+    key.frame = frame;
+    key.lookfrom = catmull_rom(k0.lookfrom, k1.lookfrom, k2.lookfrom, k3.lookfrom, t);
+    key.lookat = catmull_rom(k0.lookat, k1.lookat, k2.lookat, k3.lookat, t);
+    key.vfov = k1.vfov + t * (k2.vfov - k1.vfov);
+    return key;
+}
+
+
+bool camera_path::read(const std::string& filename, camera_path& path, std::string& error) {
+    std::ifstream in(filename);
+    if (!in) {
+        error = "Could not open camera path '" + filename + "'.";
+        return false;
+    }
+
+    path.keys.clear();
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+        auto first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+
+        std::istringstream fields(line);
+        camera_keyframe key;
+        double x, y, z, ax, ay, az;
+        if (!(fields >> key.frame >> x >> y >> z >> ax >> ay >> az >> key.vfov)) {
+            error = filename + ":" + std::to_string(line_number) + ": expected \"frame lookfrom"
+                    " x y z lookat x y z vfov\".";
+            return false;
+        }
+        key.lookfrom = point3(x, y, z);
+        key.lookat = point3(ax, ay, az);
+        path.keys.push_back(key);
+    }
+
+    if (path.keys.empty()) {
+        error = "Camera path '" + filename + "' has no keyframes.";
+        return false;
+    }
+
+    std::stable_sort(path.keys.begin(), path.keys.end(),
+        [](const camera_keyframe& a, const camera_keyframe& b) { return a.frame < b.frame; });
+    return true;
+}
+
+
+// The name of frame `frame` of an animation written to `prefix`, such as "fly.0042.ppm".
+std::string frame_filename(const std::string& prefix, int frame) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "%04d", frame);
+    return prefix + "." + number + ".ppm";
+}
+
+
+// Finishes and writes frames in the background, one at a time, so that a frame is denoised
+// and saved while the next one renders.
+class frame_writer {
+    public:
+        ~frame_writer() { finish(); }
+
+        // Waits for the frame before to be written, then starts on this one.
+        void write(framebuffer image, std::string filename, bool denoise_image) {
+            wait_for_pending();
+            pending_filename = filename;
+            pending = std::async(std::launch::async,
+                [image = std::move(image), filename = std::move(filename), denoise_image]
+                () mutable {
+                    if (denoise_image)
+                        denoise(image);
+                    std::ofstream out(filename, std::ios::binary);
+                    image.write_ppm(out);
+                    out.flush();
+                    return static_cast<bool>(out);
+                });
+        }
+
+        // Waits for the last frame. Returns false if any frame could not be written.
+        bool finish() {
+            wait_for_pending();
+            return all_written;
+        }
+
+    private:
+        void wait_for_pending() {
+            if (!pending.valid())
+                return;
+            if (!pending.get()) {
+                std::cerr << "\nERROR: Could not write frame '" << pending_filename << "'.\n";
+                all_written = false;
+            }
+        }
+
+        std::future<bool> pending;
+        std::string pending_filename;
+        bool all_written = true;
+};
+
+
+#endif
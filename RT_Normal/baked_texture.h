@@ -0,0 +1,201 @@
+#ifndef BAKED_TEXTURE_H
+#define BAKED_TEXTURE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+
+// How far a baked texture strays from its source, per colour channel.
+struct bake_error {
+    double mean = 0;
+    double max = 0;
+};
+
+
+// A procedural texture sampled once onto a lattice and interpolated at render time. A world
+// space bake covers a box and falls back to the source outside it; a surface bake covers the
+// (u, v) square of one object and is only meaningful on that object.
+class baked_texture : public texture {
+    public:
+        baked_texture(shared_ptr<texture> src, const aabb& bounds, int nx, int ny, int nz);
+
+        // `point_at` gives the shading point for texture coordinates (u, v).
+        baked_texture(
+            shared_ptr<texture> src, int nu, int nv,
+            std::function<point3(double, double)> point_at);
+
+        virtual color value(double u, double v, const vec3& p) const override;
+
+        // Compares against the source at random points: over the surface for a surface bake,
+        // through the box for a world space one.
+        bake_error measure_error(int samples) const;
+
+        size_t memory_bytes() const { return values.size() * sizeof(float); }
+
+    public:
+        shared_ptr<texture> source;
+
+    private:
+        void bake();
+        color lookup(const double c[3]) const;
+
+        // The point and texture coordinates that lattice coordinates c stand for.
+        void sample_point(const double c[3], double& u, double& v, point3& p) const;
+
+    private:
+        bool on_surface;
+        aabb box;
+        std::function<point3(double, double)> surface;
+        int size[3];
+        std::vector<float> values;
+};
+
+
+baked_texture::baked_texture(
+    shared_ptr<texture> src, const aabb& bounds, int nx, int ny, int nz
+) : source(src), on_surface(false), box(bounds), size{ nx, ny, nz } {
+    bake();
+}
+
+
+baked_texture::baked_texture(
+    shared_ptr<texture> src, int nu, int nv, std::function<point3(double, double)> point_at
+) : source(src), on_surface(true), surface(point_at), size{ nu, nv, 1 } {
+    bake();
+}
+
+
+void baked_texture::sample_point(const double c[3], double& u, double& v, point3& p) const {
+    double s[3];
+    for (int a = 0; a < 3; a++)
+        s[a] = size[a] > 1 ? c[a] / (size[a] - 1) : 0.5;
+
+    if (on_surface) {
+        u = s[0];
+        v = s[1];
+        p = surface(u, v);
+    } else {
+        u = v = 0;
+        for (int a = 0; a < 3; a++)
+            p[a] = box.min()[a] + s[a] * (box.max()[a] - box.min()[a]);
+    }
+}
+
+
+void baked_texture::bake() {
+    values.resize(static_cast<size_t>(size[0]) * size[1] * size[2] * 3);
+
+    auto out = values.data();
+    for (int k = 0; k < size[2]; k++) {
+        for (int j = 0; j < size[1]; j++) {
+            for (int i = 0; i < size[0]; i++) {
+                double c[3] = { double(i), double(j), double(k) };
+                double u, v;
+                point3 p;
+                sample_point(c, u, v, p);
+
+                auto value = source->value(u, v, p);
+                *out++ = static_cast<float>(value.x());
+                *out++ = static_cast<float>(value.y());
+                *out++ = static_cast<float>(value.z());
+            }
+        }
+    }
+}
+
+
+color baked_texture::lookup(const double c[3]) const {
+    int base[3];
+    double frac[3];
+    for (int a = 0; a < 3; a++) {
+        auto clamped = clamp(c[a], 0.0, double(size[a] - 1));
+        base[a] = std::min(static_cast<int>(clamped), std::max(size[a] - 2, 0));
+        frac[a] = clamped - base[a];
+    }
+
+    auto at = [&](int di, int dj, int dk) {
+        auto i = std::min(base[0] + di, size[0] - 1);
+        auto j = std::min(base[1] + dj, size[1] - 1);
+        auto k = std::min(base[2] + dk, size[2] - 1);
+        auto texel = &values[((static_cast<size_t>(k) * size[1] + j) * size[0] + i) * 3];
+        return color(texel[0], texel[1], texel[2]);
+    };
+
+    // A surface bake is a single layer, so only its four nearest texels take part.
+    auto depth = size[2] > 1 ? 2 : 1;
+
+    color accum(0,0,0);
+    for (int dk = 0; dk < depth; dk++) {
+        auto wk = depth > 1 ? (dk ? frac[2] : 1 - frac[2]) : 1.0;
+        for (int dj = 0; dj < 2; dj++)
+            for (int di = 0; di < 2; di++)
+                accum += wk * (dj ? frac[1] : 1 - frac[1]) * (di ? frac[0] : 1 - frac[0])
+                       * at(di, dj, dk);
+    }
+
+    return accum;
+}
+
+
+color baked_texture::value(double u, double v, const vec3& p) const {
+    double c[3];
+
+    if (on_surface) {
+        c[0] = u * (size[0] - 1);
+        c[1] = v * (size[1] - 1);
+        c[2] = 0;
+    } else {
+        for (int a = 0; a < 3; a++) {
+            auto extent = box.max()[a] - box.min()[a];
+            auto s = (p[a] - box.min()[a]) / extent;
+            if (!(s >= 0 && s <= 1))
+                return source->value(u, v, p);
+            c[a] = s * (size[a] - 1);
+        }
+    }
+
+    return lookup(c);
+}
+
+
+bake_error baked_texture::measure_error(int samples) const {
+    bake_error error;
+
+    for (int n = 0; n < samples; n++) {
+        double c[3];
+        for (int a = 0; a < 3; a++)
+            c[a] = random_double() * (size[a] - 1);
+
+        double u, v;
+        point3 p;
+        sample_point(c, u, v, p);
+
+        auto difference = value(u, v, p) - source->value(u, v, p);
+        for (int a = 0; a < 3; a++) {
+            error.mean += fabs(difference[a]);
+            error.max = fmax(error.max, fabs(difference[a]));
+        }
+    }
+
+    if (samples > 0)
+        error.mean /= 3.0 * samples;
+
+    return error;
+}
+
+
+#endif
@@ -0,0 +1,1026 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "animation.h"
+#include "baked_texture.h"
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "denoise.h"
+#include "finalize.h"
+#include "forked_render.h"
+#include "heterogeneous_medium.h"
+#include "numa.h"
+#include "render_pool.h"
+#include "scene_arena.h"
+#include "texture_cache.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+
+// The benchmarks run by --bench. They time the scenes and render functions of main.cc, which
+// includes this header after them, and report on std::cerr.
+
+
+// Starts a row of results with `label` and the time taken, followed, when `count` rays (or
+// other `unit`s) were traced, by how many million of them that is per second. The caller
+// finishes the row.
+std::ostream& print_row(
+    const std::string& label, double ms, double count = 0, const char* unit = "rays"
+) {
+    std::cerr << label << "  " << ms << " ms";
+    if (count > 0)
+        std::cerr << ", " << count / (ms * 1000) << " M" << unit << "/s";
+    return std::cerr;
+}
+
+
+void benchmark_startup() {
+    // Time scene setup with an empty BVH cache (cold) and again once the cache is populated
+    // (warm). The scenes are regenerated from the same seed so both runs hash identically.
+    auto saved_directory = bvh_cache_directory;
+    auto bench_directory = std::filesystem::path(saved_directory.empty() ? "bvh_cache" : saved_directory)
+                         / "startup_bench";
+    bvh_cache_directory = bench_directory.string();
+
+    struct bench_case {
+        const char* name;
+        std::function<hittable_list()> setup;
+    } cases[] = {
+        { "random_scene",        random_scene },
+        { "final_scene",         final_scene },
+        { "sphere_field 100x100", [] { return sphere_field(100); } },
+        { "sphere_field 400x400", [] { return sphere_field(400); } },
+    };
+
+    std::cerr << "scene                   cold (ms)   warm (ms)\n";
+    for (const auto& c : cases) {
+        std::error_code ec;
+        std::filesystem::remove_all(bench_directory, ec);
+
+        seed_random(1);
+        auto cold = time_ms([&] { c.setup(); });
+        seed_random(1);
+        auto warm = time_ms([&] { c.setup(); });
+
+        std::cerr.width(22);
+        std::cerr << std::left << c.name << std::right;
+        std::cerr.width(12);
+        std::cerr << cold;
+        std::cerr.width(12);
+        std::cerr << warm << '\n';
+    }
+
+    std::error_code ec;
+    std::filesystem::remove_all(bench_directory, ec);
+    bvh_cache_directory = saved_directory;
+}
+
+
+void benchmark_triangles() {
+    // Closest-hit rays against a large torus, with leaves tested one triangle at a time by the
+    // watertight test and four at a time by the packet kernel.
+    auto mesh = torus_mesh(1.0, 0.35, 1000, 250, nullptr);
+    mesh->print_stats(std::cerr);
+
+    const int ray_count = 500000;
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = 3.0 * random_unit_vector();
+        auto target = vec3::random(-1.2, 1.2) * vec3(1, 0.3, 1);
+        rays.push_back(ray(origin, target - origin));
+    }
+
+    for (int packets = 0; packets < 2; packets++) {
+        int hits = 0;
+        double t_sum = 0;
+        auto ms = time_ms([&] {
+            for (const auto& r : rays) {
+                size_t tri;
+                double t, b1, b2;
+                if (mesh->closest_triangle(r, 0.001, infinity, packets != 0, tri, t, b1, b2)) {
+                    hits++;
+                    t_sum += t;
+                }
+            }
+        });
+
+        print_row(packets ? "packet (4-wide)  " : "scalar watertight", ms, ray_count)
+            << ", " << hits << " hits, mean t " << (hits ? t_sum / hits : 0) << '\n';
+    }
+}
+
+
+void benchmark_transforms() {
+    // Rays against a box behind eight nested translate/rotate_y wrappers, before and after
+    // finalize_scene folds the chain into a single instance.
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    shared_ptr<hittable> chain = make_shared<box>(point3(0,0,0), point3(1,1,1), white);
+    for (int i = 0; i < 4; i++) {
+        chain = make_shared<rotate_y>(chain, 20);
+        chain = make_shared<translate>(chain, vec3(0.1, 0.2, -0.1));
+    }
+
+    aabb bounds;
+    chain->bounding_box(0, 1, bounds);
+    auto center = 0.5 * (bounds.min() + bounds.max());
+
+    const int ray_count = 1000000;
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = center + 5.0 * random_unit_vector();
+        rays.push_back(ray(origin, center + vec3::random(-0.5, 0.5) - origin));
+    }
+
+    hittable_list world(chain);
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1)
+            finalize_scene(world);
+
+        int hits = 0;
+        auto ms = time_ms([&] {
+            hit_record rec;
+            for (const auto& r : rays)
+                hits += world.hit(r, 0.001, infinity, rec);
+        });
+
+        print_row(pass ? "folded into one instance" : "8 nested wrappers       ", ms, ray_count)
+            << ", " << hits << " hits\n";
+    }
+}
+
+
+void benchmark_motion() {
+    // Rays at random shutter times through a field of fast-moving spheres, against trees that
+    // bound each sphere by its whole path and against one that follows the motion. The same
+    // spheres frozen halfway through the shutter give the static speed to aim for.
+    const int n = 100;
+    hittable_list moving, frozen;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            point3 center(a + 0.5*random_double(), 0.2, b + 0.5*random_double());
+            auto path = 3.0 * vec3(random_double(-1,1), 0, random_double(-1,1));
+            moving.add(make_shared<moving_sphere>(center, center + path, 0.0, 1.0, 0.2, nullptr));
+            frozen.add(make_shared<sphere>(center + 0.5*path, 0.2, nullptr));
+        }
+    }
+
+    const int ray_count = 500000;
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++) {
+        point3 origin(random_double(0, n), 5, random_double(0, n));
+        point3 target(random_double(0, n), 0, random_double(0, n));
+        rays.push_back(ray(origin, target - origin, random_double()));
+    }
+
+    struct bench_case {
+        const char* name;
+        shared_ptr<hittable> bvh;
+    };
+    bench_case cases[] = {
+        { "bvh_node, swept boxes   ", make_shared<bvh_node>(moving, 0, 1) },
+        { "flat_bvh, swept boxes   ", make_shared<flat_bvh>(moving, 0, 1, false) },
+        { "flat_bvh, motion bounds ", make_shared<flat_bvh>(moving, 0, 1, true) },
+        { "flat_bvh, frozen spheres", make_shared<flat_bvh>(frozen, 0, 1) },
+    };
+
+    for (const auto& c : cases) {
+        int hits = 0;
+        auto ms = time_ms([&] {
+            hit_record rec;
+            for (const auto& r : rays)
+                hits += c.bvh->hit(r, 0.001, infinity, rec);
+        });
+
+        print_row(c.name, ms, ray_count) << ", " << hits << " hits\n";
+    }
+}
+
+
+void benchmark_volumes() {
+    // Finding where rays are inside a volume boundary made of 2000 spheres under a BVH: with
+    // one interval query, and by pairing up hits from repeated closest-hit searches as
+    // constant_medium used to.
+    hittable_list blobs;
+    for (int i = 0; i < 2000; i++)
+        blobs.add(make_shared<sphere>(vec3::random(-10, 10), 0.5, nullptr));
+    auto boundary = make_shared<flat_bvh>(blobs, 0, 1);
+
+    const int ray_count = 200000;
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = 20.0 * random_unit_vector();
+        rays.push_back(ray(origin, vec3::random(-8, 8) - origin));
+    }
+
+    for (int single_pass = 0; single_pass < 2; single_pass++) {
+        int spans = 0;
+        auto ms = time_ms([&] {
+            for (const auto& r : rays) {
+                ray_intervals inside;
+                if (single_pass)
+                    boundary->intervals(r, 0.001, infinity, inside);
+                else
+                    boundary->hittable::intervals(r, 0.001, infinity, inside);
+                spans += inside.count;
+            }
+        });
+
+        print_row(single_pass ? "interval query  " : "paired hit calls", ms, ray_count)
+            << ", " << spans << " spans\n";
+    }
+}
+
+
+void benchmark_media() {
+    // Free-path sampling through a cloud with one majorant per 8^3 block of lattice cells and
+    // with a single majorant for the whole grid, and ratio-tracking transmittance checked
+    // against a finely ray-marched reference.
+    auto density = cloud_density(point3(0, 0, 0), 1, 64, 5);
+    auto boundary = make_shared<box>(density->bounds().min(), density->bounds().max(), nullptr);
+    heterogeneous_medium blocked(boundary, density, color(1, 1, 1));
+    heterogeneous_medium global(boundary, density, color(1, 1, 1), 64);
+
+    const int ray_count = 200000;
+    std::vector<ray> rays;
+    rays.reserve(ray_count);
+    for (int i = 0; i < ray_count; i++) {
+        auto origin = 3.0 * random_unit_vector();
+        rays.push_back(ray(origin, vec3::random(-0.8, 0.8) - origin));
+    }
+
+    for (const auto* medium : { &blocked, &global }) {
+        int hits = 0;
+        auto ms = time_ms([&] {
+            hit_record rec;
+            for (const auto& r : rays)
+                hits += medium->hit(r, 0.001, infinity, rec);
+        });
+
+        print_row(medium == &blocked ? "delta tracking, 8^3 majorant blocks"
+                                     : "delta tracking, one majorant      ", ms, ray_count)
+            << ", " << hits << " scattered\n";
+    }
+
+    const int check_rays = 200;
+    const int estimates = 1000;
+    double worst_error = 0;
+    auto ms = time_ms([&] {
+        for (int i = 0; i < check_rays; i++) {
+            const auto& r = rays[i];
+            double sum = 0;
+            for (int e = 0; e < estimates; e++)
+                sum += blocked.transmittance(r, 0.001, infinity);
+
+            // Reference: integrate the density along the part of the ray inside the grid.
+            double t0 = 0.001, t1 = infinity, optical_depth = 0;
+            if (density->bounds().clip(r, t0, t1)) {
+                const int steps = 4000;
+                auto dt = (t1 - t0) / steps;
+                for (int s = 0; s < steps; s++)
+                    optical_depth += density->density(r.at(t0 + (s + 0.5)*dt)) * dt;
+                optical_depth *= r.direction().length();
+            }
+
+            worst_error = fmax(worst_error, fabs(sum / estimates - exp(-optical_depth)));
+        }
+    });
+
+    std::cerr << "ratio tracking: " << check_rays << " rays x " << estimates << " estimates in "
+              << ms << " ms, largest error against ray marching " << worst_error << '\n';
+}
+
+
+void benchmark_perlin() {
+    // Seven-octave turbulence as noise_texture uses it: one octave at a time in double
+    // precision, four octaves at a time, and four points at a time through the batch call.
+    perlin noise;
+
+    const int point_count = 1000000;
+    std::vector<point3> points(point_count);
+    for (auto& p : points)
+        p = point3::random(-50, 50);
+
+    std::vector<double> reference(point_count), result(point_count);
+    auto scalar_ms = time_ms([&] {
+        for (int i = 0; i < point_count; i++)
+            reference[i] = noise.turb_scalar(points[i]);
+    });
+
+    auto report = [&](const char* name, double ms) {
+        double worst = 0;
+        for (int i = 0; i < point_count; i++)
+            worst = fmax(worst, fabs(result[i] - reference[i]));
+        print_row(name, ms, point_count, "points")
+            << ", " << scalar_ms / ms << "x, largest difference " << worst << '\n';
+    };
+
+    result = reference;
+    report("one octave at a time", scalar_ms);
+
+    report("octaves 4-wide      ", time_ms([&] {
+        for (int i = 0; i < point_count; i++)
+            result[i] = noise.turb(points[i]);
+    }));
+
+    report("batch of points     ", time_ms([&] {
+        noise.turb_batch(points.data(), result.data(), points.size());
+    }));
+}
+
+
+void benchmark_textures() {
+    // Shading lookups on the small sphere of two_perlin_spheres and two_spheres, analytic and
+    // baked onto the sphere's (u, v) square at a few resolutions.
+    const point3 center(0,2,0);
+    const double radius = 2;
+    auto surface = [=](double u, double v) {
+        return center + radius * sphere::sphere_point(u, v);
+    };
+
+    const int lookup_count = 1000000;
+    struct lookup { double u, v; point3 p; };
+    std::vector<lookup> lookups(lookup_count);
+    for (auto& l : lookups) {
+        l.u = random_double();
+        l.v = random_double();
+        l.p = surface(l.u, l.v);
+    }
+
+    auto time_lookups = [&](const texture& tex) {
+        color sum(0,0,0);
+        auto ms = time_ms([&] {
+            for (const auto& l : lookups)
+                sum += tex.value(l.u, l.v, l.p);
+        });
+        // Keeps the loop from being optimised away.
+        if (sum.x() < 0)
+            std::cerr << sum << '\n';
+        return ms;
+    };
+
+    auto run = [&](const char* name, shared_ptr<texture> source) {
+        auto analytic_ms = time_lookups(*source);
+        std::cerr << name << " analytic     " << analytic_ms << " ms\n";
+
+        for (int resolution : { 256, 512, 1024 }) {
+            shared_ptr<baked_texture> baked;
+            auto bake_ms = time_ms([&] {
+                baked = make_shared<baked_texture>(source, 2*resolution, resolution, surface);
+            });
+            auto ms = time_lookups(*baked);
+            auto error = baked->measure_error(100000);
+
+            print_row(std::string(name) + " baked " + std::to_string(resolution), ms)
+                      << ", " << analytic_ms / ms << "x, bake " << bake_ms << " ms, "
+                      << baked->memory_bytes() / 1024 << " KiB, mean error " << error.mean
+                      << ", largest " << error.max << '\n';
+        }
+    };
+
+    run("noise  ", make_shared<noise_texture>(4));
+    run("checker", make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)));
+}
+
+
+void benchmark_mipmap() {
+    // A distant sphere wrapped in a 2048x1024 image of fine detail, rendered as bare albedo.
+    // Each pixel is compared against a heavily supersampled reference, with and without the
+    // ray footprint selecting a mip level.
+    const int tex_width = 2048, tex_height = 1024;
+    std::vector<unsigned char> pixels(size_t(tex_width) * tex_height * 3);
+    for (int j = 0; j < tex_height; j++) {
+        for (int i = 0; i < tex_width; i++) {
+            auto pixel = &pixels[(size_t(j) * tex_width + i) * 3];
+            bool odd = ((i / 2) + (j / 2)) % 2;
+            pixel[0] = odd ? 230 : 20;
+            pixel[1] = static_cast<unsigned char>(255 * random_double());
+            pixel[2] = (i % 7 < 2) ? 255 : 0;
+        }
+    }
+
+    image_texture tex(pixels.data(), tex_width, tex_height);
+    sphere globe(point3(0,0,0), 2, nullptr);
+
+    const int image_size = 128;
+    camera cam(point3(0,0,60), point3(0,0,0), vec3(0,1,0), 5, 1.0, 0.0, 60);
+    cam.set_image_height(image_size);
+
+    auto render = [&](int samples, bool filtered) {
+        std::vector<color> image(image_size * image_size);
+        for (int j = 0; j < image_size; j++) {
+            for (int i = 0; i < image_size; i++) {
+                color sum(0,0,0);
+                for (int s = 0; s < samples; s++) {
+                    auto r = cam.get_ray((i + random_double()) / (image_size - 1),
+                                         (j + random_double()) / (image_size - 1));
+                    hit_record rec;
+                    if (!globe.hit(r, 0.001, infinity, rec))
+                        continue;
+                    rec.finalize(r);
+
+                    double du = 0, dv = 0;
+                    if (filtered)
+                        rec.footprint(r, du, dv);
+                    sum += tex.filtered_value(rec.u, rec.v, rec.p, du, dv);
+                }
+                image[j * image_size + i] = sum / samples;
+            }
+        }
+        return image;
+    };
+
+    auto reference = render(256, false);
+
+    std::cerr << tex.level_count() << " mip levels\n";
+    for (int samples : { 1, 4, 16 }) {
+        for (bool filtered : { false, true }) {
+            std::vector<color> image;
+            auto ms = time_ms([&] { image = render(samples, filtered); });
+
+            double squared = 0;
+            for (size_t k = 0; k < image.size(); k++)
+                squared += (image[k] - reference[k]).length_squared() / 3;
+
+            std::cerr << (filtered ? "mipmapped " : "top level ") << samples << " spp  "
+                      << ms << " ms, rms error against 256 spp " << sqrt(squared / image.size())
+                      << '\n';
+        }
+    }
+}
+
+
+void benchmark_texture_cache() {
+    // Loads a 4096x2048 image by decoding it, through the texture cache when the converted
+    // file still has to be written (cold) and when it is already there (warm), and again by
+    // name once it is registered.
+    auto saved_directory = texture_cache_directory;
+    auto bench_directory = std::filesystem::path(
+        saved_directory.empty() ? "texture_cache" : saved_directory) / "texture_bench";
+    texture_cache_directory = bench_directory.string();
+
+    std::error_code ec;
+    std::filesystem::remove_all(bench_directory, ec);
+    std::filesystem::create_directories(bench_directory, ec);
+
+    const int width = 4096, height = 2048;
+    auto image_name = (bench_directory / "bench.ppm").string();
+    {
+        std::ofstream out(image_name, std::ios::binary);
+        out << "P6\n" << width << ' ' << height << "\n255\n";
+        std::vector<unsigned char> row(width * 3);
+        for (int j = 0; j < height; j++) {
+            for (auto& byte : row)
+                byte = static_cast<unsigned char>(random_int(0, 255));
+            out.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+    }
+
+    auto decode_ms = time_ms([&] { image_texture tex(image_name.c_str()); });
+
+    shared_ptr<image_texture> first, second;
+    auto cold_ms = time_ms([&] { first = load_image_texture(image_name); });
+
+    auto hash = texture_source_hash(image_name);
+    auto warm_ms = time_ms([&] { read_texture_cache(texture_cache_filename(hash), hash); });
+    auto shared_ms = time_ms([&] { second = load_image_texture(image_name); });
+
+    std::cerr << "decode and build pyramid  " << decode_ms << " ms\n"
+              << "cold cache (and write)    " << cold_ms << " ms\n"
+              << "warm cache (map)          " << warm_ms << " ms\n"
+              << "already loaded            " << shared_ms << " ms, "
+              << (first == second ? "same texture" : "different textures") << '\n'
+              << "cache file " << std::filesystem::file_size(texture_cache_filename(hash), ec)
+              / (1024*1024) << " MiB\n";
+
+    first.reset();
+    second.reset();
+    std::filesystem::remove_all(bench_directory, ec);
+    texture_cache_directory = saved_directory;
+}
+
+
+void benchmark_texture_batch() {
+    // 1M shading points on a sphere of radius 2, looked up one virtual call at a time and in
+    // batches of 64 through value_batch.
+    const size_t point_count = 1 << 20;
+    const size_t batch_size = 64;
+
+    std::vector<double> u(point_count), v(point_count), x(point_count), y(point_count),
+                        z(point_count);
+    for (size_t i = 0; i < point_count; i++) {
+        u[i] = random_double();
+        v[i] = random_double();
+        auto p = 2.0 * sphere::sphere_point(u[i], v[i]);
+        x[i] = p.x();  y[i] = p.y();  z[i] = p.z();
+    }
+
+    std::vector<unsigned char> pixels(512 * 256 * 3);
+    for (auto& byte : pixels)
+        byte = static_cast<unsigned char>(random_int(0, 255));
+
+    struct bench_case {
+        const char* name;
+        shared_ptr<texture> tex;
+    } cases[] = {
+        { "solid_color    ", make_shared<solid_color>(0.2, 0.4, 0.6) },
+        { "checker_texture", make_shared<checker_texture>(
+              color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9)) },
+        { "noise_texture  ", make_shared<noise_texture>(4) },
+        { "image_texture  ", make_shared<image_texture>(pixels.data(), 512, 256) },
+        { "baked fallback ", make_shared<baked_texture>(make_shared<noise_texture>(4), 512, 256,
+              [](double u, double v) { return 2.0 * sphere::sphere_point(u, v); }) },
+    };
+
+    std::vector<double> r(point_count), g(point_count), b(point_count);
+    for (const auto& c : cases) {
+        const texture& tex = *c.tex;
+        std::vector<color> reference(point_count);
+
+        auto single_ms = time_ms([&] {
+            for (size_t i = 0; i < point_count; i++)
+                reference[i] = tex.value(u[i], v[i], point3(x[i], y[i], z[i]));
+        });
+
+        auto batch_ms = time_ms([&] {
+            for (size_t start = 0; start < point_count; start += batch_size) {
+                texture_query q;
+                q.count = std::min(batch_size, point_count - start);
+                q.u = &u[start];  q.v = &v[start];
+                q.x = &x[start];  q.y = &y[start];  q.z = &z[start];
+                tex.value_batch(q, &r[start], &g[start], &b[start]);
+            }
+        });
+
+        double worst = 0;
+        for (size_t i = 0; i < point_count; i++)
+            worst = fmax(worst, (color(r[i], g[i], b[i]) - reference[i]).length());
+
+        std::cerr << c.name << "  one at a time " << single_ms << " ms, batched " << batch_ms
+                  << " ms, " << single_ms / batch_ms << "x, largest difference " << worst << '\n';
+    }
+}
+
+
+void benchmark_denoise() {
+    // The Cornell box at a few samples per pixel, compared against a long render before and
+    // after filtering. Values are clamped to the displayable range first, so that the light
+    // does not dominate the error.
+    const int image_size = 100;
+    auto world = cornell_box();
+    finalize_scene(world);
+
+    camera cam(point3(278, 278, -800), point3(278, 278, 0), vec3(0,1,0), 40.0, 1.0, 0.0, 10.0,
+               0.0, 1.0);
+    cam.set_image_height(image_size);
+    const color background(0,0,0);
+
+    auto reference = render(world, cam, background, image_size, image_size, 512, 50,
+                            false);
+
+    auto rms_error = [&](const framebuffer& image) {
+        double squared = 0;
+        for (size_t k = 0; k < image.radiance.size(); k++)
+            for (int c = 0; c < 3; c++) {
+                auto d = clamp(image.radiance[k][c], 0.0, 1.0)
+                       - clamp(reference.radiance[k][c], 0.0, 1.0);
+                squared += d*d / 3;
+            }
+        return sqrt(squared / image.radiance.size());
+    };
+
+    for (int samples : { 4, 8, 16 }) {
+        auto image = render(world, cam, background, image_size, image_size, samples, 50,
+                            false, true);
+        auto noisy = rms_error(image);
+        auto ms = time_ms([&] { denoise(image); });
+
+        std::cerr << samples << " spp  rms error against 512 spp " << noisy << ", denoised "
+                  << rms_error(image) << " (" << ms << " ms)\n";
+    }
+}
+
+
+void benchmark_fork() {
+    // The same render through threads sharing one address space and through forked processes
+    // sharing only the framebuffer. Both give each pixel its own random sequence, so the
+    // images must agree exactly.
+    auto world = random_scene();
+    finalize_scene(world);
+
+    const int image_width = 200, image_height = 112, samples = 8, max_depth = 50;
+    camera cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20.0, 16.0 / 9.0, 0.1, 10.0, 0.0, 1.0);
+    cam.set_image_height(image_height);
+    const color background(0.70, 0.80, 1.00);
+
+    accumulation_buffer threaded(image_width, image_height, render_seed);
+    auto threaded_ms = time_ms([&] {
+        render_progressive(world, cam, background, max_depth, samples, threaded, {}, false);
+    });
+
+    const int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    print_row("threads    " + std::to_string(cores), threaded_ms) << '\n';
+
+    for (int processes : { 1, cores, 2 * cores }) {
+        accumulation_buffer forked(image_width, image_height, render_seed);
+        auto render_band = [&](int row_begin, int row_end, accumulation_buffer& band_sums) {
+            std::atomic<int> rows_remaining = row_end - row_begin;
+            render_rows(world, cam, background, max_depth, samples, samples, row_begin, row_end,
+                        band_sums, rows_remaining);
+        };
+        auto forked_ms = time_ms([&] { render_forked(forked, processes, 8, render_band); });
+
+        size_t differences = 0;
+        for (size_t i = 0; i < forked.pixels.size(); i++)
+            differences += std::memcmp(&forked.pixels[i], &threaded.pixels[i],
+                                       sizeof(pixel_sums)) != 0;
+
+        print_row("processes  " + std::to_string(processes), forked_ms)
+            << ", " << differences << " pixels differ from the threaded render\n";
+    }
+}
+
+void benchmark_numa() {
+    // The same render with threads kept to the first node, then spread over every node, and
+    // then spread with a copy of the top-level BVH on each node. Each pinned run has its
+    // threads set up their own rows of the framebuffer first. The images must agree exactly.
+    auto topology = numa_topology::detect();
+    std::cerr << topology.node_count() << " NUMA nodes:";
+    for (int node = 0; node < topology.node_count(); node++)
+        std::cerr << "  node " << node << ": " << topology.node_cpus[node].size() << " CPUs";
+    std::cerr << '\n';
+    if (topology.node_count() == 1)
+        std::cerr << "(with one node, the runs below differ only in pinning)\n";
+
+    auto world = random_scene();
+    finalize_scene(world);
+
+    const int image_width = 200, image_height = 112, samples = 8, max_depth = 50;
+    camera cam(point3(13,2,3), point3(0,0,0), vec3(0,1,0), 20.0, 16.0 / 9.0, 0.1, 10.0, 0.0, 1.0);
+    cam.set_image_height(image_height);
+    const color background(0.70, 0.80, 1.00);
+
+    accumulation_buffer unpinned(image_width, image_height, render_seed);
+    auto unpinned_ms = time_ms([&] {
+        render_progressive(world, cam, background, max_depth, samples, unpinned, {}, false);
+    });
+    print_row("unpinned          ", unpinned_ms) << '\n';
+
+    struct variant { const char* name; int node_limit; bool replicate; };
+    for (auto v : { variant{"first node only    ", 1, false},
+                    variant{"spread over nodes  ", topology.node_count(), false},
+                    variant{"spread, replicated ", topology.node_count(), true} }) {
+        auto thread_count = v.node_limit == 1
+            ? static_cast<int>(topology.node_cpus[0].size()) : topology.cpu_count();
+        auto placement = thread_placement::make(topology, thread_count, v.node_limit, true);
+        if (v.replicate)
+            replicate_scene_per_node(placement, world);
+
+        accumulation_buffer pinned(image_width, image_height, render_seed, false);
+        auto pinned_ms = time_ms([&] {
+            render_pool pool(&placement);
+            pool.for_rows(0, image_height, [&](int, int start, int end) {
+                pinned.initialize_rows(start, end);
+            });
+            render_progressive(world, cam, background, max_depth, samples, pinned, {}, false,
+                               &pool);
+        });
+
+        size_t differences = 0;
+        for (size_t i = 0; i < pinned.pixels.size(); i++)
+            differences += std::memcmp(&pinned.pixels[i], &unpinned.pixels[i],
+                                       sizeof(pixel_sums)) != 0;
+
+        std::cerr << v.name << " " << pinned_ms << " ms with " << thread_count << " threads, "
+                  << differences << " pixels differ from the unpinned render\n";
+    }
+}
+
+void benchmark_arena() {
+    // Builds, renders and destroys each scene with its objects on the heap, in a scene arena,
+    // and in an arena on huge pages. The scenes are built from the same random numbers and
+    // without the BVH cache, so that all three are the same.
+    auto saved_directory = bvh_cache_directory;
+    bvh_cache_directory.clear();
+
+    struct bench_case {
+        const char* name;
+        std::function<hittable_list()> build;
+        point3 lookfrom, lookat;
+        double vfov;
+    } cases[] = {
+        { "random_scene     ", random_scene, point3(13,2,3), point3(0,0,0), 20 },
+        { "final_scene      ", final_scene, point3(478,278,-600), point3(278,278,0), 40 },
+        { "sphere_field(300)", [] { return sphere_field(300); }, point3(150,30,-40),
+          point3(150,0,150), 40 },
+    };
+
+    struct variant { const char* name; bool arena; bool huge_pages; } variants[] = {
+        { "heap       ", false, false },
+        { "arena      ", true, false },
+        { "huge pages ", true, true },
+    };
+
+    const int image_width = 200, image_height = 112, samples = 4, max_depth = 50;
+    const color background(0.70, 0.80, 1.00);
+
+    for (const auto& c : cases) {
+        camera cam(c.lookfrom, c.lookat, vec3(0,1,0), c.vfov, 16.0 / 9.0, 0.0, 10.0, 0.0, 1.0);
+        cam.set_image_height(image_height);
+
+        for (const auto& v : variants) {
+            auto arena = v.arena ? make_shared<scene_arena>(v.huge_pages) : nullptr;
+            std::unique_ptr<hittable_list> world;
+
+            seed_random(7);
+            auto build_ms = time_ms([&] {
+                scene_arena_scope scope(arena);
+                world = std::make_unique<hittable_list>(c.build());
+                finalize_scene(*world);
+            });
+
+            auto reserved = arena ? arena->bytes_reserved() : 0;
+            arena.reset();
+
+            auto render_ms = time_ms([&] {
+                render(*world, cam, background, image_width, image_height, samples, max_depth,
+                       false);
+            });
+            auto teardown_ms = time_ms([&] { world.reset(); });
+
+            std::cerr << c.name << "  " << v.name << " build " << std::setw(8) << build_ms
+                      << " ms  render " << std::setw(8) << render_ms << " ms  teardown "
+                      << std::setw(7) << teardown_ms << " ms";
+            if (reserved > 0)
+                std::cerr << "  (" << reserved / 1024 << " KiB of arena)";
+            std::cerr << '\n';
+        }
+    }
+
+    bvh_cache_directory = saved_directory;
+}
+
+
+void benchmark_refit() {
+    // 20000 spheres drifting in random directions, followed over 30 frames by refitting the
+    // tree built for the first frame, against building a new tree for every frame. Each frame
+    // also checks that the refitted tree finds the same hits as the new one, and shows when
+    // the updater would rebuild.
+    hittable_list spheres;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int i = 0; i < 20000; i++) {
+        auto center = point3::random(-50, 50);
+        spheres.add(make_shared<moving_sphere>(center, center + vec3::random(-2, 2), 0.0, 1.0,
+                                               0.3, mat));
+    }
+
+    const int frames = 30;
+    const double frame_time = 0.25;
+    const int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    for (bool track_motion : { false, true }) {
+        std::cerr << (track_motion ? "motion nodes\n" : "swept boxes\n")
+                  << "frame  refit ms  rebuild ms  cost ratio  misses  updater\n";
+
+        auto refitted = make_shared<flat_bvh>(spheres, 0.0, frame_time, track_motion);
+        flat_bvh monitored(spheres, 0.0, frame_time, track_motion);
+        flat_bvh_updater updater;
+        double total_refit_ms = 0, total_build_ms = 0;
+
+        for (int frame = 1; frame < frames; frame++) {
+            auto time0 = frame * frame_time, time1 = time0 + frame_time;
+
+            auto refit_ms = time_ms([&] { refitted->refit(time0, time1, cores); });
+            shared_ptr<flat_bvh> built;
+            auto build_ms = time_ms([&] {
+                built = make_shared<flat_bvh>(spheres, time0, time1, track_motion);
+            });
+            total_refit_ms += refit_ms;
+            total_build_ms += build_ms;
+            bool rebuilt = updater.update(monitored, time0, time1);
+
+            int misses = 0;
+            for (int i = 0; i < 2000; i++) {
+                ray r(point3::random(-60, 60), random_unit_vector(), random_double(time0, time1));
+                hit_record a, b;
+                bool hit_a = refitted->hit(r, 0.001, infinity, a);
+                bool hit_b = built->hit(r, 0.001, infinity, b);
+                misses += hit_a != hit_b || (hit_a && a.t != b.t);
+            }
+
+            if (frame % 5 == 0 || rebuilt)
+                std::cerr << std::setw(5) << frame << std::setw(10) << refit_ms
+                          << std::setw(12) << build_ms
+                          << std::setw(12) << refitted->sah_cost() / built->sah_cost()
+                          << std::setw(8) << misses << "  " << (rebuilt ? "rebuilt" : "") << '\n';
+        }
+
+        std::cerr << "refits take " << 100 * total_refit_ms / total_build_ms << "% of the time "
+                  << "of rebuilds; the updater made " << updater.rebuilds << " rebuilds in "
+                  << updater.refits << " updates\n";
+    }
+}
+
+
+void benchmark_animation() {
+    // Eight frames of an orbit around random_scene, rendered as separate runs used to be, with
+    // the scene set up, threads started and each frame written before the next is begun, and
+    // then as one animation. Set-up is helped by the BVH cache in both.
+    camera_path path;
+    for (int i = 0; i <= 4; i++) {
+        auto angle = i * pi / 8;
+        path.keys.push_back({ 2.0 * i, point3(13*cos(angle), 2, 13*sin(angle)), point3(0,0,0),
+                              20.0 });
+    }
+
+    const int first_frame = 0, last_frame = 7, samples = 4;
+    auto directory = std::filesystem::temp_directory_path() / "rt_animation_bench";
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    auto prefix = (directory / "frame").string();
+
+    auto separate_ms = time_ms([&] {
+        for (int frame = first_frame; frame <= last_frame; frame++) {
+            auto setup = select_scene(1);
+            finalize_scene(setup.world);
+            setup.image_width = 200;
+            auto key = path.at(frame);
+            setup.lookfrom = key.lookfrom;
+            setup.lookat = key.lookat;
+            auto cam = setup.make_camera(setup.image_height());
+            auto image = render(setup.world, cam, setup.background, setup.image_width,
+                                setup.image_height(), samples, setup.max_depth, false);
+            std::ofstream out(frame_filename(prefix, frame), std::ios::binary);
+            image.write_ppm(out);
+        }
+    });
+
+    auto animation_ms = time_ms([&] {
+        auto setup = select_scene(1);
+        finalize_scene(setup.world);
+        setup.image_width = 200;
+        render_pool pool;
+        render_animation(setup, path, first_frame, last_frame, samples, prefix, false, pool,
+                         false);
+    });
+
+    const int frames = last_frame - first_frame + 1;
+    std::cerr << "separate runs  " << separate_ms << " ms, "
+              << 1000.0 * frames / separate_ms << " frames per second\n"
+              << "animation      " << animation_ms << " ms, "
+              << 1000.0 * frames / animation_ms << " frames per second\n";
+
+    std::filesystem::remove_all(directory, ec);
+}
+
+
+void benchmark_shadow() {
+    // Shadow rays from the first surface behind each pixel to random points in the scene's
+    // bounds, answered by closest-hit queries, with the hit finished as a shading point would
+    // be, and by occlusion queries that stop at the first blocker. random_scene is also
+    // searched through a tree of bvh_node, as it is before finalize_scene. Media sample their
+    // own free paths, so the two queries only agree on scenes without them.
+    struct bench_case {
+        const char* name;
+        int scene;
+        bool finalize;
+        bool has_media;
+    } cases[] = {
+        { "random_scene, bvh_node   ", 1, false, false },
+        { "random_scene             ", 1, true, false },
+        { "cornell_box              ", 6, true, false },
+        { "final_scene              ", 8, true, true },
+        { "instanced_clusters       ", 10, true, false },
+    };
+
+    const int image_width = 200, per_pixel = 4;
+
+    for (const auto& c : cases) {
+        seed_random(7);
+        auto setup = select_scene(c.scene);
+        if (c.finalize) {
+            finalize_scene(setup.world);
+        } else {
+            auto tree = make_shared<bvh_node>(setup.world, 0.0, 1.0);
+            setup.world = hittable_list(tree);
+        }
+        const auto& world = setup.world;
+
+        aabb bounds;
+        world.bounding_box(0.0, 1.0, bounds);
+
+        setup.image_width = image_width;
+        auto image_height = setup.image_height();
+        auto cam = setup.make_camera(image_height);
+
+        std::vector<ray> rays;
+        for (int j = 0; j < image_height; j++) {
+            for (int i = 0; i < image_width; i++) {
+                hit_record rec;
+                auto r = cam.get_ray((i + 0.5) / (image_width-1), (j + 0.5) / (image_height-1));
+                if (!world.hit(r, 0.001, infinity, rec))
+                    continue;
+
+                // Each segment runs from the shading point (t = 0) to its target (t = 1).
+                auto p = r.at(rec.t);
+                for (int k = 0; k < per_pixel; k++) {
+                    point3 target(random_double(bounds.min().x(), bounds.max().x()),
+                                  random_double(bounds.min().y(), bounds.max().y()),
+                                  random_double(bounds.min().z(), bounds.max().z()));
+                    rays.push_back(ray(p, target - p, r.time()));
+                }
+            }
+        }
+
+        std::vector<char> closest_blocked(rays.size()), any_blocked(rays.size());
+        auto closest_ms = time_ms([&] {
+            hit_record rec;
+            for (size_t i = 0; i < rays.size(); i++) {
+                closest_blocked[i] = world.hit(rays[i], 0.001, 0.999, rec);
+                if (closest_blocked[i])
+                    rec.finalize(rays[i]);
+            }
+        });
+        auto any_ms = time_ms([&] {
+            for (size_t i = 0; i < rays.size(); i++)
+                any_blocked[i] = world.occluded(rays[i], 0.001, 0.999);
+        });
+
+        size_t blocked = 0, disagree = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            blocked += any_blocked[i];
+            disagree += closest_blocked[i] != any_blocked[i];
+        }
+
+        std::cerr << c.name << "  " << rays.size() << " rays, " << std::setprecision(3)
+                  << 100.0 * blocked / rays.size() << "% blocked\n"
+                  << "    closest hit  " << std::setw(8) << closest_ms << " ms, "
+                  << std::setw(6) << rays.size() / (closest_ms * 1000) << " Mrays/s\n"
+                  << "    occluded     " << std::setw(8) << any_ms << " ms, "
+                  << std::setw(6) << rays.size() / (any_ms * 1000) << " Mrays/s  ("
+                  << closest_ms / any_ms << "x)";
+        if (c.has_media)
+            std::cerr << "  media, not compared\n";
+        else
+            std::cerr << "  " << disagree << " disagree\n";
+        std::cerr << std::setprecision(6);
+    }
+}
+
+
+// Runs the benchmark called `name`. Returns false if there is no such benchmark.
+bool run_benchmark(const std::string& name) {
+    static const struct {
+        const char* name;
+        void (*run)();
+    } benchmarks[] = {
+        { "startup",       benchmark_startup },
+        { "triangles",     benchmark_triangles },
+        { "transforms",    benchmark_transforms },
+        { "motion",        benchmark_motion },
+        { "volumes",       benchmark_volumes },
+        { "media",         benchmark_media },
+        { "perlin",        benchmark_perlin },
+        { "textures",      benchmark_textures },
+        { "mipmap",        benchmark_mipmap },
+        { "texture-cache", benchmark_texture_cache },
+        { "texture-batch", benchmark_texture_batch },
+        { "denoise",       benchmark_denoise },
+        { "fork",          benchmark_fork },
+        { "numa",          benchmark_numa },
+        { "animation",     benchmark_animation },
+        { "refit",         benchmark_refit },
+        { "arena",         benchmark_arena },
+        { "shadow",        benchmark_shadow },
+    };
+
+    for (const auto& benchmark : benchmarks) {
+        if (name == benchmark.name) {
+            benchmark.run();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+#endif
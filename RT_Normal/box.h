@@ -15,6 +15,7 @@
 
 #include "aarect.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 
 
 class box : public hittable  {
@@ -24,11 +25,24 @@ class box : public hittable  {
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return sides.occluded(r, t_min, t_max);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = aabb(box_min, box_max);
             return true;
         }
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override {
+            // The inside of the box is exactly the slab intersection.
+            if (!aabb(box_min, box_max).clip(r, t_min, t_max))
+                return false;
+            out.add(t_min, t_max);
+            return true;
+        }
+
     public:
         point3 box_min;
         point3 box_max;
@@ -40,14 +54,14 @@ box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
     box_min = p0;
     box_max = p1;
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    sides.add(arena_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
+    sides.add(arena_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+    sides.add(arena_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
+    sides.add(arena_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    sides.add(arena_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
+    sides.add(arena_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
 }
 
 bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
@@ -15,6 +15,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 
 #include <algorithm>
 
@@ -34,8 +35,13 @@ class bvh_node : public hittable  {
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
     public:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
@@ -94,8 +100,8 @@ bvh_node::bvh_node(
         std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
         auto mid = start + object_span/2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+        left = arena_shared<bvh_node>(objects, start, mid, time0, time1);
+        right = arena_shared<bvh_node>(objects, mid, end, time0, time1);
     }
 
     aabb box_left, box_right;
@@ -120,6 +126,27 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    // Any hit will do, so the right subtree is only searched if the left one is clear.
+    return left->occluded(r, t_min, t_max)
+        || (right != left && right->occluded(r, t_min, t_max));
+}
+
+
+bool bvh_node::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    bool in_left = left->intervals(r, t_min, t_max, out);
+    bool in_right = right != left && right->intervals(r, t_min, t_max, out);
+
+    return in_left || in_right;
+}
+
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
     output_box = box;
     return true;
@@ -0,0 +1,248 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "mapped_file.h"
+#include "scene_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+
+// Directory holding the cached acceleration structures. An empty string disables the cache.
+inline std::string bvh_cache_directory = "bvh_cache";
+
+
+// Layout of a cache file: this header, the node array at node_offset and the leaf order (one
+// uint32_t per primitive, repeated for each time segment) at order_offset. With segment_count
+// 0 the nodes are flat_bvh_nodes, otherwise they are flat_bvh_motion_nodes. Everything is
+// stored in native byte order.
+struct bvh_cache_header {
+    char magic[8];
+    uint64_t scene_hash;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t primitive_count;
+    uint32_t node_offset;
+    uint32_t order_offset;
+    uint32_t segment_count;
+    uint32_t pad[6];
+};
+
+static_assert(sizeof(bvh_cache_header) == 64, "nodes following the header stay aligned");
+
+const char bvh_cache_magic[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 0, 1 };
+const uint32_t bvh_cache_version = 3;
+
+
+class scene_hasher {
+    public:
+        void add(const void* data, size_t size) {
+            // 64-bit FNV-1a
+            auto bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; i++) {
+                value ^= bytes[i];
+                value *= 0x100000001b3ull;
+            }
+        }
+
+        void add(double x) { add(&x, sizeof(x)); }
+        void add(uint64_t x) { add(&x, sizeof(x)); }
+        void add(const char* s) { add(s, std::strlen(s)); }
+
+        uint64_t result() const { return value; }
+
+    private:
+        uint64_t value = 0xcbf29ce484222325ull;
+};
+
+
+// Hashes what the BVH builder sees of a scene: the type of every object and its bounds over
+// the shutter interval, at either end of it and halfway through. Two scenes with the same hash
+// produce the same tree.
+uint64_t scene_hash(const std::vector<shared_ptr<hittable>>& objects, double time0, double time1) {
+    scene_hasher h;
+    h.add(static_cast<uint64_t>(bvh_cache_version));
+    h.add(static_cast<uint64_t>(objects.size()));
+    h.add(time0);
+    h.add(time1);
+
+    auto add_box = [&](const hittable& object, double t0, double t1) {
+        aabb box;
+        object.bounding_box(t0, t1, box);
+        for (int a = 0; a < 3; a++) {
+            h.add(box.min()[a]);
+            h.add(box.max()[a]);
+        }
+    };
+
+    auto time_mid = 0.5 * (time0 + time1);
+    for (const auto& object : objects) {
+        h.add(typeid(*object).name());
+        add_box(*object, time0, time1);
+        add_box(*object, time0, time0);
+        add_box(*object, time1, time1);
+        add_box(*object, time_mid, time_mid);
+    }
+
+    return h.result();
+}
+
+
+std::string bvh_cache_filename(uint64_t hash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(hash));
+    return (std::filesystem::path(bvh_cache_directory) / name).string();
+}
+
+
+bool write_bvh_cache(const std::string& filename, const flat_bvh& bvh, uint64_t hash) {
+    bvh_cache_header header = {};
+    std::memcpy(header.magic, bvh_cache_magic, sizeof(header.magic));
+    header.scene_hash = hash;
+    header.version = bvh_cache_version;
+    header.node_count = static_cast<uint32_t>(bvh.node_count());
+    header.segment_count = static_cast<uint32_t>(bvh.segment_count());
+    header.primitive_count = static_cast<uint32_t>(
+        bvh.source_index.size() / std::max(header.segment_count, 1u));
+    header.node_offset = sizeof(bvh_cache_header);
+    header.order_offset = header.node_offset + header.node_count * sizeof(flat_bvh_node);
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), ec);
+
+    return write_file_atomically(filename, [&](std::ofstream& out) {
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (bvh.node_data())
+            out.write(reinterpret_cast<const char*>(bvh.node_data()),
+                      header.node_count * sizeof(flat_bvh_node));
+        else
+            out.write(reinterpret_cast<const char*>(bvh.motion_node_data()),
+                      header.node_count * sizeof(flat_bvh_motion_node));
+        out.write(reinterpret_cast<const char*>(bvh.source_index.data()),
+                  bvh.source_index.size() * sizeof(uint32_t));
+    });
+}
+
+
+// Maps a cache file and checks that it describes a valid tree over `objects`. Returns null
+// if the file is missing, stale or damaged.
+shared_ptr<flat_bvh> read_bvh_cache(
+    const std::string& filename, const std::vector<shared_ptr<hittable>>& objects, uint64_t hash,
+    double time0, double time1
+) {
+    auto file = make_shared<mapped_file>(filename.c_str());
+    if (!file->valid() || file->size() < sizeof(bvh_cache_header))
+        return nullptr;
+
+    bvh_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    uint64_t order_length = uint64_t(std::max(header.segment_count, 1u)) * header.primitive_count;
+
+    if (std::memcmp(header.magic, bvh_cache_magic, sizeof(header.magic)) != 0
+        || header.version != bvh_cache_version
+        || header.scene_hash != hash
+        || header.primitive_count != objects.size()
+        || header.segment_count > static_cast<uint32_t>(flat_bvh_max_segments)
+        || header.node_count == 0
+        || header.node_offset % alignof(flat_bvh_node) != 0
+        || header.order_offset != header.node_offset + header.node_count * sizeof(flat_bvh_node)
+        || file->size() < header.order_offset + order_length * sizeof(uint32_t))
+        return nullptr;
+
+    auto order = reinterpret_cast<const uint32_t*>(file->data() + header.order_offset);
+    for (uint64_t i = 0; i < order_length; i++)
+        if (order[i] >= header.primitive_count)
+            return nullptr;
+
+    // Both node types share the layout of the links checked here. Children always come after
+    // their parent, so depths can be found in one pass; no tree may be deeper than a built one,
+    // which traversal's fixed stack relies on.
+    auto valid_nodes = [&](const auto* nodes) {
+        std::vector<uint8_t> depth(header.node_count, 0);
+        for (uint32_t i = 0; i < header.node_count; i++) {
+            const auto& node = nodes[i];
+            if (node.count > 0) {
+                if (node.offset + uint64_t(node.count) > order_length)
+                    return false;
+                continue;
+            }
+
+            if (node.offset <= i || node.offset >= header.node_count || node.axis >= 3
+                || depth[i] >= flat_bvh_max_depth)
+                return false;
+
+            auto child_depth = static_cast<uint8_t>(depth[i] + 1);
+            depth[i + 1] = std::max(depth[i + 1], child_depth);
+            depth[node.offset] = std::max(depth[node.offset], child_depth);
+        }
+        return true;
+    };
+
+    if (header.segment_count == 0) {
+        auto nodes = reinterpret_cast<const flat_bvh_node*>(file->data() + header.node_offset);
+        if (!valid_nodes(nodes) || flat_bvh_subtree_end(nodes, 0) != header.node_count)
+            return nullptr;
+        return arena_shared<flat_bvh>(objects, order, nodes, header.node_count, file);
+    }
+
+    auto nodes = reinterpret_cast<const flat_bvh_motion_node*>(file->data() + header.node_offset);
+    if (!valid_nodes(nodes))
+        return nullptr;
+
+    // The segment trees must tile the node array exactly.
+    uint32_t segment_end = 0;
+    for (uint32_t k = 0; k < header.segment_count; k++) {
+        if (segment_end >= header.node_count)
+            return nullptr;
+        segment_end = flat_bvh_subtree_end(nodes, segment_end);
+    }
+    if (segment_end != header.node_count)
+        return nullptr;
+
+    return arena_shared<flat_bvh>(
+        objects, order, nodes, header.node_count, header.segment_count, time0, time1, file);
+}
+
+
+// Returns a BVH over `list`, reusing the tree from an earlier run with the same scene when
+// one is cached and storing a freshly built one otherwise.
+shared_ptr<flat_bvh> load_or_build_bvh(const hittable_list& list, double time0, double time1) {
+    if (bvh_cache_directory.empty())
+        return arena_shared<flat_bvh>(list, time0, time1);
+
+    auto hash = scene_hash(list.objects, time0, time1);
+    auto filename = bvh_cache_filename(hash);
+
+    if (auto cached = read_bvh_cache(filename, list.objects, hash, time0, time1))
+        return cached;
+
+    auto bvh = arena_shared<flat_bvh>(list, time0, time1);
+    if (!write_bvh_cache(filename, *bvh, hash))
+        std::cerr << "WARNING: Could not write BVH cache file '" << filename << "'.\n";
+
+    return bvh;
+}
+
+
+#endif
@@ -48,14 +48,22 @@ class camera {
             time1 = _time1;
         }
 
+        // Gives rays a cone one pixel wide, for texture filtering. Directions reach the focus
+        // plane at t = 1, where a pixel is the viewport height over the image height.
+        void set_image_height(int image_height) {
+            pixel_spread = vertical.length() / image_height;
+        }
+
         ray get_ray(double s, double t) const {
             vec3 rd = lens_radius * random_in_unit_disk();
             vec3 offset = u * rd.x() + v * rd.y();
-            return ray(
+            ray r(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
                 random_double(time0, time1)
             );
+            r.spread = pixel_spread;
+            return r;
         }
 
     private:
@@ -66,6 +74,7 @@ class camera {
         vec3 u, v, w;
         double lens_radius;
         double time0, time1;  // shutter open/close times
+        double pixel_spread = 0;
 };
 
 #endif
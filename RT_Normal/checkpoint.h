@@ -0,0 +1,100 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "accumulation.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+
+// Layout of a checkpoint file: this header followed by width * height pixel_sums, top row
+// first, in native byte order. `render_key` identifies the scene, camera and settings the sums
+// belong to, so that a checkpoint is never resumed into a different render.
+struct checkpoint_header {
+    char magic[8];
+    uint64_t render_key;
+    uint32_t version;
+    uint32_t pixel_size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pad[8];
+};
+
+static_assert(sizeof(checkpoint_header) == 64, "the pixels follow aligned");
+
+const char checkpoint_magic[8] = { 'R', 'T', 'C', 'K', 'P', 'T', 0, 1 };
+const uint32_t checkpoint_version = 1;
+
+
+// When a progressive render saves its sums: after `minutes` or after `samples` more samples
+// per pixel, whichever comes first, and once more when it finishes. Zero turns a limit off.
+struct checkpoint_schedule {
+    std::string filename;  // empty for no checkpoints
+    uint64_t render_key = 0;
+    double minutes = 10;
+    int samples = 0;
+};
+
+
+// Writes through a temporary file renamed over the old checkpoint, so that a render killed
+// part way through writing still leaves the previous checkpoint intact.
+bool write_checkpoint(
+    const std::string& filename, const accumulation_buffer& sums, uint64_t render_key
+) {
+    checkpoint_header header = {};
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.render_key = render_key;
+    header.version = checkpoint_version;
+    header.pixel_size = sizeof(pixel_sums);
+    header.width = static_cast<uint32_t>(sums.width);
+    header.height = static_cast<uint32_t>(sums.height);
+
+    return write_file_atomically(filename, [&](std::ofstream& out) {
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(sums.pixels.data()),
+                  sums.pixels.size() * sizeof(pixel_sums));
+    });
+}
+
+
+// Loads a checkpoint into `sums`, which must already have the render's size. Returns false,
+// leaving `sums` alone, if the file is missing, damaged or from a different render.
+bool read_checkpoint(const std::string& filename, accumulation_buffer& sums, uint64_t render_key) {
+    mapped_file file(filename.c_str());
+    if (!file.valid() || file.size() < sizeof(checkpoint_header))
+        return false;
+
+    checkpoint_header header;
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    auto expected_size = sizeof(header) + sums.pixels.size() * sizeof(pixel_sums);
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0
+        || header.version != checkpoint_version
+        || header.pixel_size != sizeof(pixel_sums)
+        || header.render_key != render_key
+        || header.width != static_cast<uint32_t>(sums.width)
+        || header.height != static_cast<uint32_t>(sums.height)
+        || file.size() != expected_size)
+        return false;
+
+    std::memcpy(sums.pixels.data(), file.data() + sizeof(header),
+                sums.pixels.size() * sizeof(pixel_sums));
+    return true;
+}
+
+
+#endif
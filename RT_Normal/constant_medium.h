@@ -15,6 +15,7 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "scene_arena.h"
 #include "texture.h"
 
 
@@ -23,22 +24,39 @@ class constant_medium : public hittable  {
         constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
             : boundary(b),
               neg_inv_density(-1/d),
-              phase_function(make_shared<isotropic>(a))
+              phase_function(arena_shared<isotropic>(a))
             {}
 
         constant_medium(shared_ptr<hittable> b, double d, color c)
             : boundary(b),
               neg_inv_density(-1/d),
-              phase_function(make_shared<isotropic>(c))
+              phase_function(arena_shared<isotropic>(c))
             {}
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        // Blocked if the sampled free path ends inside the medium, so a shadow ray through it
+        // is let through with the medium's transmittance on average.
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            double t;
+            return sample_collision(r, t_min, t_max, t);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             return boundary->bounding_box(time0, time1, output_box);
         }
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override {
+            return boundary->intervals(r, t_min, t_max, out);
+        }
+
+    private:
+        // Samples a free path along the ray and returns true, with its end in `t`, if it ends
+        // inside the boundary between t_min and t_max.
+        bool sample_collision(const ray& r, double t_min, double t_max, double& t) const;
+
     public:
         shared_ptr<hittable> boundary;
         shared_ptr<material> phase_function;
@@ -51,37 +69,13 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     const bool enableDebug = false;
     const bool debugging = enableDebug && random_double() < 0.00001;
 
-    hit_record rec1, rec2;
-
-    if (!boundary->hit(r, -infinity, infinity, rec1))
-        return false;
-
-    if (!boundary->hit(r, rec1.t+0.0001, infinity, rec2))
+    if (!sample_collision(r, t_min, t_max, rec.t))
         return false;
 
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-
-    if (rec1.t >= rec2.t)
-        return false;
-
-    if (rec1.t < 0)
-        rec1.t = 0;
-
-    const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
-
-    if (hit_distance > distance_inside_boundary)
-        return false;
-
-    rec.t = rec1.t + hit_distance / ray_length;
     rec.p = r.at(rec.t);
 
     if (debugging) {
-        std::cerr << "hit_distance = " <<  hit_distance << '\n'
+        std::cerr << "\nt_min=" << t_min << ", t_max=" << t_max << '\n'
                   << "rec.t = " <<  rec.t << '\n'
                   << "rec.p = " <<  rec.p << '\n';
     }
@@ -89,8 +83,41 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     rec.normal = vec3(1,0,0);  // arbitrary
     rec.front_face = true;     // also arbitrary
     rec.mat_ptr = phase_function;
+    rec.pending = nullptr;
 
     return true;
 }
 
+
+bool constant_medium::sample_collision(
+    const ray& r, double t_min, double t_max, double& t
+) const {
+    // One query finds every stretch of the ray inside the boundary.
+    ray_intervals inside;
+    if (!boundary->intervals(r, t_min, t_max, inside))
+        return false;
+
+    const auto ray_length = r.direction().length();
+    auto hit_distance = neg_inv_density * log(random_double());
+
+    // The free path runs on through each stretch of the medium in turn.
+    for (int i = 0; i < inside.count; i++) {
+        auto t0 = fmax(inside.spans[i].t0, 0.0);
+        auto t1 = inside.spans[i].t1;
+        if (t0 >= t1)
+            continue;
+
+        const auto distance_inside_boundary = (t1 - t0) * ray_length;
+        if (hit_distance > distance_inside_boundary) {
+            hit_distance -= distance_inside_boundary;
+            continue;
+        }
+
+        t = t0 + hit_distance / ray_length;
+        return true;
+    }
+
+    return false;
+}
+
 #endif
@@ -0,0 +1,389 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+
+struct denoise_settings {
+    int iterations = 5;
+    double sigma_luminance = 4.0;  // luminance edges, in standard deviations of the noise
+    double sigma_normal = 0.3;     // distance between normals
+    double sigma_depth = 0.03;     // relative change in depth per pixel of filter step
+    double sigma_albedo = 0.1;     // distance between albedos
+};
+
+
+// An edge-avoiding a-trous wavelet filter. Each pass blurs with a 5x5 B3 spline kernel whose
+// taps are 2^pass pixels apart, weighting every tap by how alike its normal, depth, albedo and
+// luminance are to the centre pixel's. Lighting is filtered with the albedo divided out and
+// multiplied back afterwards. The luminance tolerance follows the estimated noise, which is
+// filtered along with the image, so that smooth regions blur strongly and lit edges survive.
+class atrous_denoiser {
+    public:
+        atrous_denoiser(const framebuffer& image, const denoise_settings& s);
+
+        void run(int thread_count);
+
+        // Replaces the image's radiance with the filtered result.
+        void write(framebuffer& image) const;
+
+    private:
+        // The planes one pass reads from and writes to.
+        struct lighting {
+            std::vector<float> r, g, b, variance;
+        };
+
+        void estimate_spatial_variance(int row_begin, int row_end);
+        void prefilter_variance(int row_begin, int row_end);
+        void filter_rows(int step, int row_begin, int row_end);
+        void filter_pixel(int x, int y, int step);
+#ifdef RTW_SSE
+        void filter_four(int x, int y, int step);
+#endif
+
+        template <typename Body>
+        void for_rows(int thread_count, Body&& body);
+
+    private:
+        int width, height;
+        denoise_settings settings;
+
+        // Guides, fixed for all passes.
+        std::vector<float> nx, ny, nz, depth, ar, ag, ab;
+
+        lighting in, out;
+        std::vector<float> sigma;  // luminance tolerance per pixel for the current pass
+};
+
+
+namespace denoise_detail {
+    // exp(-e) for e >= 0, to about 1e-6, with the same arithmetic as the SSE version below so
+    // that the two paths agree.
+    inline float exp_neg(float e) {
+        auto y = std::max(-e * 1.44269504f, -126.0f);
+        auto n = std::floor(y);
+        auto f = y - n;
+        auto p = 1.0f + f*(0.693147f + f*(0.240227f + f*(0.0555041f + f*(0.00961813f
+                      + f*0.00133336f))));
+        int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+#ifdef RTW_SSE
+    inline __m128 exp_neg(__m128 e) {
+        auto y = _mm_max_ps(_mm_mul_ps(e, _mm_set1_ps(-1.44269504f)), _mm_set1_ps(-126.0f));
+
+        // Truncation rounds the negative y up; step back down where it did.
+        auto n = _mm_cvttps_epi32(y);
+        auto nf = _mm_cvtepi32_ps(n);
+        auto rounded_up = _mm_cmpgt_ps(nf, y);
+        nf = _mm_sub_ps(nf, _mm_and_ps(rounded_up, _mm_set1_ps(1.0f)));
+        n = _mm_add_epi32(n, _mm_castps_si128(rounded_up));  // true lanes are -1
+
+        auto f = _mm_sub_ps(y, nf);
+        auto p = _mm_set1_ps(0.00133336f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00961813f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.240227f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.693147f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+        auto scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23));
+        return _mm_mul_ps(p, scale);
+    }
+#endif
+
+    const float kernel[5] = { 1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16 };
+}
+
+
+atrous_denoiser::atrous_denoiser(const framebuffer& image, const denoise_settings& s)
+    : width(image.width), height(image.height), settings(s)
+{
+    auto n = size_t(width) * height;
+    for (auto plane : { &nx, &ny, &nz, &depth, &ar, &ag, &ab })
+        plane->resize(n);
+    for (auto plane : { &in.r, &in.g, &in.b, &in.variance, &out.r, &out.g, &out.b,
+                        &out.variance, &sigma })
+        plane->resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        nx[i] = static_cast<float>(image.normal[i].x());
+        ny[i] = static_cast<float>(image.normal[i].y());
+        nz[i] = static_cast<float>(image.normal[i].z());
+        depth[i] = static_cast<float>(image.depth[i]);
+
+        // Lighting is what is left of the radiance once the surface colour is divided out.
+        const auto& a = image.albedo[i];
+        const auto& c = image.radiance[i];
+        auto demodulate = [](double radiance, double albedo) {
+            return static_cast<float>(radiance / fmax(albedo, 1e-3));
+        };
+        ar[i] = static_cast<float>(a.x());
+        ag[i] = static_cast<float>(a.y());
+        ab[i] = static_cast<float>(a.z());
+        in.r[i] = demodulate(c.x(), a.x());
+        in.g[i] = demodulate(c.y(), a.y());
+        in.b[i] = demodulate(c.z(), a.z());
+
+        auto a_luminance = fmax(luminance(a), 1e-3);
+        in.variance[i] = static_cast<float>(image.variance[i] / (a_luminance * a_luminance));
+    }
+}
+
+
+template <typename Body>
+void atrous_denoiser::for_rows(int thread_count, Body&& body) {
+    if (thread_count <= 1) {
+        body(0, height);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    auto rows = (height + thread_count - 1) / thread_count;
+    for (int start = 0; start < height; start += rows)
+        threads.emplace_back([&, start] { body(start, std::min(start + rows, height)); });
+    for (auto& t : threads)
+        t.join();
+}
+
+
+void atrous_denoiser::run(int thread_count) {
+    for_rows(thread_count, [&](int begin, int end) { estimate_spatial_variance(begin, end); });
+    std::swap(in.variance, out.variance);
+
+    for (int pass = 0; pass < settings.iterations; pass++) {
+        auto step = 1 << pass;
+        for_rows(thread_count, [&](int begin, int end) { prefilter_variance(begin, end); });
+        for_rows(thread_count, [&](int begin, int end) { filter_rows(step, begin, end); });
+        std::swap(in, out);
+    }
+}
+
+
+void atrous_denoiser::estimate_spatial_variance(int row_begin, int row_end) {
+    // At a few samples per pixel many pixels see no light at all and report no variance, which
+    // would stop them from blending with anything. Where the neighbouring surface is alike, the
+    // spread of its pixels' values is another estimate of one pixel's noise; keep the larger.
+    using namespace denoise_detail;
+
+    const int radius = 3;
+    auto inv_sigma_n = static_cast<float>(1 / (settings.sigma_normal * settings.sigma_normal));
+    auto inv_sigma_a = static_cast<float>(1 / (settings.sigma_albedo * settings.sigma_albedo));
+
+    for (int y = row_begin; y < row_end; y++) {
+        for (int x = 0; x < width; x++) {
+            auto p = size_t(y) * width + x;
+            auto depth_scale = 1 / (static_cast<float>(settings.sigma_depth) * depth[p] + 1e-6f);
+
+            float sum_w = 0, sum_l = 0, sum_l2 = 0;
+            for (int dy = -radius; dy <= radius; dy++) {
+                auto row = size_t(std::clamp(y + dy, 0, height - 1)) * width;
+                for (int dx = -radius; dx <= radius; dx++) {
+                    auto q = row + std::clamp(x + dx, 0, width - 1);
+
+                    auto dn = (nx[q]-nx[p])*(nx[q]-nx[p]) + (ny[q]-ny[p])*(ny[q]-ny[p])
+                            + (nz[q]-nz[p])*(nz[q]-nz[p]);
+                    auto dz = (depth[q] - depth[p]) * depth_scale;
+                    auto da = (ar[q]-ar[p])*(ar[q]-ar[p]) + (ag[q]-ag[p])*(ag[q]-ag[p])
+                            + (ab[q]-ab[p])*(ab[q]-ab[p]);
+                    auto w = exp_neg(dn*inv_sigma_n + dz*dz + da*inv_sigma_a);
+
+                    auto l = 0.2126f*in.r[q] + 0.7152f*in.g[q] + 0.0722f*in.b[q];
+                    sum_w += w;
+                    sum_l += w * l;
+                    sum_l2 += w * l*l;
+                }
+            }
+
+            auto mean = sum_l / sum_w;
+            out.variance[p] = std::max(in.variance[p], std::max(sum_l2 / sum_w - mean*mean, 0.0f));
+        }
+    }
+}
+
+
+void atrous_denoiser::prefilter_variance(int row_begin, int row_end) {
+    // A single pixel's variance estimate is itself noisy, so the tolerance comes from a 3x3
+    // average of it.
+    auto scale = static_cast<float>(settings.sigma_luminance);
+    for (int y = row_begin; y < row_end; y++) {
+        for (int x = 0; x < width; x++) {
+            float sum = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                auto row = size_t(std::clamp(y + dy, 0, height - 1)) * width;
+                for (int dx = -1; dx <= 1; dx++)
+                    sum += in.variance[row + std::clamp(x + dx, 0, width - 1)];
+            }
+            sigma[size_t(y) * width + x] = scale * std::sqrt(sum / 9) + 1e-4f;
+        }
+    }
+}
+
+
+void atrous_denoiser::filter_rows(int step, int row_begin, int row_end) {
+    for (int y = row_begin; y < row_end; y++) {
+        int x = 0;
+#ifdef RTW_SSE
+        // Four pixels at a time wherever none of their taps reach past the sides.
+        for (; x < width; x++) {
+            if (x - 2*step >= 0 && x + 3 + 2*step < width)
+                break;
+            filter_pixel(x, y, step);
+        }
+        for (; x + 3 + 2*step < width; x += 4)
+            filter_four(x, y, step);
+#endif
+        for (; x < width; x++)
+            filter_pixel(x, y, step);
+    }
+}
+
+
+void atrous_denoiser::filter_pixel(int x, int y, int step) {
+    using namespace denoise_detail;
+
+    auto p = size_t(y) * width + x;
+    auto luminance_p = 0.2126f*in.r[p] + 0.7152f*in.g[p] + 0.0722f*in.b[p];
+    auto inv_sigma_l = 1 / (sigma[p] * sigma[p]);
+    auto inv_sigma_n = static_cast<float>(1 / (settings.sigma_normal * settings.sigma_normal));
+    auto inv_sigma_a = static_cast<float>(1 / (settings.sigma_albedo * settings.sigma_albedo));
+    auto depth_scale = 1 / (static_cast<float>(settings.sigma_depth) * step * depth[p] + 1e-6f);
+
+    float sum_w = 0, sum_r = 0, sum_g = 0, sum_b = 0, sum_v = 0;
+    for (int dy = -2; dy <= 2; dy++) {
+        auto row = size_t(std::clamp(y + dy*step, 0, height - 1)) * width;
+        for (int dx = -2; dx <= 2; dx++) {
+            auto q = row + std::clamp(x + dx*step, 0, width - 1);
+
+            auto dl = 0.2126f*in.r[q] + 0.7152f*in.g[q] + 0.0722f*in.b[q] - luminance_p;
+            auto dn = (nx[q]-nx[p])*(nx[q]-nx[p]) + (ny[q]-ny[p])*(ny[q]-ny[p])
+                    + (nz[q]-nz[p])*(nz[q]-nz[p]);
+            auto dz = (depth[q] - depth[p]) * depth_scale;
+            auto da = (ar[q]-ar[p])*(ar[q]-ar[p]) + (ag[q]-ag[p])*(ag[q]-ag[p])
+                    + (ab[q]-ab[p])*(ab[q]-ab[p]);
+
+            auto e = dl*dl*inv_sigma_l + dn*inv_sigma_n + dz*dz + da*inv_sigma_a;
+            auto w = kernel[dx + 2] * kernel[dy + 2] * exp_neg(e);
+
+            sum_w += w;
+            sum_r += w * in.r[q];
+            sum_g += w * in.g[q];
+            sum_b += w * in.b[q];
+            sum_v += w * w * in.variance[q];
+        }
+    }
+
+    // The centre tap always has full weight, so sum_w is never zero.
+    out.r[p] = sum_r / sum_w;
+    out.g[p] = sum_g / sum_w;
+    out.b[p] = sum_b / sum_w;
+    out.variance[p] = sum_v / (sum_w * sum_w);
+}
+
+
+#ifdef RTW_SSE
+void atrous_denoiser::filter_four(int x, int y, int step) {
+    using namespace denoise_detail;
+
+    auto p = size_t(y) * width + x;
+    auto load = [](const std::vector<float>& plane, size_t i) { return _mm_loadu_ps(&plane[i]); };
+    auto square = [](__m128 v) { return _mm_mul_ps(v, v); };
+    auto luminance4 = [&](const lighting& l, size_t i) {
+        return _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(_mm_set1_ps(0.2126f), load(l.r, i)),
+            _mm_mul_ps(_mm_set1_ps(0.7152f), load(l.g, i))),
+            _mm_mul_ps(_mm_set1_ps(0.0722f), load(l.b, i)));
+    };
+
+    auto luminance_p = luminance4(in, p);
+    auto sigma_p = load(sigma, p);
+    auto inv_sigma_l = _mm_div_ps(_mm_set1_ps(1.0f), _mm_mul_ps(sigma_p, sigma_p));
+    auto inv_sigma_n = _mm_set1_ps(static_cast<float>(
+        1 / (settings.sigma_normal * settings.sigma_normal)));
+    auto inv_sigma_a = _mm_set1_ps(static_cast<float>(
+        1 / (settings.sigma_albedo * settings.sigma_albedo)));
+    auto depth_scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(static_cast<float>(settings.sigma_depth) * step), load(depth, p)),
+        _mm_set1_ps(1e-6f)));
+
+    auto nx_p = load(nx, p), ny_p = load(ny, p), nz_p = load(nz, p), depth_p = load(depth, p);
+    auto ar_p = load(ar, p), ag_p = load(ag, p), ab_p = load(ab, p);
+
+    auto sum_w = _mm_setzero_ps(), sum_v = _mm_setzero_ps();
+    auto sum_r = _mm_setzero_ps(), sum_g = _mm_setzero_ps(), sum_b = _mm_setzero_ps();
+
+    for (int dy = -2; dy <= 2; dy++) {
+        auto row = size_t(std::clamp(y + dy*step, 0, height - 1)) * width;
+        for (int dx = -2; dx <= 2; dx++) {
+            auto q = row + x + dx*step;
+
+            auto dl = _mm_sub_ps(luminance4(in, q), luminance_p);
+            auto dn = _mm_add_ps(_mm_add_ps(
+                square(_mm_sub_ps(load(nx, q), nx_p)),
+                square(_mm_sub_ps(load(ny, q), ny_p))),
+                square(_mm_sub_ps(load(nz, q), nz_p)));
+            auto dz = _mm_mul_ps(_mm_sub_ps(load(depth, q), depth_p), depth_scale);
+            auto da = _mm_add_ps(_mm_add_ps(
+                square(_mm_sub_ps(load(ar, q), ar_p)),
+                square(_mm_sub_ps(load(ag, q), ag_p))),
+                square(_mm_sub_ps(load(ab, q), ab_p)));
+
+            auto e = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(square(dl), inv_sigma_l), _mm_mul_ps(dn, inv_sigma_n)),
+                _mm_add_ps(square(dz), _mm_mul_ps(da, inv_sigma_a)));
+            auto w = _mm_mul_ps(_mm_set1_ps(kernel[dx + 2] * kernel[dy + 2]), exp_neg(e));
+
+            sum_w = _mm_add_ps(sum_w, w);
+            sum_r = _mm_add_ps(sum_r, _mm_mul_ps(w, load(in.r, q)));
+            sum_g = _mm_add_ps(sum_g, _mm_mul_ps(w, load(in.g, q)));
+            sum_b = _mm_add_ps(sum_b, _mm_mul_ps(w, load(in.b, q)));
+            sum_v = _mm_add_ps(sum_v, _mm_mul_ps(square(w), load(in.variance, q)));
+        }
+    }
+
+    _mm_storeu_ps(&out.r[p], _mm_div_ps(sum_r, sum_w));
+    _mm_storeu_ps(&out.g[p], _mm_div_ps(sum_g, sum_w));
+    _mm_storeu_ps(&out.b[p], _mm_div_ps(sum_b, sum_w));
+    _mm_storeu_ps(&out.variance[p], _mm_div_ps(sum_v, square(sum_w)));
+}
+#endif
+
+
+void atrous_denoiser::write(framebuffer& image) const {
+    for (size_t i = 0; i < image.radiance.size(); i++)
+        image.radiance[i] = color(in.r[i] * ar[i], in.g[i] * ag[i], in.b[i] * ab[i]);
+}
+
+
+// Filters the image's radiance in place, guided by its features.
+void denoise(
+    framebuffer& image, const denoise_settings& settings = denoise_settings(),
+    int thread_count = static_cast<int>(std::thread::hardware_concurrency())
+) {
+    atrous_denoiser denoiser(image, settings);
+    denoiser.run(thread_count);
+    denoiser.write(image);
+}
+
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef DENSITY_GRID_H
+#define DENSITY_GRID_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+
+// Density samples on a regular lattice spanning a box, interpolated trilinearly between
+// lattice points. The density is zero outside the box.
+class density_grid {
+    public:
+        density_grid(const aabb& bounds, int nx, int ny, int nz)
+            : box(bounds), size{ nx, ny, nz },
+              values(static_cast<size_t>(nx) * ny * nz, 0.0f)
+        {}
+
+        // Samples `f` at every lattice point.
+        void fill(const std::function<double(const point3&)>& f);
+
+        float& at(int i, int j, int k) { return values[index(i, j, k)]; }
+        float at(int i, int j, int k) const { return values[index(i, j, k)]; }
+
+        double density(const point3& p) const;
+
+        // An upper bound on the density anywhere in the lattice cells [lo, hi) along each axis.
+        // Trilinear interpolation never exceeds the largest corner of a cell.
+        double max_density(const int lo[3], const int hi[3]) const;
+
+        const aabb& bounds() const { return box; }
+        int lattice_size(int axis) const { return size[axis]; }
+
+        // Lattice coordinates of p, with lattice point (i, j, k) at (i, j, k).
+        vec3 lattice_coordinates(const point3& p) const {
+            vec3 c;
+            for (int a = 0; a < 3; a++)
+                c[a] = (p[a] - box.min()[a]) / (box.max()[a] - box.min()[a]) * (size[a] - 1);
+            return c;
+        }
+
+    private:
+        size_t index(int i, int j, int k) const {
+            return (static_cast<size_t>(k) * size[1] + j) * size[0] + i;
+        }
+
+    private:
+        aabb box;
+        int size[3];
+        std::vector<float> values;
+};
+
+
+void density_grid::fill(const std::function<double(const point3&)>& f) {
+    for (int k = 0; k < size[2]; k++) {
+        for (int j = 0; j < size[1]; j++) {
+            for (int i = 0; i < size[0]; i++) {
+                point3 p;
+                int ijk[3] = { i, j, k };
+                for (int a = 0; a < 3; a++) {
+                    auto s = size[a] > 1 ? double(ijk[a]) / (size[a] - 1) : 0.5;
+                    p[a] = box.min()[a] + s * (box.max()[a] - box.min()[a]);
+                }
+                at(i, j, k) = static_cast<float>(fmax(f(p), 0.0));
+            }
+        }
+    }
+}
+
+
+double density_grid::density(const point3& p) const {
+    auto c = lattice_coordinates(p);
+
+    int base[3];
+    double frac[3];
+    for (int a = 0; a < 3; a++) {
+        if (!(c[a] >= 0 && c[a] <= size[a] - 1))
+            return 0;
+        base[a] = std::min(static_cast<int>(c[a]), std::max(size[a] - 2, 0));
+        frac[a] = c[a] - base[a];
+    }
+
+    auto value = [&](int di, int dj, int dk) {
+        return double(at(std::min(base[0] + di, size[0] - 1),
+                         std::min(base[1] + dj, size[1] - 1),
+                         std::min(base[2] + dk, size[2] - 1)));
+    };
+
+    auto accum = 0.0;
+    for (int di = 0; di < 2; di++)
+        for (int dj = 0; dj < 2; dj++)
+            for (int dk = 0; dk < 2; dk++)
+                accum += (di ? frac[0] : 1 - frac[0])
+                       * (dj ? frac[1] : 1 - frac[1])
+                       * (dk ? frac[2] : 1 - frac[2])
+                       * value(di, dj, dk);
+
+    return accum;
+}
+
+
+double density_grid::max_density(const int lo[3], const int hi[3]) const {
+    // Cell c spans lattice points c and c+1.
+    float result = 0;
+    for (int k = std::max(lo[2], 0); k <= std::min(hi[2], size[2] - 1); k++)
+        for (int j = std::max(lo[1], 0); j <= std::min(hi[1], size[1] - 1); j++)
+            for (int i = std::max(lo[0], 0); i <= std::min(hi[0], size[0] - 1); i++)
+                result = std::max(result, at(i, j, k));
+    return result;
+}
+
+
+#endif
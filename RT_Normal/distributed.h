@@ -0,0 +1,548 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "accumulation.h"
+#include "checkpoint.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <netdb.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+
+// Rendering spread over worker processes. A coordinator owns the accumulation buffer and hands
+// out jobs, each a band of rows and a number of samples per pixel to take them to. A job
+// carries its pixels' sums and random states, and comes back with them advanced, so the
+// merged image is the same as one rendered in a single process, whichever worker took which
+// job. Workers may connect at any time; the jobs of one that disconnects go back in the queue.
+//
+// Addresses are a Unix socket path, or "tcp:HOST:PORT".
+
+
+// What a worker needs to rebuild the scene and check that it got the same one.
+struct render_job {
+    int32_t scene;
+    int32_t width;
+    int32_t height;
+    int32_t max_depth;
+    int32_t bake_textures;
+    int32_t target;        // samples per pixel when the render is done
+    uint32_t pixel_size;   // sizeof(pixel_sums), which both ends must agree on
+    uint32_t features;     // 1 if first-hit features are gathered for denoising or layers
+    uint64_t render_key;
+};
+
+
+enum class message_type : uint32_t {
+    job = 1,  // coordinator to worker: a render_job
+    ready,    // worker to coordinator: the render key the worker's scene has
+    band,     // coordinator to worker: the pixel_sums of rows [row_begin, row_end)
+    result,   // worker to coordinator: the same rows with samples added up to `target`
+    done      // coordinator to worker: nothing left to do
+};
+
+struct message_header {
+    uint32_t type;
+    uint32_t row_begin;
+    uint32_t row_end;
+    uint32_t target;
+    uint64_t length;  // bytes of payload that follow
+};
+
+
+#ifndef _WIN32
+
+// One end of a stream socket, closed when destroyed.
+class connection {
+    public:
+        explicit connection(int socket = -1) : fd(socket) {}
+        ~connection() { if (fd >= 0) close(fd); }
+
+        connection(const connection&) = delete;
+        connection& operator=(const connection&) = delete;
+
+        bool valid() const { return fd >= 0; }
+
+        bool send(message_type type, const void* payload = nullptr, size_t length = 0,
+                  uint32_t row_begin = 0, uint32_t row_end = 0, uint32_t target = 0) const;
+
+        // Returns false on a closed connection or a malformed message.
+        bool receive(message_header& header, std::vector<unsigned char>& payload) const;
+
+    private:
+        bool write_all(const void* data, size_t length) const;
+        bool read_all(void* data, size_t length) const;
+
+    private:
+        int fd;
+};
+
+
+bool connection::write_all(const void* data, size_t length) const {
+    auto bytes = static_cast<const char*>(data);
+    while (length > 0) {
+        auto sent = ::send(fd, bytes, length, 0);
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+
+bool connection::read_all(void* data, size_t length) const {
+    auto bytes = static_cast<char*>(data);
+    while (length > 0) {
+        auto got = ::recv(fd, bytes, length, 0);
+        if (got <= 0)
+            return false;
+        bytes += got;
+        length -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+
+bool connection::send(
+    message_type type, const void* payload, size_t length,
+    uint32_t row_begin, uint32_t row_end, uint32_t target
+) const {
+    message_header header = { static_cast<uint32_t>(type), row_begin, row_end, target, length };
+    return write_all(&header, sizeof(header)) && write_all(payload, length);
+}
+
+
+bool connection::receive(message_header& header, std::vector<unsigned char>& payload) const {
+    if (!read_all(&header, sizeof(header)))
+        return false;
+
+    // No honest message comes near this; anything larger is a stray connection.
+    if (header.length > (uint64_t(1) << 32))
+        return false;
+
+    payload.resize(static_cast<size_t>(header.length));
+    return read_all(payload.data(), payload.size());
+}
+
+
+// Resolves an address into a socket family and address. Returns false if it cannot.
+bool parse_address(
+    const std::string& address, int& family, sockaddr_storage& storage, socklen_t& length
+) {
+    std::memset(&storage, 0, sizeof(storage));
+
+    if (address.compare(0, 4, "tcp:") == 0) {
+        auto host_port = address.substr(4);
+        auto colon = host_port.rfind(':');
+        if (colon == std::string::npos)
+            return false;
+        auto host = host_port.substr(0, colon);
+        auto port = host_port.substr(colon + 1);
+
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found) != 0
+            || !found)
+            return false;
+
+        family = found->ai_family;
+        std::memcpy(&storage, found->ai_addr, found->ai_addrlen);
+        length = static_cast<socklen_t>(found->ai_addrlen);
+        freeaddrinfo(found);
+        return true;
+    }
+
+    sockaddr_un local = {};
+    if (address.empty() || address.size() >= sizeof(local.sun_path))
+        return false;
+    local.sun_family = AF_UNIX;
+    std::memcpy(local.sun_path, address.c_str(), address.size());
+
+    family = AF_UNIX;
+    std::memcpy(&storage, &local, sizeof(local));
+    length = sizeof(local);
+    return true;
+}
+
+
+// Returns a listening socket, or -1.
+int listen_on(const std::string& address) {
+    int family;
+    sockaddr_storage storage;
+    socklen_t length;
+    if (!parse_address(address, family, storage, length))
+        return -1;
+
+    auto fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (family == AF_UNIX) {
+        unlink(address.c_str());
+    } else {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&storage), length) != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+// Connects to a coordinator, retrying for a while in case it has not started listening yet.
+int connect_to(const std::string& address, int attempts = 50) {
+    int family;
+    sockaddr_storage storage;
+    socklen_t length;
+    if (!parse_address(address, family, storage, length))
+        return -1;
+
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        auto fd = socket(family, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0)
+            return fd;
+
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    return -1;
+}
+
+#endif
+
+
+class render_coordinator {
+    public:
+        // Renders `sums` up to job.target samples per pixel. Jobs are bands of `band_height`
+        // rows and add at most `job_samples` samples per pixel, so that a worker that drops
+        // out loses little, and checkpoints can be written as jobs come back.
+        render_coordinator(
+            const render_job& job, accumulation_buffer& sums,
+            const checkpoint_schedule& checkpoint, int band_height = 16, int job_samples = 16);
+
+        // Listens on `address` and serves workers until the render is done. Returns false if
+        // it could not listen.
+        bool run(const std::string& address);
+
+    private:
+        void serve(int socket, int worker);
+        void report_progress();
+
+    private:
+        render_job job;
+        accumulation_buffer& sums;
+        checkpoint_schedule checkpoint;
+        int band_height;
+        int job_samples;
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<int> band_samples;   // samples per pixel each band has so far
+        std::deque<int> waiting;         // bands that need more samples and are not out
+        int bands_finished = 0;
+        int workers = 0;
+        std::chrono::steady_clock::time_point last_checkpoint;
+        std::chrono::steady_clock::time_point last_report;
+};
+
+
+render_coordinator::render_coordinator(
+    const render_job& j, accumulation_buffer& s, const checkpoint_schedule& c,
+    int rows, int samples
+) : job(j), sums(s), checkpoint(c), band_height(std::max(rows, 1)),
+    job_samples(std::max(samples, 1))
+{
+    auto band_count = (sums.height + band_height - 1) / band_height;
+    band_samples.assign(band_count, job.target);
+
+    for (int band = 0; band < band_count; band++) {
+        auto begin = band * band_height;
+        auto end = std::min(begin + band_height, sums.height);
+        for (auto i = sums.index(0, begin); i < sums.index(0, end); i++)
+            band_samples[band] = std::min(band_samples[band], int(sums.pixels[i].samples));
+
+        if (band_samples[band] < job.target)
+            waiting.push_back(band);
+        else
+            bands_finished++;
+    }
+}
+
+
+#ifndef _WIN32
+
+bool render_coordinator::run(const std::string& address) {
+    signal(SIGPIPE, SIG_IGN);
+
+    auto listener = listen_on(address);
+    if (listener < 0)
+        return false;
+
+    std::cerr << "Coordinator: waiting for workers on " << address << '\n';
+    last_checkpoint = last_report = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    int next_worker = 0;
+
+    auto finished = [&] {
+        std::lock_guard<std::mutex> guard(lock);
+        return bands_finished == static_cast<int>(band_samples.size());
+    };
+
+    while (!finished()) {
+        pollfd incoming = { listener, POLLIN, 0 };
+        if (poll(&incoming, 1, 250) <= 0)
+            continue;
+
+        auto socket = accept(listener, nullptr, nullptr);
+        if (socket >= 0)
+            threads.emplace_back(&render_coordinator::serve, this, socket, next_worker++);
+    }
+
+    close(listener);
+    if (address.compare(0, 4, "tcp:") != 0)
+        unlink(address.c_str());
+
+    changed.notify_all();
+    for (auto& t : threads)
+        t.join();
+
+    if (!checkpoint.filename.empty()
+        && !write_checkpoint(checkpoint.filename, sums, checkpoint.render_key))
+        std::cerr << "\nWARNING: Could not write checkpoint '" << checkpoint.filename << "'.\n";
+
+    std::cerr << "\nCoordinator: render done\n";
+    return true;
+}
+
+
+void render_coordinator::serve(int socket, int worker) {
+    connection link(socket);
+    message_header header;
+    std::vector<unsigned char> payload;
+
+    auto send_job = job;
+    send_job.pixel_size = sizeof(pixel_sums);
+    if (!link.send(message_type::job, &send_job, sizeof(send_job))
+        || !link.receive(header, payload)
+        || header.type != static_cast<uint32_t>(message_type::ready)
+        || payload.size() != sizeof(uint64_t))
+        return;
+
+    uint64_t worker_key;
+    std::memcpy(&worker_key, payload.data(), sizeof(worker_key));
+    if (worker_key != job.render_key) {
+        std::cerr << "\nWARNING: Worker " << worker << " built a different scene; ignoring it.\n";
+        link.send(message_type::done);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        workers++;
+        std::cerr << "\nCoordinator: worker " << worker << " joined, " << workers
+                  << " working\n";
+    }
+
+    std::vector<unsigned char> band_data;
+    while (true) {
+        int band;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&] {
+                return !waiting.empty() || bands_finished == int(band_samples.size());
+            });
+            if (waiting.empty())
+                break;
+
+            band = waiting.front();
+            waiting.pop_front();
+
+            auto begin = sums.index(0, band * band_height);
+            auto end = sums.index(0, std::min((band + 1) * band_height, sums.height));
+            band_data.resize((end - begin) * sizeof(pixel_sums));
+            std::memcpy(band_data.data(), &sums.pixels[begin], band_data.size());
+        }
+
+        auto row_begin = band * band_height;
+        auto row_end = std::min(row_begin + band_height, sums.height);
+        auto target = std::min(band_samples[band] + job_samples, int(job.target));
+
+        bool ok = link.send(message_type::band, band_data.data(), band_data.size(),
+                            row_begin, row_end, target)
+               && link.receive(header, payload)
+               && header.type == static_cast<uint32_t>(message_type::result)
+               && header.row_begin == uint32_t(row_begin) && header.row_end == uint32_t(row_end)
+               && payload.size() == band_data.size();
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (!ok) {
+            // Whatever the worker did with the band is lost; it starts over from the copy here.
+            waiting.push_front(band);
+            workers--;
+            std::cerr << "\nCoordinator: worker " << worker << " dropped, " << workers
+                      << " working\n";
+            changed.notify_all();
+            return;
+        }
+
+        std::memcpy(&sums.pixels[sums.index(0, row_begin)], payload.data(), payload.size());
+        band_samples[band] = target;
+        if (target < job.target)
+            waiting.push_back(band);
+        else
+            bands_finished++;
+
+        report_progress();
+        changed.notify_all();
+    }
+
+    link.send(message_type::done);
+    std::lock_guard<std::mutex> guard(lock);
+    workers--;
+}
+
+
+// Called with the lock held.
+void render_coordinator::report_progress() {
+    auto now = std::chrono::steady_clock::now();
+
+    if (now - last_report >= std::chrono::seconds(1)) {
+        long total = 0;
+        for (auto samples : band_samples)
+            total += samples;
+        std::cerr << "\rCoordinator: " << total / double(band_samples.size()) << " of "
+                  << job.target << " samples per pixel, " << workers << " working " << std::flush;
+        last_report = now;
+    }
+
+    // Bands reach different sample counts in between, so a checkpoint made here resumes with
+    // each band continuing from its own.
+    auto minutes = std::chrono::duration<double, std::ratio<60>>(now - last_checkpoint).count();
+    if (!checkpoint.filename.empty() && checkpoint.minutes > 0 && minutes >= checkpoint.minutes) {
+        if (!write_checkpoint(checkpoint.filename, sums, checkpoint.render_key))
+            std::cerr << "\nWARNING: Could not write checkpoint '" << checkpoint.filename
+                      << "'.\n";
+        last_checkpoint = now;
+    }
+}
+
+
+// Connects to the coordinator at `address` and renders jobs until it says the render is done.
+// `prepare` builds the scene for a render job and returns its render key. `render` adds
+// samples to rows [row_begin, row_end) of a buffer the size of the image, up to `target`
+// samples per pixel.
+bool run_worker(
+    const std::string& address,
+    const std::function<uint64_t(const render_job&)>& prepare,
+    const std::function<void(int row_begin, int row_end, int target, accumulation_buffer&)>&
+        render
+) {
+    signal(SIGPIPE, SIG_IGN);
+
+    connection link(connect_to(address));
+    if (!link.valid()) {
+        std::cerr << "ERROR: Could not connect to coordinator at '" << address << "'.\n";
+        return false;
+    }
+
+    message_header header;
+    std::vector<unsigned char> payload;
+    if (!link.receive(header, payload) || header.type != static_cast<uint32_t>(message_type::job)
+        || payload.size() != sizeof(render_job))
+        return false;
+
+    render_job job;
+    std::memcpy(&job, payload.data(), sizeof(job));
+    if (job.pixel_size != sizeof(pixel_sums)) {
+        std::cerr << "ERROR: The coordinator was built differently from this worker.\n";
+        return false;
+    }
+
+    auto key = prepare(job);
+    if (!link.send(message_type::ready, &key, sizeof(key)))
+        return false;
+
+    accumulation_buffer sums(job.width, job.height, 0);
+
+    while (link.receive(header, payload)) {
+        if (header.type == static_cast<uint32_t>(message_type::done))
+            return true;
+
+        int row_begin = static_cast<int>(header.row_begin);
+        int row_end = static_cast<int>(header.row_end);
+        if (header.type != static_cast<uint32_t>(message_type::band)
+            || row_begin >= row_end || row_end > job.height
+            || payload.size() != sums.index(0, row_end - row_begin) * sizeof(pixel_sums))
+            return false;
+
+        auto rows = &sums.pixels[sums.index(0, row_begin)];
+        std::memcpy(rows, payload.data(), payload.size());
+        render(row_begin, row_end, static_cast<int>(header.target), sums);
+
+        if (!link.send(message_type::result, rows, payload.size(), header.row_begin,
+                       header.row_end, header.target))
+            return false;
+    }
+
+    // The coordinator went away without finishing; nothing here is worth keeping.
+    return false;
+}
+
+#else
+
+bool render_coordinator::run(const std::string&) {
+    std::cerr << "ERROR: Distributed rendering needs POSIX sockets.\n";
+    return false;
+}
+
+bool run_worker(
+    const std::string&, const std::function<uint64_t(const render_job&)>&,
+    const std::function<void(int, int, int, accumulation_buffer&)>&
+) {
+    std::cerr << "ERROR: Distributed rendering needs POSIX sockets.\n";
+    return false;
+}
+
+#endif
+
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef FINALIZE_H
+#define FINALIZE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "aarect.h"
+#include "affine.h"
+#include "baked_texture.h"
+#include "box.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "flat_bvh.h"
+#include "heterogeneous_medium.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "scene_arena.h"
+#include "sphere.h"
+#include "texture.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+
+// Rewrites a built scene for faster tracing without changing what it looks like. Chains of
+// translate, rotate_y and instance wrappers become one instance with the combined transform,
+// and spheres that are only translated get the offset baked into their centres.
+//
+// Optionally, procedural textures on diffuse surfaces are also baked into lattices: onto the
+// (u, v) square of a sphere, or through the bounding box of any other primitive. A bake is
+// only kept if its mean error against the procedural texture is within bake_tolerance.
+class scene_finalizer {
+    public:
+        void run(hittable_list& world) {
+            visit_children(world);
+
+            if (folded_wrappers > 0)
+                std::cerr << "Finalize: folded " << folded_wrappers << " transform wrappers into "
+                          << merged_transforms << " instances, baked " << baked_spheres
+                          << " translations into spheres\n";
+
+            if (bake_resolution > 0) {
+                bake(world);
+                std::cerr << "Finalize: baked " << baked_textures << " procedural textures ("
+                          << baked_bytes / (1024*1024) << " MiB), rejected " << rejected_bakes
+                          << " as too coarse\n";
+            }
+        }
+
+        shared_ptr<hittable> fold(const shared_ptr<hittable>& object);
+
+    public:
+        int folded_wrappers = 0;
+        int merged_transforms = 0;
+        int baked_spheres = 0;
+
+        int bake_resolution = 0;       // lattice points along a bake's longest side, 0 for none
+        double bake_tolerance = 0.02;  // largest mean error per channel for a bake to be kept
+        int bake_error_samples = 4096;
+
+        int baked_textures = 0;
+        int rejected_bakes = 0;
+        size_t baked_bytes = 0;
+
+    private:
+        void visit_children(hittable& object);
+
+        // Only primitives reached without passing a transform are baked, since their own
+        // coordinates are the world space points that textures are evaluated at.
+        void bake(hittable& object);
+
+        template <typename MakeBake>
+        void bake_material(shared_ptr<material>& mat_ptr, const char* shape, MakeBake&& make_bake);
+
+        // Aggregates may be shared (an instanced bottom-level BVH, say), so each is rewritten once.
+        std::unordered_set<const hittable*> visited;
+        std::unordered_set<const hittable*> baked;
+};
+
+
+shared_ptr<hittable> scene_finalizer::fold(const shared_ptr<hittable>& object) {
+    affine to_world;
+    int wrappers = 0;
+    auto inner = object;
+
+    while (true) {
+        if (auto t = dynamic_cast<const translate*>(inner.get())) {
+            to_world = to_world * affine::translation(t->offset);
+            inner = t->ptr;
+        } else if (auto r = dynamic_cast<const rotate_y*>(inner.get())) {
+            affine rotation;
+            rotation.m[0][0] =  r->cos_theta;  rotation.m[0][2] = r->sin_theta;
+            rotation.m[2][0] = -r->sin_theta;  rotation.m[2][2] = r->cos_theta;
+            to_world = to_world * rotation;
+            inner = r->ptr;
+        } else if (auto i = dynamic_cast<const instance*>(inner.get())) {
+            to_world = to_world * i->to_world;
+            inner = i->ptr;
+        } else {
+            break;
+        }
+        wrappers++;
+    }
+
+    visit_children(*inner);
+
+    if (wrappers == 0)
+        return inner;
+
+    if (to_world.is_translation()) {
+        auto offset = to_world.offset();
+
+        if (auto s = dynamic_cast<const sphere*>(inner.get())) {
+            folded_wrappers += wrappers;
+            baked_spheres++;
+            return arena_shared<sphere>(s->center + offset, s->radius, s->mat_ptr);
+        }
+
+        if (auto s = dynamic_cast<const moving_sphere*>(inner.get())) {
+            folded_wrappers += wrappers;
+            baked_spheres++;
+            return arena_shared<moving_sphere>(
+                s->center0 + offset, s->center1 + offset, s->time0, s->time1, s->radius, s->mat_ptr);
+        }
+    }
+
+    // A single instance that already holds the whole transform can stay as it is, and is not
+    // counted as folded.
+    if (wrappers == 1 && dynamic_cast<const instance*>(object.get()))
+        return object;
+
+    folded_wrappers += wrappers;
+    merged_transforms++;
+    return arena_shared<instance>(inner, to_world);
+}
+
+
+void scene_finalizer::visit_children(hittable& object) {
+    // Replacing a child by its folded form never grows its bounds, so the boxes already stored
+    // in enclosing BVHs remain valid.
+    if (!visited.insert(&object).second)
+        return;
+
+    if (auto list = dynamic_cast<hittable_list*>(&object)) {
+        for (auto& child : list->objects)
+            child = fold(child);
+    } else if (auto bvh = dynamic_cast<flat_bvh*>(&object)) {
+        // A motion tree lists every object once per time segment. Each is folded once, and
+        // all of its entries get the same result.
+        std::vector<shared_ptr<hittable>> folded(bvh->object_count());
+        for (size_t i = 0; i < bvh->primitives.size(); i++) {
+            auto& result = folded[bvh->source_index[i]];
+            if (!result)
+                result = fold(bvh->primitives[i]);
+            bvh->primitives[i] = result;
+        }
+    } else if (auto node = dynamic_cast<bvh_node*>(&object)) {
+        node->left = fold(node->left);
+        node->right = fold(node->right);
+    } else if (auto medium = dynamic_cast<constant_medium*>(&object)) {
+        medium->boundary = fold(medium->boundary);
+    } else if (auto medium = dynamic_cast<heterogeneous_medium*>(&object)) {
+        medium->boundary = fold(medium->boundary);
+    }
+}
+
+
+void scene_finalizer::bake(hittable& object) {
+    if (!baked.insert(&object).second)
+        return;
+
+    auto world_bake = [&](hittable& primitive) {
+        return [&](shared_ptr<texture> source) {
+            aabb bounds;
+            primitive.bounding_box(0, 1, bounds);
+
+            auto extent = bounds.max() - bounds.min();
+            auto longest = fmax(extent.x(), fmax(extent.y(), extent.z()));
+
+            int size[3];
+            for (int a = 0; a < 3; a++) {
+                auto points = static_cast<int>(round(bake_resolution * extent[a] / longest));
+                size[a] = std::max(points, 1);
+            }
+
+            return arena_shared<baked_texture>(source, bounds, size[0], size[1], size[2]);
+        };
+    };
+
+    if (auto list = dynamic_cast<hittable_list*>(&object)) {
+        for (auto& child : list->objects)
+            bake(*child);
+    } else if (auto bvh = dynamic_cast<flat_bvh*>(&object)) {
+        // The first time segment of a motion tree already holds every object.
+        for (size_t i = 0; i < bvh->object_count(); i++)
+            bake(*bvh->primitives[i]);
+    } else if (auto node = dynamic_cast<bvh_node*>(&object)) {
+        bake(*node->left);
+        bake(*node->right);
+    } else if (auto b = dynamic_cast<box*>(&object)) {
+        bake(b->sides);
+    } else if (auto s = dynamic_cast<sphere*>(&object)) {
+        // Longitude spans twice the angle of latitude, so it gets twice the texels.
+        bake_material(s->mat_ptr, "sphere", [&](shared_ptr<texture> source) {
+            auto center = s->center;
+            auto radius = s->radius;
+            return arena_shared<baked_texture>(
+                source, 2*bake_resolution, bake_resolution, [center, radius](double u, double v) {
+                    return center + radius * sphere::sphere_point(u, v);
+                });
+        });
+    } else if (auto s = dynamic_cast<moving_sphere*>(&object)) {
+        bake_material(s->mat_ptr, "moving sphere", world_bake(object));
+    } else if (auto r = dynamic_cast<xy_rect*>(&object)) {
+        bake_material(r->mp, "rectangle", world_bake(object));
+    } else if (auto r = dynamic_cast<xz_rect*>(&object)) {
+        bake_material(r->mp, "rectangle", world_bake(object));
+    } else if (auto r = dynamic_cast<yz_rect*>(&object)) {
+        bake_material(r->mp, "rectangle", world_bake(object));
+    } else if (auto mesh = dynamic_cast<triangle_mesh*>(&object)) {
+        bake_material(mesh->mat_ptr, "mesh", world_bake(object));
+    }
+}
+
+
+template <typename MakeBake>
+void scene_finalizer::bake_material(
+    shared_ptr<material>& mat_ptr, const char* shape, MakeBake&& make_bake
+) {
+    auto diffuse = dynamic_cast<const lambertian*>(mat_ptr.get());
+    if (!diffuse)
+        return;
+
+    auto source = diffuse->albedo;
+    const char* kind = nullptr;
+    if (dynamic_cast<const checker_texture*>(source.get()))
+        kind = "checker";
+    else if (dynamic_cast<const noise_texture*>(source.get()))
+        kind = "noise";
+    else
+        return;
+
+    auto baked_albedo = make_bake(source);
+    auto error = baked_albedo->measure_error(bake_error_samples);
+    bool keep = error.mean <= bake_tolerance;
+
+    std::cerr << "Bake: " << kind << " texture on " << shape << ", "
+              << baked_albedo->memory_bytes() / 1024 << " KiB, mean error " << error.mean
+              << ", largest " << error.max << (keep ? "\n" : ", rejected\n");
+
+    if (!keep) {
+        rejected_bakes++;
+        return;
+    }
+
+    // Materials may be shared by objects that are not baked, so this one gets its own.
+    baked_textures++;
+    baked_bytes += baked_albedo->memory_bytes();
+    auto id = mat_ptr->id;
+    mat_ptr = arena_shared<lambertian>(baked_albedo);
+    mat_ptr->id = id;
+}
+
+
+// Texture baking is skipped unless bake_resolution is positive.
+void finalize_scene(hittable_list& world, int bake_resolution = 0) {
+    scene_finalizer finalizer;
+    finalizer.bake_resolution = bake_resolution;
+    finalizer.run(world);
+}
+
+
+#endif
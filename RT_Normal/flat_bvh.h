@@ -0,0 +1,1168 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "scene_arena.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+
+// One node of a depth-first linearised BVH. The left child of an interior node always
+// directly follows it in the array, so only the right child needs to be stored. The layout is
+// plain data so that a built tree can be written to disk and used again straight from a mapping.
+struct flat_bvh_node {
+    double lo[3];
+    double hi[3];
+    uint32_t offset;   // leaf: first primitive, interior: index of the right child
+    uint32_t count;    // number of primitives in a leaf, 0 for interior nodes
+    uint32_t axis;     // split axis of an interior node
+    uint32_t aux;      // free for the owner of the tree to annotate leaves
+};
+
+static_assert(sizeof(flat_bvh_node) == 64, "flat_bvh_node should fill one cache line");
+
+const int flat_bvh_max_depth = 60;
+
+
+// A node of a tree over moving objects: the same layout, but with bounds at the start and the
+// end of a time segment, rounded outwards to floats so that both fit in one cache line.
+struct flat_bvh_motion_node {
+    float lo[2][3];
+    float hi[2][3];
+    uint32_t offset;
+    uint32_t count;
+    uint32_t axis;
+    uint32_t aux;
+};
+
+static_assert(sizeof(flat_bvh_motion_node) == 64, "flat_bvh_motion_node should fill one cache line");
+
+
+// Builds a flat_bvh_node array over a set of boxes with a binned surface area heuristic.
+// `order` lists the box indices in leaf order: leaf primitives are order[offset .. offset+count).
+// When leaves are tested `packet_width` primitives at a time, the cost of a leaf is the number
+// of packets rather than the number of primitives.
+class flat_bvh_builder {
+    public:
+        flat_bvh_builder(const std::vector<aabb>& boxes, int leaf_size = 4, int packet_width = 1);
+
+    public:
+        std::vector<flat_bvh_node> nodes;
+        std::vector<uint32_t> order;
+
+    private:
+        struct build_item {
+            aabb box;
+            point3 centroid;
+            uint32_t index;
+        };
+
+        static const int bin_count = 12;
+
+        uint32_t build(std::vector<build_item>& items, size_t start, size_t end, int depth);
+        void make_leaf(std::vector<build_item>& items, size_t start, size_t end, const aabb& box);
+
+        int max_leaf_size;
+        int packet_size;
+};
+
+
+flat_bvh_builder::flat_bvh_builder(const std::vector<aabb>& boxes, int leaf_size, int packet_width)
+    : max_leaf_size(leaf_size), packet_size(packet_width)
+{
+    std::vector<build_item> items(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        items[i].box = boxes[i];
+        items[i].centroid = 0.5 * (boxes[i].min() + boxes[i].max());
+        items[i].index = static_cast<uint32_t>(i);
+    }
+
+    order.reserve(items.size());
+    nodes.reserve(2 * items.size() / leaf_size + 1);
+
+    if (!items.empty())
+        build(items, 0, items.size(), 0);
+}
+
+
+void flat_bvh_builder::make_leaf(
+    std::vector<build_item>& items, size_t start, size_t end, const aabb& box
+) {
+    flat_bvh_node node = {};
+    for (int a = 0; a < 3; a++) {
+        node.lo[a] = box.min()[a];
+        node.hi[a] = box.max()[a];
+    }
+    node.offset = static_cast<uint32_t>(order.size());
+    node.count = static_cast<uint32_t>(end - start);
+
+    for (size_t i = start; i < end; i++)
+        order.push_back(items[i].index);
+
+    nodes.push_back(node);
+}
+
+
+uint32_t flat_bvh_builder::build(std::vector<build_item>& items, size_t start, size_t end, int depth) {
+    auto node_index = static_cast<uint32_t>(nodes.size());
+    auto count = end - start;
+
+    aabb box = items[start].box;
+    aabb centroid_box(items[start].centroid, items[start].centroid);
+    for (size_t i = start + 1; i < end; i++) {
+        box = surrounding_box(box, items[i].box);
+        centroid_box = surrounding_box(centroid_box, aabb(items[i].centroid, items[i].centroid));
+    }
+
+    int axis = centroid_box.longest_axis();
+    auto extent = centroid_box.max()[axis] - centroid_box.min()[axis];
+
+    if (count <= 1 || extent <= 0 || depth >= flat_bvh_max_depth) {
+        make_leaf(items, start, end, box);
+        return node_index;
+    }
+
+    // Binned surface area heuristic along the longest centroid axis.
+    struct bin {
+        aabb box;
+        size_t count = 0;
+    } bins[bin_count];
+
+    auto bin_of = [&](const build_item& item) {
+        auto b = static_cast<int>(bin_count * (item.centroid[axis] - centroid_box.min()[axis]) / extent);
+        return b < bin_count ? b : bin_count - 1;
+    };
+
+    for (size_t i = start; i < end; i++) {
+        auto& b = bins[bin_of(items[i])];
+        b.box = b.count == 0 ? items[i].box : surrounding_box(b.box, items[i].box);
+        b.count++;
+    }
+
+    double best_cost = infinity;
+    int best_split = -1;
+
+    for (int split = 1; split < bin_count; split++) {
+        aabb left_box, right_box;
+        size_t left_count = 0, right_count = 0;
+
+        for (int b = 0; b < split; b++) {
+            if (bins[b].count == 0) continue;
+            left_box = left_count == 0 ? bins[b].box : surrounding_box(left_box, bins[b].box);
+            left_count += bins[b].count;
+        }
+        for (int b = split; b < bin_count; b++) {
+            if (bins[b].count == 0) continue;
+            right_box = right_count == 0 ? bins[b].box : surrounding_box(right_box, bins[b].box);
+            right_count += bins[b].count;
+        }
+
+        if (left_count == 0 || right_count == 0)
+            continue;
+
+        auto cost = left_box.area()*left_count + right_box.area()*right_count;
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = split;
+        }
+    }
+
+    // Traversal is taken to cost about as much as one primitive (or packet) test.
+    auto leaf_cost = static_cast<double>((count + packet_size - 1) / packet_size);
+    auto split_cost = 1.0 + best_cost / box.area() / packet_size;
+
+    if (best_split < 0 || (count <= static_cast<size_t>(max_leaf_size) && leaf_cost <= split_cost)) {
+        make_leaf(items, start, end, box);
+        return node_index;
+    }
+
+    auto middle = std::partition(items.begin() + start, items.begin() + end,
+        [&](const build_item& item) { return bin_of(item) < best_split; });
+    auto mid = static_cast<size_t>(middle - items.begin());
+
+    flat_bvh_node node = {};
+    for (int a = 0; a < 3; a++) {
+        node.lo[a] = box.min()[a];
+        node.hi[a] = box.max()[a];
+    }
+    node.axis = static_cast<uint32_t>(axis);
+    nodes.push_back(node);
+
+    build(items, start, mid, depth + 1);
+    nodes[node_index].offset = build(items, mid, end, depth + 1);
+
+    return node_index;
+}
+
+
+// Recomputes the bounds of every node of a built tree from new primitive boxes, indexed as the
+// boxes given to the builder were. Children always follow their parent in the array, so one
+// backwards sweep sees both children of a node before the node itself.
+std::vector<aabb> fit_flat_bvh_bounds(
+    const std::vector<flat_bvh_node>& nodes, const std::vector<uint32_t>& order,
+    const std::vector<aabb>& boxes
+) {
+    std::vector<aabb> bounds(nodes.size());
+
+    for (size_t i = nodes.size(); i-- > 0;) {
+        const auto& node = nodes[i];
+
+        if (node.count > 0) {
+            bounds[i] = boxes[order[node.offset]];
+            for (uint32_t j = node.offset + 1; j < node.offset + node.count; j++)
+                bounds[i] = surrounding_box(bounds[i], boxes[order[j]]);
+        } else {
+            bounds[i] = surrounding_box(bounds[i + 1], bounds[node.offset]);
+        }
+    }
+
+    return bounds;
+}
+
+
+// Motion node bounds are floats, rounded outwards so that they still contain the boxes.
+inline float float_below(double x) {
+    auto f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float float_above(double x) {
+    auto f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, INFINITY) : f;
+}
+
+
+// Sets a motion node's bounds from its boxes at the start and end of its segment. Traversal
+// interpolates the bounds in single precision, which can land a few ulps of the larger end
+// inside the exact value, so each coordinate is padded by 2^-20 of the larger end first.
+inline void set_motion_node_bounds(flat_bvh_motion_node& node, const aabb& start, const aabb& end) {
+    for (int a = 0; a < 3; a++) {
+        auto lo_pad = ldexp(fmax(fabs(start.min()[a]), fabs(end.min()[a])), -20);
+        auto hi_pad = ldexp(fmax(fabs(start.max()[a]), fabs(end.max()[a])), -20);
+        node.lo[0][a] = float_below(start.min()[a] - lo_pad);
+        node.lo[1][a] = float_below(end.min()[a] - lo_pad);
+        node.hi[0][a] = float_above(start.max()[a] + hi_pad);
+        node.hi[1][a] = float_above(end.max()[a] + hi_pad);
+    }
+}
+
+
+// Whether an object whose box is box0, box_mid and box1 at the start, middle and end of an
+// interval stays inside the boxes interpolated between the two ends.
+inline bool moves_linearly(const aabb& box0, const aabb& box_mid, const aabb& box1) {
+    for (int a = 0; a < 3; a++) {
+        if (box_mid.min()[a] < 0.5*(box0.min()[a] + box1.min()[a]) - 1e-9
+            || box_mid.max()[a] > 0.5*(box0.max()[a] + box1.max()[a]) + 1e-9)
+            return false;
+    }
+    return true;
+}
+
+
+// Calls body(begin, end) over [0, count) split among up to `thread_count` threads.
+template <typename Body>
+void flat_bvh_parallel_for(size_t count, int thread_count, Body&& body) {
+    if (thread_count <= 1 || count < 2) {
+        body(size_t(0), count);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    auto chunk = (count + thread_count - 1) / thread_count;
+    for (size_t start = 0; start < count; start += chunk)
+        threads.emplace_back([&, start] { body(start, std::min(start + chunk, count)); });
+    for (auto& t : threads)
+        t.join();
+}
+
+
+// Slab tests scale the far distance of each slab up by 2*gamma(3) (Ize, "Robust BVH Ray
+// Traversal", JCGT 2013) and accept a ray that only touches a box, so that rounding never
+// culls a box holding a hit the watertight triangle test would find, including the zero
+// thickness boxes of axis-aligned flat triangles.
+constexpr double flat_bvh_slab_slack =
+    1 + 2 * (3 * 0.5 * std::numeric_limits<double>::epsilon())
+          / (1 - 3 * 0.5 * std::numeric_limits<double>::epsilon());
+
+
+inline bool flat_bvh_node_hit(
+    const flat_bvh_node& node, const point3& origin, const vec3& inv_dir, double t_min, double t_max
+) {
+    for (int a = 0; a < 3; a++) {
+        auto t0 = (node.lo[a] - origin[a]) * inv_dir[a];
+        auto t1 = (node.hi[a] - origin[a]) * inv_dir[a];
+        if (inv_dir[a] < 0)
+            std::swap(t0, t1);
+        t1 *= flat_bvh_slab_slack;
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    return true;
+}
+
+
+// Per-ray constants of the motion node slab test.
+struct flat_bvh_motion_ray {
+    point3 origin;
+    vec3 inv_dir;
+    double time_fraction;
+#ifdef RTW_SSE
+    // The same in single precision. The origin rounded up is subtracted from lower bounds and
+    // rounded down from upper ones, which can only move each slab outwards. The unused fourth
+    // lane of inv_dir4 is NaN, so that lane drops out of the minimum and maximum. Rays
+    // parallel to an axis would give NaN distances in the other lanes too, and use the
+    // scalar test instead.
+    __m128 origin_up, origin_down, inv_dir4, time_fraction4;
+    bool axis_parallel;
+#endif
+
+    flat_bvh_motion_ray(const ray& r, const vec3& inv, double fraction)
+        : origin(r.origin()), inv_dir(inv), time_fraction(fraction)
+    {
+#ifdef RTW_SSE
+        const float inv_x = float(inv.x()), inv_y = float(inv.y()), inv_z = float(inv.z());
+        axis_parallel = std::isinf(inv_x) || std::isinf(inv_y) || std::isinf(inv_z);
+        origin_up = _mm_setr_ps(
+            float_above(origin.x()), float_above(origin.y()), float_above(origin.z()), 0);
+        origin_down = _mm_setr_ps(
+            float_below(origin.x()), float_below(origin.y()), float_below(origin.z()), 0);
+        inv_dir4 = _mm_setr_ps(inv_x, inv_y, inv_z, std::numeric_limits<float>::quiet_NaN());
+        time_fraction4 = _mm_set1_ps(float(fraction));
+#endif
+    }
+};
+
+
+// Slab test against the node's bounds at the ray's fraction of the way through the node's time
+// segment. Objects that move linearly have boxes that are linear in time, and the union of such
+// boxes stays inside the interpolated union. With SSE the three axes are tested at once in
+// single precision; the padding of set_motion_node_bounds and a slack of 2^-20 on the far
+// distances, well above 2*gamma(3) for floats, keep the test conservative.
+inline bool flat_bvh_node_hit(
+    const flat_bvh_motion_node& node, const flat_bvh_motion_ray& mr, double t_min, double t_max
+) {
+#ifdef RTW_SSE
+    if (!mr.axis_parallel) {
+        // The fourth lane of hi[1] is the node's offset, whose bits can be a denormal float.
+        const __m128 xyz = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+        const __m128 lo0 = _mm_loadu_ps(node.lo[0]), lo1 = _mm_loadu_ps(node.lo[1]);
+        const __m128 hi0 = _mm_loadu_ps(node.hi[0]);
+        const __m128 hi1 = _mm_and_ps(_mm_loadu_ps(node.hi[1]), xyz);
+        const __m128 lo = _mm_add_ps(lo0, _mm_mul_ps(mr.time_fraction4, _mm_sub_ps(lo1, lo0)));
+        const __m128 hi = _mm_add_ps(hi0, _mm_mul_ps(mr.time_fraction4, _mm_sub_ps(hi1, hi0)));
+
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(lo, mr.origin_up), mr.inv_dir4);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(hi, mr.origin_down), mr.inv_dir4);
+
+        // With a NaN operand max and min return the second one, the interval so far.
+        const __m128 slack = _mm_set1_ps(1 + 0x1p-20f);
+        __m128 near = _mm_max_ps(_mm_min_ps(t0, t1), _mm_set1_ps(float(t_min)));
+        __m128 far = _mm_min_ps(_mm_mul_ps(_mm_max_ps(t0, t1), slack),
+                                _mm_mul_ps(_mm_set1_ps(float(t_max)), slack));
+        near = _mm_max_ps(near, _mm_shuffle_ps(near, near, _MM_SHUFFLE(2, 3, 0, 1)));
+        near = _mm_max_ps(near, _mm_shuffle_ps(near, near, _MM_SHUFFLE(1, 0, 3, 2)));
+        far = _mm_min_ps(far, _mm_shuffle_ps(far, far, _MM_SHUFFLE(2, 3, 0, 1)));
+        far = _mm_min_ps(far, _mm_shuffle_ps(far, far, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_comile_ss(near, far);
+    }
+#endif
+
+    for (int a = 0; a < 3; a++) {
+        auto lo = node.lo[0][a] + mr.time_fraction * (node.lo[1][a] - node.lo[0][a]);
+        auto hi = node.hi[0][a] + mr.time_fraction * (node.hi[1][a] - node.hi[0][a]);
+        auto t0 = (lo - mr.origin[a]) * mr.inv_dir[a];
+        auto t1 = (hi - mr.origin[a]) * mr.inv_dir[a];
+        if (mr.inv_dir[a] < 0)
+            std::swap(t0, t1);
+        t1 *= flat_bvh_slab_slack;
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min)
+            return false;
+    }
+    return true;
+}
+
+
+// Closest-hit traversal of a flat_bvh_node or flat_bvh_motion_node array, starting at node
+// `root`. Motion node bounds are interpolated to `time_fraction`. For every leaf the ray
+// reaches, leaf_hit(node, t_max) tests the leaf's primitives and returns true if it found a
+// hit, in which case t_max must have been lowered to the distance of that hit. With `any_hit`
+// the traversal stops at the first leaf that reports a hit instead.
+template <bool any_hit = false, typename Node, typename LeafHit>
+bool traverse_flat_bvh(
+    const Node* nodes, uint32_t root, double time_fraction,
+    const ray& r, double t_min, double t_max, LeafHit&& leaf_hit
+) {
+    const auto origin = r.origin();
+    const vec3 inv_dir(1/r.direction().x(), 1/r.direction().y(), 1/r.direction().z());
+    const bool dir_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+    const flat_bvh_motion_ray motion_ray(r, inv_dir, time_fraction);
+
+    uint32_t stack[flat_bvh_max_depth + 4];
+    int stack_size = 0;
+    uint32_t current = root;
+    bool hit_anything = false;
+
+    while (true) {
+        const auto& node = nodes[current];
+
+        bool reached;
+        if constexpr (std::is_same_v<Node, flat_bvh_motion_node>)
+            reached = flat_bvh_node_hit(node, motion_ray, t_min, t_max);
+        else
+            reached = flat_bvh_node_hit(node, origin, inv_dir, t_min, t_max);
+
+        if (reached) {
+            if (node.count > 0) {
+                if (leaf_hit(node, t_max)) {
+                    if constexpr (any_hit)
+                        return true;
+                    hit_anything = true;
+                }
+            } else {
+                // Visit the child nearer to the ray origin first.
+                if (dir_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+
+    return hit_anything;
+}
+
+
+template <bool any_hit = false, typename LeafHit>
+bool traverse_flat_bvh(
+    const flat_bvh_node* nodes, const ray& r, double t_min, double t_max, LeafHit&& leaf_hit
+) {
+    return traverse_flat_bvh<any_hit>(
+        nodes, 0, 0.0, r, t_min, t_max, std::forward<LeafHit>(leaf_hit));
+}
+
+
+// One past the last node of the subtree rooted at `root`, found by following right children
+// down to the last leaf.
+template <typename Node>
+uint32_t flat_bvh_subtree_end(const Node* nodes, uint32_t root) {
+    while (nodes[root].count == 0)
+        root = nodes[root].offset;
+    return root + 1;
+}
+
+
+const int flat_bvh_max_segments = 8;
+
+// Motion trees pay for themselves through the SSE motion node test. The double-precision
+// fallback costs about as much per node as the primitive tests the trees save, so without SSE
+// moving objects keep their swept boxes unless asked otherwise.
+#ifdef RTW_SSE
+const bool flat_bvh_track_motion = true;
+#else
+const bool flat_bvh_track_motion = false;
+#endif
+
+
+// A BVH over arbitrary hittables. If some of them move during the shutter interval, the
+// interval is cut into segments, each with its own tree of motion nodes split on where things
+// are during that segment. Node bounds are interpolated to each ray's time, so a ray only
+// visits nodes near where the geometry is at that instant rather than everywhere it passes.
+// The segment trees are stored one after another in the node array.
+class flat_bvh : public hittable {
+    public:
+        flat_bvh() {}
+
+        // The node pointers refer to the tree's own storage, so it can be moved, which
+        // rebuild() relies on, but not copied; replicate() makes a copy with its own nodes.
+        flat_bvh(const flat_bvh&) = delete;
+        flat_bvh& operator=(const flat_bvh&) = delete;
+        flat_bvh(flat_bvh&&) = default;
+        flat_bvh& operator=(flat_bvh&&) = default;
+
+        flat_bvh(
+            const hittable_list& list, double time0, double time1,
+            bool track_motion = flat_bvh_track_motion, int leaf_size = 4)
+            : flat_bvh(list.objects, time0, time1, track_motion, leaf_size)
+        {}
+
+        // With track_motion false, moving objects are bounded by their boxes over the whole
+        // interval, as bvh_node does. Leaves hold up to `leaf_size` primitives.
+        flat_bvh(
+            const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1,
+            bool track_motion = flat_bvh_track_motion, int leaf_size = 4);
+
+        // Adopt a node array that was built earlier for the same objects. `order` maps each
+        // leaf slot to an index into src_objects and `owner` keeps the node memory alive.
+        flat_bvh(
+            const std::vector<shared_ptr<hittable>>& src_objects,
+            const uint32_t* order, const flat_bvh_node* node_array, size_t count,
+            shared_ptr<const void> owner);
+
+        flat_bvh(
+            const std::vector<shared_ptr<hittable>>& src_objects,
+            const uint32_t* order, const flat_bvh_motion_node* node_array, size_t count,
+            int segments, double time0, double time1, shared_ptr<const void> owner);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
+        // Exactly one of these is non-null for a non-empty tree.
+        const flat_bvh_node* node_data() const { return nodes; }
+        const flat_bvh_motion_node* motion_node_data() const { return motion_nodes; }
+
+        size_t node_count() const { return num_nodes; }
+
+        // A tree over the same primitives with its own copy of the nodes, placed wherever the
+        // calling thread's first writes put it. Nodes from a mapped cache file are copied too.
+        shared_ptr<flat_bvh> replicate() const;
+        // Number of time segments in a tree of motion nodes, 0 for a static tree.
+        int segment_count() const { return static_cast<int>(segment_roots.size()); }
+
+        // Number of objects the tree was built over. A motion tree holds each of them once
+        // per segment, so this is less than primitives.size().
+        size_t object_count() const {
+            return primitives.size() / std::max(segment_count(), 1);
+        }
+
+        // Recomputes the node bounds for where the primitives are during [time0, time1],
+        // keeping the shape of the tree, so that it follows objects that have moved. Subtrees
+        // are refitted on `thread_count` threads. A motion tree keeps its segments, spread
+        // over the new interval. Nodes adopted from a cache file are copied first.
+        void refit(double time0, double time1, int thread_count = 1);
+
+        // Builds the tree again from scratch over the same primitives for [time0, time1], with
+        // the settings it was first built with.
+        void rebuild(double time0, double time1);
+
+        // The surface area heuristic cost of the tree: the expected number of nodes visited
+        // and primitives tested by a ray through the root's box, averaged over the segments
+        // of a motion tree. Refitting lets it grow as objects move away from where the tree
+        // was split.
+        double sah_cost() const;
+
+    public:
+        double built_cost = 0;   // sah_cost() when the tree was built
+
+    private:
+        void find_segment_roots(int segments);
+        void own_nodes();
+
+        template <bool any_hit = false, typename LeafHit>
+        bool traverse(const ray& r, double t_min, double t_max, LeafHit&& leaf_hit) const;
+
+    public:
+        scene_vector<shared_ptr<hittable>> primitives;  // in leaf order, one run per segment
+        scene_vector<uint32_t> source_index;            // primitives[i] is src_objects[source_index[i]]
+
+    private:
+        scene_vector<flat_bvh_node> storage;
+        scene_vector<flat_bvh_motion_node> motion_storage;
+        shared_ptr<const void> external;
+        const flat_bvh_node* nodes = nullptr;
+        const flat_bvh_motion_node* motion_nodes = nullptr;
+        size_t num_nodes = 0;
+        std::vector<uint32_t> segment_roots;
+        double start_time = 0;
+        double end_time = 1;
+        bool tracks_motion = flat_bvh_track_motion;
+        int max_leaf_size = 4;
+};
+
+
+flat_bvh::flat_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects, double time0, double time1,
+    bool track_motion, int leaf_size
+) : start_time(time0), end_time(time1), tracks_motion(track_motion), max_leaf_size(leaf_size) {
+    auto n = src_objects.size();
+
+    std::vector<aabb> boxes(n);
+    for (size_t i = 0; i < n; i++) {
+        if (!src_objects[i]->bounding_box(time0, time1, boxes[i]))
+            std::cerr << "No bounding box in flat_bvh constructor.\n";
+    }
+
+    // Boxes at either end of the shutter for the objects that move.
+    std::vector<aabb> start_boxes = boxes, end_boxes = boxes;
+    std::vector<bool> moves(n, false);
+    double travel = 0, size = 0;
+    int moving_count = 0;
+
+    if (track_motion && time1 > time0) {
+        auto time_mid = 0.5 * (time0 + time1);
+
+        for (size_t i = 0; i < n; i++) {
+            aabb box0, box1, box_mid;
+            if (!src_objects[i]->bounding_box(time0, time0, box0)
+                || !src_objects[i]->bounding_box(time1, time1, box1)
+                || !src_objects[i]->bounding_box(time_mid, time_mid, box_mid))
+                continue;
+
+            bool same = true;
+            for (int a = 0; a < 3; a++)
+                same = same && box0.min()[a] == box1.min()[a] && box0.max()[a] == box1.max()[a];
+
+            // Objects whose box does not move linearly keep their swept box throughout.
+            if (same || !moves_linearly(box0, box_mid, box1))
+                continue;
+
+            moves[i] = true;
+            start_boxes[i] = box0;
+            end_boxes[i] = box1;
+            moving_count++;
+            travel += (0.5*(box1.min() + box1.max()) - 0.5*(box0.min() + box0.max())).length();
+            size += (box0.max() - box0.min()).length();
+        }
+    }
+
+    int segments = 0;
+
+    if (moving_count == 0) {
+        flat_bvh_builder builder(boxes, leaf_size);
+        storage.assign(builder.nodes.begin(), builder.nodes.end());
+        source_index.assign(builder.order.begin(), builder.order.end());
+    } else {
+        // Enough segments that an average moving object travels about its own size in each.
+        auto wanted = size > 0 ? ceil(travel / size) : flat_bvh_max_segments;
+        segments = static_cast<int>(fmin(fmax(wanted, 1), flat_bvh_max_segments));
+
+        auto box_at = [&](size_t i, double f) {
+            if (!moves[i])
+                return boxes[i];
+            return aabb(start_boxes[i].min() + f*(end_boxes[i].min() - start_boxes[i].min()),
+                        start_boxes[i].max() + f*(end_boxes[i].max() - start_boxes[i].max()));
+        };
+
+        std::vector<aabb> split_boxes(n), segment_start(n), segment_end(n);
+        std::vector<flat_bvh_motion_node> segment_nodes;
+        std::vector<uint32_t> segment_order;
+
+        for (int k = 0; k < segments; k++) {
+            auto f0 = double(k) / segments;
+            auto f1 = double(k + 1) / segments;
+            for (size_t i = 0; i < n; i++) {
+                segment_start[i] = box_at(i, f0);
+                segment_end[i] = box_at(i, f1);
+                split_boxes[i] = box_at(i, 0.5*(f0 + f1));
+            }
+
+            // Split on the boxes halfway through the segment, which say where an object is
+            // better than its swept box does, then bound both ends of the segment.
+            flat_bvh_builder builder(split_boxes, leaf_size);
+            auto start_bounds = fit_flat_bvh_bounds(builder.nodes, builder.order, segment_start);
+            auto end_bounds = fit_flat_bvh_bounds(builder.nodes, builder.order, segment_end);
+
+            auto node_base = static_cast<uint32_t>(segment_nodes.size());
+            auto leaf_base = static_cast<uint32_t>(segment_order.size());
+
+            for (size_t i = 0; i < builder.nodes.size(); i++) {
+                const auto& node = builder.nodes[i];
+                flat_bvh_motion_node m = {};
+                set_motion_node_bounds(m, start_bounds[i], end_bounds[i]);
+                m.offset = node.offset + (node.count > 0 ? leaf_base : node_base);
+                m.count = node.count;
+                m.axis = node.axis;
+                m.aux = node.aux;
+                segment_nodes.push_back(m);
+            }
+            segment_order.insert(segment_order.end(), builder.order.begin(), builder.order.end());
+        }
+
+        motion_storage.assign(segment_nodes.begin(), segment_nodes.end());
+        source_index.assign(segment_order.begin(), segment_order.end());
+    }
+
+    primitives.reserve(source_index.size());
+    for (auto index : source_index)
+        primitives.push_back(src_objects[index]);
+
+    if (!motion_storage.empty()) {
+        motion_nodes = motion_storage.data();
+        num_nodes = motion_storage.size();
+        find_segment_roots(segments);
+    } else {
+        nodes = storage.data();
+        num_nodes = storage.size();
+    }
+
+    built_cost = sah_cost();
+}
+
+
+flat_bvh::flat_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects,
+    const uint32_t* order, const flat_bvh_node* node_array, size_t count,
+    shared_ptr<const void> owner
+) : source_index(order, order + src_objects.size()),
+    external(owner),
+    nodes(node_array),
+    num_nodes(count)
+{
+    primitives.reserve(src_objects.size());
+    for (auto index : source_index)
+        primitives.push_back(src_objects[index]);
+
+    built_cost = sah_cost();
+}
+
+
+flat_bvh::flat_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects,
+    const uint32_t* order, const flat_bvh_motion_node* node_array, size_t count,
+    int segments, double time0, double time1, shared_ptr<const void> owner
+) : source_index(order, order + segments * src_objects.size()),
+    external(owner),
+    motion_nodes(node_array),
+    num_nodes(count),
+    start_time(time0),
+    end_time(time1)
+{
+    primitives.reserve(source_index.size());
+    for (auto index : source_index)
+        primitives.push_back(src_objects[index]);
+
+    find_segment_roots(segments);
+    built_cost = sah_cost();
+}
+
+
+void flat_bvh::find_segment_roots(int segments) {
+    segment_roots.resize(segments);
+    segment_roots[0] = 0;
+    for (int k = 1; k < segments; k++)
+        segment_roots[k] = flat_bvh_subtree_end(motion_nodes, segment_roots[k-1]);
+}
+
+
+// Runs traverse_flat_bvh over the static tree, or over the motion tree of the time segment
+// that holds the ray's time.
+template <bool any_hit, typename LeafHit>
+bool flat_bvh::traverse(const ray& r, double t_min, double t_max, LeafHit&& leaf_hit) const {
+    if (num_nodes == 0)
+        return false;
+
+    if (nodes)
+        return traverse_flat_bvh<any_hit>(nodes, r, t_min, t_max, leaf_hit);
+
+    // Rays outside the shutter use the nearest segment, extrapolated.
+    auto segments = segment_count();
+    auto f = segments * (r.time() - start_time) / (end_time - start_time);
+    auto k = static_cast<int>(fmin(fmax(floor(f), 0), segments - 1));
+
+    return traverse_flat_bvh<any_hit>(
+        motion_nodes, segment_roots[k], f - k, r, t_min, t_max, leaf_hit);
+}
+
+
+bool flat_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    // As in hittable_list, ids only name objects of a tree over more than one. A motion tree
+    // holds each object once per segment, so that is not the number of primitives.
+    const bool name_objects = object_count() > 1;
+
+    return traverse(r, t_min, t_max,
+        [&](const auto& leaf, double& closest) {
+            bool hit_leaf = false;
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+                if (primitives[i]->hit(r, t_min, closest, rec)) {
+                    hit_leaf = true;
+                    closest = rec.t;
+                    if (name_objects)
+                        rec.object_id = static_cast<int>(source_index[i]);
+                }
+            }
+            return hit_leaf;
+        });
+}
+
+
+bool flat_bvh::occluded(const ray& r, double t_min, double t_max) const {
+    return traverse<true>(r, t_min, t_max,
+        [&](const auto& leaf, double&) {
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; i++) {
+                if (primitives[i]->occluded(r, t_min, t_max))
+                    return true;
+            }
+            return false;
+        });
+}
+
+
+shared_ptr<flat_bvh> flat_bvh::replicate() const {
+    auto copy = make_shared<flat_bvh>();
+    copy->primitives = primitives;
+    copy->source_index = source_index;
+    copy->num_nodes = num_nodes;
+    copy->segment_roots = segment_roots;
+    copy->start_time = start_time;
+    copy->end_time = end_time;
+    copy->built_cost = built_cost;
+    copy->tracks_motion = tracks_motion;
+    copy->max_leaf_size = max_leaf_size;
+
+    if (nodes) {
+        copy->storage.assign(nodes, nodes + num_nodes);
+        copy->nodes = copy->storage.data();
+    } else if (motion_nodes) {
+        copy->motion_storage.assign(motion_nodes, motion_nodes + num_nodes);
+        copy->motion_nodes = copy->motion_storage.data();
+    }
+
+    return copy;
+}
+
+
+bool flat_bvh::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    // Every leaf along the ray contributes, so the range is never narrowed.
+    bool found = false;
+    traverse(r, t_min, t_max,
+        [&](const auto& leaf, double&) {
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; i++)
+                found |= primitives[i]->intervals(r, t_min, t_max, out);
+            return false;
+        });
+    return found;
+}
+
+
+bool flat_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (num_nodes == 0)
+        return false;
+
+    if (nodes) {
+        output_box = aabb(point3(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]),
+                          point3(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]));
+        return true;
+    }
+
+    // The box around every segment root at both ends of its segment.
+    bool first = true;
+    for (auto root : segment_roots) {
+        const auto& node = motion_nodes[root];
+        for (int end = 0; end < 2; end++) {
+            aabb box(point3(node.lo[end][0], node.lo[end][1], node.lo[end][2]),
+                     point3(node.hi[end][0], node.hi[end][1], node.hi[end][2]));
+            output_box = first ? box : surrounding_box(output_box, box);
+            first = false;
+        }
+    }
+
+    return true;
+}
+
+
+void flat_bvh::own_nodes() {
+    if (nodes && nodes != storage.data()) {
+        storage.assign(nodes, nodes + num_nodes);
+        nodes = storage.data();
+    } else if (motion_nodes && motion_nodes != motion_storage.data()) {
+        motion_storage.assign(motion_nodes, motion_nodes + num_nodes);
+        motion_nodes = motion_storage.data();
+    }
+    external.reset();
+}
+
+
+// Splits the subtree under `root` into the subtrees `levels` below it, which can be refitted
+// independently since each is a contiguous run of nodes, and the nodes above them, listed in
+// array order in `top`.
+template <typename Node>
+void flat_bvh_split_subtrees(
+    const Node* nodes, uint32_t root, int levels, std::vector<uint32_t>& subtrees,
+    std::vector<uint32_t>& top
+) {
+    if (levels == 0 || nodes[root].count > 0) {
+        subtrees.push_back(root);
+        return;
+    }
+
+    top.push_back(root);
+    flat_bvh_split_subtrees(nodes, root + 1, levels - 1, subtrees, top);
+    flat_bvh_split_subtrees(nodes, nodes[root].offset, levels - 1, subtrees, top);
+}
+
+
+void flat_bvh::refit(double time0, double time1, int thread_count) {
+    start_time = time0;
+    end_time = time1;
+    if (num_nodes == 0)
+        return;
+
+    own_nodes();
+
+    // Boxes for the primitives in leaf order: over the whole interval for a static tree, and
+    // at either end of its segment for a motion tree.
+    auto segments = std::max(segment_count(), 1);
+    auto per_segment = primitives.size() / segments;
+    std::vector<aabb> start_boxes(primitives.size());
+    std::vector<aabb> end_boxes(motion_nodes ? primitives.size() : 0);
+
+    flat_bvh_parallel_for(primitives.size(), thread_count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (!motion_nodes) {
+                primitives[i]->bounding_box(time0, time1, start_boxes[i]);
+                continue;
+            }
+
+            auto k = static_cast<double>(i / per_segment);
+            auto ta = time0 + (time1 - time0) * k / segments;
+            auto tb = time0 + (time1 - time0) * (k + 1) / segments;
+            auto tm = 0.5 * (ta + tb);
+            aabb box_mid;
+            primitives[i]->bounding_box(ta, ta, start_boxes[i]);
+            primitives[i]->bounding_box(tb, tb, end_boxes[i]);
+            primitives[i]->bounding_box(tm, tm, box_mid);
+
+            // As when building, an object that does not move linearly keeps its swept box.
+            if (!moves_linearly(start_boxes[i], box_mid, end_boxes[i])) {
+                primitives[i]->bounding_box(ta, tb, start_boxes[i]);
+                end_boxes[i] = start_boxes[i];
+            }
+        }
+    });
+
+    auto leaf_box = [](const std::vector<aabb>& boxes, uint32_t offset, uint32_t count) {
+        auto box = boxes[offset];
+        for (uint32_t j = offset + 1; j < offset + count; j++)
+            box = surrounding_box(box, boxes[j]);
+        return box;
+    };
+
+    // Children follow their parent, so a backwards sweep fits both before the parent.
+    auto fit_node = [&](uint32_t i) {
+        if (nodes) {
+            auto& node = storage[i];
+            if (node.count > 0) {
+                auto box = leaf_box(start_boxes, node.offset, node.count);
+                for (int a = 0; a < 3; a++) {
+                    node.lo[a] = box.min()[a];
+                    node.hi[a] = box.max()[a];
+                }
+            } else {
+                const auto& left = storage[i + 1];
+                const auto& right = storage[node.offset];
+                for (int a = 0; a < 3; a++) {
+                    node.lo[a] = fmin(left.lo[a], right.lo[a]);
+                    node.hi[a] = fmax(left.hi[a], right.hi[a]);
+                }
+            }
+        } else {
+            auto& node = motion_storage[i];
+            if (node.count > 0) {
+                set_motion_node_bounds(node, leaf_box(start_boxes, node.offset, node.count),
+                                       leaf_box(end_boxes, node.offset, node.count));
+            } else {
+                // Padded again on top of the children's padding, since the padding depends on
+                // the magnitude of the node's own bounds.
+                const auto& left = motion_storage[i + 1];
+                const auto& right = motion_storage[node.offset];
+                aabb box[2];
+                for (int end = 0; end < 2; end++) {
+                    point3 lo, hi;
+                    for (int a = 0; a < 3; a++) {
+                        lo[a] = std::min(left.lo[end][a], right.lo[end][a]);
+                        hi[a] = std::max(left.hi[end][a], right.hi[end][a]);
+                    }
+                    box[end] = aabb(lo, hi);
+                }
+                set_motion_node_bounds(node, box[0], box[1]);
+            }
+        }
+    };
+
+    // Enough subtrees to keep every thread busy, then the few nodes above them.
+    int levels = 0;
+    while (thread_count > 1 && (1 << levels) < 4 * thread_count)
+        levels++;
+
+    std::vector<uint32_t> subtrees, top;
+    auto roots = motion_nodes ? segment_roots : std::vector<uint32_t>{ 0 };
+    for (auto root : roots) {
+        if (nodes)
+            flat_bvh_split_subtrees(nodes, root, levels, subtrees, top);
+        else
+            flat_bvh_split_subtrees(motion_nodes, root, levels, subtrees, top);
+    }
+
+    flat_bvh_parallel_for(subtrees.size(), thread_count, [&](size_t begin, size_t end) {
+        for (size_t s = begin; s < end; s++) {
+            auto root = subtrees[s];
+            auto last = nodes ? flat_bvh_subtree_end(nodes, root)
+                              : flat_bvh_subtree_end(motion_nodes, root);
+            for (auto i = last; i-- > root;)
+                fit_node(i);
+        }
+    });
+
+    for (auto i = top.rbegin(); i != top.rend(); ++i)
+        fit_node(*i);
+}
+
+
+void flat_bvh::rebuild(double time0, double time1) {
+    // The first segment's primitives are each source object once.
+    auto count = object_count();
+    std::vector<shared_ptr<hittable>> src_objects(count);
+    for (size_t i = 0; i < count; i++)
+        src_objects[source_index[i]] = primitives[i];
+
+    *this = flat_bvh(src_objects, time0, time1, tracks_motion, max_leaf_size);
+}
+
+
+double flat_bvh::sah_cost() const {
+    if (num_nodes == 0)
+        return 0;
+
+    auto area = [](const auto& lo, const auto& hi) {
+        double x = hi[0] - lo[0], y = hi[1] - lo[1], z = hi[2] - lo[2];
+        return 2 * (x*y + y*z + z*x);
+    };
+    auto node_area = [&](size_t i) {
+        if (nodes)
+            return area(nodes[i].lo, nodes[i].hi);
+        const auto& node = motion_nodes[i];
+        return 0.5 * (area(node.lo[0], node.hi[0]) + area(node.lo[1], node.hi[1]));
+    };
+    auto node_count = [&](size_t i) { return nodes ? nodes[i].count : motion_nodes[i].count; };
+
+    auto roots = motion_nodes ? segment_roots : std::vector<uint32_t>{ 0 };
+    double cost = 0;
+    for (auto root : roots) {
+        auto root_area = node_area(root);
+        if (root_area <= 0)
+            continue;
+
+        auto last = nodes ? flat_bvh_subtree_end(nodes, root)
+                          : flat_bvh_subtree_end(motion_nodes, root);
+        double segment_cost = 0;
+        for (auto i = root; i < last; i++)
+            segment_cost += node_area(i) * std::max<uint32_t>(node_count(i), 1);
+        cost += segment_cost / root_area;
+    }
+
+    return cost / roots.size();
+}
+
+
+// Keeps the BVHs of an animated scene fitted to each frame. Each update refits, and rebuilds
+// instead once refitting has let a tree's cost grow past `rebuild_ratio` times what it was
+// when last built.
+struct flat_bvh_updater {
+    double rebuild_ratio = 1.5;
+    int thread_count = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    int refits = 0;
+    int rebuilds = 0;
+    double refit_ms = 0;
+    double rebuild_ms = 0;
+
+    // Updates `bvh` for [time0, time1]. Returns true if it was rebuilt.
+    bool update(flat_bvh& bvh, double time0, double time1);
+
+    // Updates every tree in `world`, the ones under instances and rotate_y wrappers included,
+    // whose cached boxes are then fitted to the interval before the trees above them are.
+    // Trees shared by several instances are updated once.
+    void update(hittable_list& world, double time0, double time1);
+
+    private:
+        void update_object(
+            hittable& object, double time0, double time1,
+            std::unordered_set<const hittable*>& visited);
+};
+
+
+bool flat_bvh_updater::update(flat_bvh& bvh, double time0, double time1) {
+    auto elapsed_ms = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    bvh.refit(time0, time1, thread_count);
+    refit_ms += elapsed_ms(start);
+    refits++;
+
+    if (bvh.sah_cost() <= rebuild_ratio * bvh.built_cost)
+        return false;
+
+    start = std::chrono::steady_clock::now();
+    bvh.rebuild(time0, time1);
+    rebuild_ms += elapsed_ms(start);
+    rebuilds++;
+    return true;
+}
+
+
+void flat_bvh_updater::update(hittable_list& world, double time0, double time1) {
+    std::unordered_set<const hittable*> visited;
+    update_object(world, time0, time1, visited);
+}
+
+
+void flat_bvh_updater::update_object(
+    hittable& object, double time0, double time1, std::unordered_set<const hittable*>& visited
+) {
+    if (auto i = dynamic_cast<instance*>(&object)) {
+        update_object(*i->ptr, time0, time1, visited);
+        i->fit_bounds(time0, time1);
+    } else if (auto r = dynamic_cast<rotate_y*>(&object)) {
+        update_object(*r->ptr, time0, time1, visited);
+        r->fit_bounds(time0, time1);
+    } else if (auto t = dynamic_cast<translate*>(&object)) {
+        update_object(*t->ptr, time0, time1, visited);
+    } else if (auto list = dynamic_cast<hittable_list*>(&object)) {
+        if (!visited.insert(list).second)
+            return;
+        for (auto& child : list->objects)
+            update_object(*child, time0, time1, visited);
+    } else if (auto bvh = dynamic_cast<flat_bvh*>(&object)) {
+        if (!visited.insert(bvh).second)
+            return;
+        for (auto& child : bvh->primitives)
+            update_object(*child, time0, time1, visited);
+        update(*bvh, time0, time1);
+    }
+}
+
+
+#endif
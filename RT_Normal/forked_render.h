@@ -0,0 +1,174 @@
+#ifndef FORKED_RENDER_H
+#define FORKED_RENDER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "accumulation.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+
+// Rendering in forked processes instead of threads. The scene is built once, and the children
+// see it through copy-on-write pages, so each has its own allocator, reference counts and
+// random state and never contends with the others. They claim bands of rows from a shared
+// counter and copy each finished band into a framebuffer mapped shared with the parent.
+struct forked_render_control {
+    std::atomic<int> next_band;
+    std::atomic<int> scan_lines_remaining;
+};
+
+static_assert(std::atomic<int>::is_always_lock_free, "the counters are shared between processes");
+
+
+// Renders every band of `sums` in `process_count` child processes. `render_band` adds
+// samples to rows [row_begin, row_end) of the buffer it is given. `progress`, if given, is
+// called in the parent with a counter of the rows still to render, and must return once it
+// reaches zero. Bands a child failed to finish are rendered in the parent afterwards. Returns
+// false if the processes could not be started, leaving `sums` alone.
+bool render_forked(
+    accumulation_buffer& sums, int process_count, int band_height,
+    const std::function<void(int row_begin, int row_end, accumulation_buffer&)>& render_band,
+    const std::function<void(std::atomic<int>&)>& progress = nullptr
+);
+
+
+#ifndef _WIN32
+
+bool render_forked(
+    accumulation_buffer& sums, int process_count, int band_height,
+    const std::function<void(int row_begin, int row_end, accumulation_buffer&)>& render_band,
+    const std::function<void(std::atomic<int>&)>& progress
+) {
+    band_height = std::max(band_height, 1);
+    auto band_count = (sums.height + band_height - 1) / band_height;
+    auto pixel_bytes = sums.pixels.size() * sizeof(pixel_sums);
+
+    // The control block, then the pixels, then a flag for each band a child finished.
+    auto pixel_offset = (sizeof(forked_render_control) + 63) & ~size_t(63);
+    auto flag_offset = pixel_offset + pixel_bytes;
+    auto length = flag_offset + band_count;
+
+    auto memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                       -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+
+    auto base = static_cast<unsigned char*>(memory);
+    auto control = new (base) forked_render_control;
+    control->next_band = 0;
+    control->scan_lines_remaining = sums.height;
+    auto shared_pixels = reinterpret_cast<pixel_sums*>(base + pixel_offset);
+    auto band_done = base + flag_offset;
+    std::memcpy(shared_pixels, sums.pixels.data(), pixel_bytes);
+
+    auto band_rows = [&](int band, int& row_begin, int& row_end) {
+        row_begin = band * band_height;
+        row_end = std::min(row_begin + band_height, sums.height);
+    };
+
+    // Anything still buffered would otherwise be written once by every child.
+    std::cout.flush();
+    std::cerr.flush();
+
+    std::vector<pid_t> children;
+    for (int i = 0; i < process_count; i++) {
+        auto pid = fork();
+        if (pid < 0)
+            break;
+
+        if (pid == 0) {
+            // The child renders into its private copy of the sums and publishes each band.
+            int band;
+            while ((band = control->next_band.fetch_add(1)) < band_count) {
+                int row_begin, row_end;
+                band_rows(band, row_begin, row_end);
+                render_band(row_begin, row_end, sums);
+
+                auto first = sums.index(0, row_begin);
+                std::memcpy(shared_pixels + first, &sums.pixels[first],
+                            sums.index(0, row_end - row_begin) * sizeof(pixel_sums));
+                band_done[band] = 1;
+                control->scan_lines_remaining -= row_end - row_begin;
+            }
+            _exit(0);
+        }
+
+        children.push_back(pid);
+    }
+
+    if (children.empty()) {
+        munmap(memory, length);
+        return false;
+    }
+
+    std::thread progress_thread;
+    if (progress)
+        progress_thread = std::thread(progress, std::ref(control->scan_lines_remaining));
+
+    for (auto pid : children) {
+        int status = 0;
+        pid_t waited;
+        while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {}
+        if (waited < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            std::cerr << "\nWARNING: Render process " << pid << " failed; its bands will be "
+                         "rendered again.\n";
+    }
+
+    std::memcpy(sums.pixels.data(), shared_pixels, pixel_bytes);
+
+    for (int band = 0; band < band_count; band++) {
+        if (band_done[band])
+            continue;
+        int row_begin, row_end;
+        band_rows(band, row_begin, row_end);
+        render_band(row_begin, row_end, sums);
+        control->scan_lines_remaining -= row_end - row_begin;
+    }
+
+    control->scan_lines_remaining = 0;
+    if (progress_thread.joinable())
+        progress_thread.join();
+
+    control->~forked_render_control();
+    munmap(memory, length);
+    return true;
+}
+
+#else
+
+bool render_forked(
+    accumulation_buffer&, int, int,
+    const std::function<void(int, int, accumulation_buffer&)>&,
+    const std::function<void(std::atomic<int>&)>&
+) {
+    std::cerr << "ERROR: Forked rendering needs POSIX processes.\n";
+    return false;
+}
+
+#endif
+
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "color.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// What the first hit of a camera ray saw. Misses keep the background as albedo, a zero
+// normal and depth, and ids of -1. `direct` is the part of the sample's radiance that was
+// emitted at the first hit or reached it straight from a light or the background.
+struct first_hit_features {
+    color albedo;
+    vec3 normal;
+    double depth = 0;
+    int material_id = -1;
+    int object_id = -1;
+    color direct;
+};
+
+
+// The result of a render, top row first. Each pixel holds the mean radiance of its samples,
+// the variance of that mean's luminance, and the mean features of the samples' first hits.
+// Ids cannot be averaged, so they are those of the pixel's first sample.
+class framebuffer {
+    public:
+        framebuffer() {}
+
+        framebuffer(int w, int h)
+            : width(w), height(h),
+              radiance(size_t(w) * h), albedo(size_t(w) * h), normal(size_t(w) * h),
+              depth(size_t(w) * h, 0.0), variance(size_t(w) * h, 0.0), direct(size_t(w) * h),
+              material_id(size_t(w) * h, -1), object_id(size_t(w) * h, -1),
+              samples(size_t(w) * h, 0)
+        {}
+
+        size_t index(int x, int y) const { return size_t(y) * width + x; }
+
+        // Writes the radiance as a plain PPM, gamma corrected for gamma=2.0.
+        void write_ppm(std::ostream& out) const {
+            out << "P3\n" << width << ' ' << height << "\n255\n";
+            for (const auto& c : radiance)
+                write_color(out, c, 1);
+        }
+
+        // Writes every layer but the radiance as its own linear PFM file, named
+        // <prefix>.<layer>.pfm. Returns false if any could not be written.
+        bool write_layers(const std::string& prefix) const;
+
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<color> radiance;
+        std::vector<color> albedo;
+        std::vector<vec3> normal;
+        std::vector<double> depth;
+        std::vector<double> variance;
+        std::vector<color> direct;          // the indirect light is radiance - direct
+        std::vector<int> material_id;
+        std::vector<int> object_id;
+        std::vector<int> samples;
+
+    private:
+        // `channel(i, c)` gives channel c of pixel i.
+        bool write_pfm(
+            const std::string& filename, int channels,
+            const std::function<double(size_t, int)>& channel) const;
+};
+
+
+bool framebuffer::write_pfm(
+    const std::string& filename, int channels,
+    const std::function<double(size_t, int)>& channel
+) const {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        return false;
+
+    // A negative scale marks little-endian floats. Rows run bottom to top.
+    const uint16_t probe = 1;
+    char little_endian;
+    std::memcpy(&little_endian, &probe, 1);
+    out << (channels == 3 ? "PF" : "Pf") << '\n' << width << ' ' << height << '\n'
+        << (little_endian ? "-1.0" : "1.0") << '\n';
+
+    std::vector<float> row(size_t(width) * channels);
+    for (int y = height - 1; y >= 0; y--) {
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < channels; c++)
+                row[size_t(x) * channels + c] = static_cast<float>(channel(index(x, y), c));
+        out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+    }
+
+    return static_cast<bool>(out);
+}
+
+
+bool framebuffer::write_layers(const std::string& prefix) const {
+    auto name = [&](const char* layer) { return prefix + "." + layer + ".pfm"; };
+
+    // Ids and counts are small integers, which floats hold exactly.
+    bool ok = true;
+    ok &= write_pfm(name("depth"), 1, [&](size_t i, int) { return depth[i]; });
+    ok &= write_pfm(name("normal"), 3, [&](size_t i, int c) { return normal[i][c]; });
+    ok &= write_pfm(name("albedo"), 3, [&](size_t i, int c) { return albedo[i][c]; });
+    ok &= write_pfm(name("material_id"), 1, [&](size_t i, int) { return material_id[i]; });
+    ok &= write_pfm(name("object_id"), 1, [&](size_t i, int) { return object_id[i]; });
+    ok &= write_pfm(name("direct"), 3, [&](size_t i, int c) { return direct[i][c]; });
+    ok &= write_pfm(name("indirect"), 3, [&](size_t i, int c) {
+        return radiance[i][c] - direct[i][c];
+    });
+    ok &= write_pfm(name("samples"), 1, [&](size_t i, int) { return samples[i]; });
+    return ok;
+}
+
+
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+}
+
+
+#endif
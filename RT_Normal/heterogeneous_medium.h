@@ -0,0 +1,246 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "density_grid.h"
+#include "hittable.h"
+#include "material.h"
+#include "scene_arena.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// A participating medium whose density varies through space, given by a density_grid and
+// confined to the inside of a boundary object. Free paths are sampled by delta tracking against
+// a coarse grid of majorants, the largest density in each block of lattice cells, so that empty
+// blocks are stepped over and thin ones are crossed in a few long strides.
+class heterogeneous_medium : public hittable {
+    public:
+        // Each majorant covers `block_size` lattice cells along every axis.
+        heterogeneous_medium(
+            shared_ptr<hittable> b, shared_ptr<density_grid> d, shared_ptr<texture> a,
+            int block_size = 8);
+
+        heterogeneous_medium(
+            shared_ptr<hittable> b, shared_ptr<density_grid> d, color c, int block_size = 8)
+            : heterogeneous_medium(b, d, arena_shared<solid_color>(c), block_size)
+        {}
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            return boundary->bounding_box(time0, time1, output_box);
+        }
+
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override {
+            return boundary->intervals(r, t_min, t_max, out);
+        }
+
+        // Fraction of light that crosses the medium between t_min and t_max, estimated without
+        // bias by ratio tracking.
+        double transmittance(const ray& r, double t_min, double t_max) const;
+
+    private:
+        // Calls visit(t0, t1, majorant) for each majorant block the ray crosses between t_min
+        // and t_max, in order, until visit returns false.
+        template <typename Visit>
+        void march(const ray& r, double t_min, double t_max, Visit&& visit) const;
+
+        template <typename Visit>
+        void march_inside(const ray& r, double t_min, double t_max, Visit&& visit) const;
+
+    public:
+        shared_ptr<hittable> boundary;
+        shared_ptr<density_grid> density;
+        shared_ptr<material> phase_function;
+
+    private:
+        int blocks[3];
+        vec3 block_extent;
+        std::vector<double> majorants;
+};
+
+
+heterogeneous_medium::heterogeneous_medium(
+    shared_ptr<hittable> b, shared_ptr<density_grid> d, shared_ptr<texture> a, int block_size
+) : boundary(b), density(d), phase_function(arena_shared<isotropic>(a)) {
+    const auto& box = density->bounds();
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto cells = std::max(density->lattice_size(axis) - 1, 1);
+        blocks[axis] = (cells + block_size - 1) / block_size;
+        block_extent[axis] = (box.max()[axis] - box.min()[axis]) * block_size / cells;
+    }
+
+    majorants.resize(static_cast<size_t>(blocks[0]) * blocks[1] * blocks[2]);
+
+    for (int z = 0; z < blocks[2]; z++) {
+        for (int y = 0; y < blocks[1]; y++) {
+            for (int x = 0; x < blocks[0]; x++) {
+                int lo[3] = { x*block_size, y*block_size, z*block_size };
+                int hi[3] = { lo[0] + block_size, lo[1] + block_size, lo[2] + block_size };
+
+                // Padded slightly so float rounding in the lattice cannot exceed it.
+                majorants[(size_t(z)*blocks[1] + y)*blocks[0] + x]
+                    = density->max_density(lo, hi) * (1 + 1e-6);
+            }
+        }
+    }
+}
+
+
+template <typename Visit>
+void heterogeneous_medium::march(const ray& r, double t_min, double t_max, Visit&& visit) const {
+    // Only the parts of the ray that are inside the boundary and the grid hold any medium.
+    ray_intervals inside;
+    if (!boundary->intervals(r, t_min, t_max, inside))
+        return;
+
+    for (int i = 0; i < inside.count; i++) {
+        auto t0 = inside.spans[i].t0;
+        auto t1 = inside.spans[i].t1;
+        if (!density->bounds().clip(r, t0, t1))
+            continue;
+
+        bool keep_going = true;
+        march_inside(r, t0, t1, [&](double c0, double c1, double majorant) {
+            keep_going = visit(c0, c1, majorant);
+            return keep_going;
+        });
+
+        if (!keep_going)
+            return;
+    }
+}
+
+
+template <typename Visit>
+void heterogeneous_medium::march_inside(
+    const ray& r, double t_min, double t_max, Visit&& visit
+) const {
+    // Walks the majorant blocks cell by cell, always stepping across the nearest block face.
+    const auto& box = density->bounds();
+    auto p = r.at(t_min);
+
+    int cell[3], step[3];
+    double next_t[3], delta_t[3];
+
+    for (int a = 0; a < 3; a++) {
+        auto d = r.direction()[a];
+        auto offset = (p[a] - box.min()[a]) / block_extent[a];
+        cell[a] = std::clamp(static_cast<int>(floor(offset)), 0, blocks[a] - 1);
+
+        if (d > 0) {
+            step[a] = 1;
+            next_t[a] = t_min + (box.min()[a] + (cell[a] + 1)*block_extent[a] - p[a]) / d;
+            delta_t[a] = block_extent[a] / d;
+        } else if (d < 0) {
+            step[a] = -1;
+            next_t[a] = t_min + (box.min()[a] + cell[a]*block_extent[a] - p[a]) / d;
+            delta_t[a] = -block_extent[a] / d;
+        } else {
+            step[a] = 0;
+            next_t[a] = infinity;
+            delta_t[a] = infinity;
+        }
+    }
+
+    auto t = t_min;
+    while (t < t_max) {
+        int a = next_t[0] < next_t[1]
+            ? (next_t[0] < next_t[2] ? 0 : 2)
+            : (next_t[1] < next_t[2] ? 1 : 2);
+        auto exit = fmin(next_t[a], t_max);
+
+        auto majorant = majorants[(size_t(cell[2])*blocks[1] + cell[1])*blocks[0] + cell[0]];
+        if (exit > t && !visit(t, exit, majorant))
+            return;
+
+        t = exit;
+        cell[a] += step[a];
+        if (cell[a] < 0 || cell[a] >= blocks[a])
+            return;
+        next_t[a] += delta_t[a];
+    }
+}
+
+
+bool heterogeneous_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    const auto ray_length = r.direction().length();
+    bool scattered = false;
+
+    // Delta tracking: tentative collisions arrive at the majorant rate, and each is real with
+    // probability density / majorant. Since free paths are memoryless, tracking can restart
+    // at every block face with that block's majorant.
+    march(r, t_min, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0)
+            return true;
+
+        auto t = t0;
+        while (true) {
+            t -= log(1 - random_double()) / (majorant * ray_length);
+            if (t >= t1)
+                return true;
+
+            if (random_double() * majorant < density->density(r.at(t))) {
+                rec.t = t;
+                scattered = true;
+                return false;
+            }
+        }
+    });
+
+    if (!scattered)
+        return false;
+
+    rec.p = r.at(rec.t);
+    rec.normal = vec3(1,0,0);  // arbitrary
+    rec.front_face = true;     // also arbitrary
+    rec.u = rec.v = 0;
+    rec.mat_ptr = phase_function;
+    rec.pending = nullptr;
+
+    return true;
+}
+
+
+double heterogeneous_medium::transmittance(const ray& r, double t_min, double t_max) const {
+    const auto ray_length = r.direction().length();
+    auto result = 1.0;
+
+    // Ratio tracking: the same tentative collisions, but each scales the estimate by the
+    // chance that it was null instead of ending the walk.
+    march(r, t_min, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0)
+            return true;
+
+        auto t = t0;
+        while (true) {
+            t -= log(1 - random_double()) / (majorant * ray_length);
+            if (t >= t1)
+                return true;
+
+            result *= 1 - density->density(r.at(t)) / majorant;
+            if (result <= 0)
+                return false;
+        }
+    });
+
+    return result;
+}
+
+
+#endif
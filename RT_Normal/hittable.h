@@ -16,6 +16,7 @@
 #include "aabb.h"
 
 
+class hittable;
 class material;
 
 
@@ -26,21 +27,157 @@ struct hit_record {
     double t;
     double u;
     double v;
+    double u_rate = 0;  // change in u per unit of distance across the surface
+    double v_rate = 0;  // likewise for v
     bool front_face;
 
+    // The index of the object hit within the outermost list or BVH that has more than one,
+    // or -1 if there is none.
+    int object_id = -1;
+
+    // A primitive's hit() may set only t, naming itself here and leaving the rest of the
+    // record for finalize() to fill in, so that candidates beaten by a closer hit cost no
+    // more than their distance. `primitive` and, until then, u and v may hold whatever the
+    // primitive needs to finish: which of its triangles was hit, and where on it.
+    const hittable* pending = nullptr;
+    uint32_t primitive = 0;
+
+    // Completes a record left pending, for the ray that it was found with.
+    inline void finalize(const ray& r);
+
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal :-outward_normal;
     }
+
+    // The width in u and v of the patch of surface that the cone of `r` covers at this hit,
+    // stretched by the angle of incidence. Zero for a thin ray or unknown texture rates.
+    inline void footprint(const ray& r, double& du, double& dv) const {
+        auto length = r.direction().length();
+        auto cos_incidence = fabs(dot(r.direction(), normal)) / length;
+        auto width = r.spread * t / fmax(cos_incidence, 0.05);
+        du = width * u_rate;
+        dv = width * v_rate;
+    }
 };
 
 
+// The stretches of a ray that lie inside a closed object, as sorted, disjoint [t0, t1] spans.
+// Spans that overlap or touch are merged as they are added. Once all slots are used, a new
+// span is merged with its nearest neighbour, so the spans always cover the inside.
+struct ray_intervals {
+    struct span {
+        double t0;
+        double t1;
+    };
+
+    static const int capacity = 8;
+
+    span spans[capacity];
+    int count = 0;
+
+    void add(double t0, double t1);
+};
+
+
+void ray_intervals::add(double t0, double t1) {
+    if (t1 < t0)
+        return;
+
+    // First span that ends at or after t0; everything before it lies wholly in front.
+    int i = 0;
+    while (i < count && spans[i].t1 < t0)
+        i++;
+
+    // Absorb every span the new one overlaps.
+    int j = i;
+    while (j < count && spans[j].t0 <= t1) {
+        t0 = fmin(t0, spans[j].t0);
+        t1 = fmax(t1, spans[j].t1);
+        j++;
+    }
+
+    if (j == i && count == capacity) {
+        // No room for a separate span: widen whichever neighbour is closer.
+        bool before = i > 0 && (i == count || t0 - spans[i-1].t1 <= spans[i].t0 - t1);
+        auto& s = spans[before ? i-1 : i];
+        s.t0 = fmin(s.t0, t0);
+        s.t1 = fmax(s.t1, t1);
+        return;
+    }
+
+    // Replace spans [i, j) by the merged span.
+    int shift = 1 - (j - i);
+    if (shift > 0) {
+        for (int k = count - 1; k >= j; k--)
+            spans[k + shift] = spans[k];
+    } else if (shift < 0) {
+        for (int k = j; k < count; k++)
+            spans[k + shift] = spans[k];
+    }
+    count += shift;
+    spans[i] = { t0, t1 };
+}
+
+
 class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // True if anything blocks the ray between t_min and t_max, as for a shadow ray. Unlike
+        // hit() it may stop at the first surface found, nearest or not. This fallback runs
+        // hit(), which leaves the record pending and so costs little more.
+        virtual bool occluded(const ray& r, double t_min, double t_max) const {
+            hit_record rec;
+            return hit(r, t_min, t_max, rec);
+        }
+
+        // Adds the spans of the ray within [t_min, t_max] that are inside this object to `out`
+        // and returns true if there were any. Objects that know their own shape answer in one
+        // pass; this fallback pairs up successive surface crossings found with hit().
+        virtual bool intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const;
+
+        // Fills in a record that this object's hit() left pending.
+        virtual void finalize_hit(const ray& r, hit_record& rec) const {}
 };
 
+
+inline void hit_record::finalize(const ray& r) {
+    if (!pending)
+        return;
+    auto object = pending;
+    pending = nullptr;
+    object->finalize_hit(r, *this);
+}
+
+
+bool hittable::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    // Crossings are searched over the whole line so that a ray starting inside still sees
+    // where it entered; the pairs are clipped to [t_min, t_max] afterwards.
+    bool found = false;
+    auto t = -infinity;
+    hit_record entry, exit;
+
+    for (int i = 0; i < ray_intervals::capacity; i++) {
+        if (!hit(r, t, infinity, entry) || !hit(r, entry.t + 0.0001, infinity, exit))
+            break;
+
+        auto t0 = fmax(entry.t, t_min);
+        auto t1 = fmin(exit.t, t_max);
+        if (t0 < t1) {
+            out.add(t0, t1);
+            found = true;
+        }
+
+        if (exit.t >= t_max)
+            break;
+        t = exit.t + 0.0001;
+    }
+
+    return found;
+}
+
 class translate : public hittable {
     public:
         translate(shared_ptr<hittable> p, const vec3& displacement)
@@ -49,8 +186,17 @@ class translate : public hittable {
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override {
+            return ptr->intervals(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max, out);
+        }
+
     public:
         shared_ptr<hittable> ptr;
         vec3 offset;
@@ -62,6 +208,7 @@ bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) c
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
+    rec.finalize(moved_r);
     rec.p += offset;
     rec.set_face_normal(moved_r, rec.normal);
 
@@ -85,20 +232,33 @@ class rotate_y : public hittable {
     public:
         rotate_y(shared_ptr<hittable> p, double angle);
 
+        // As for instance, the box is cached and can be fitted to a new interval.
+        void fit_bounds(double time0, double time1);
+
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return ptr->occluded(rotated_ray(r), t_min, t_max);
+        }
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             output_box = bbox;
             return hasbox;
         }
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
         double cos_theta;
         bool hasbox;
         aabb bbox;
+
+    private:
+        ray rotated_ray(const ray& r) const;
 };
 
 
@@ -106,7 +266,12 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     auto radians = degrees_to_radians(angle);
     sin_theta = sin(radians);
     cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
+    fit_bounds(0, 1);
+}
+
+
+void rotate_y::fit_bounds(double time0, double time1) {
+    hasbox = ptr->bounding_box(time0, time1, bbox);
 
     point3 min( infinity,  infinity,  infinity);
     point3 max(-infinity, -infinity, -infinity);
@@ -135,7 +300,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::rotated_ray(const ray& r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -145,11 +310,17 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta*r.direction()[0] - sin_theta*r.direction()[2];
     direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return ray(origin, direction, r.time());
+}
+
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    auto rotated_r = rotated_ray(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
 
+    rec.finalize(rotated_r);
     auto p = rec.p;
     auto normal = rec.normal;
 
@@ -166,4 +337,9 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+bool rotate_y::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    return ptr->intervals(rotated_ray(r), t_min, t_max, out);
+}
+
+
 #endif
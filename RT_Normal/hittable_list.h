@@ -30,8 +30,13 @@ class hittable_list : public hittable  {
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
     public:
         std::vector<shared_ptr<hittable>> objects;
 };
@@ -42,11 +47,15 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
     auto hit_anything = false;
     auto closest_so_far = t_max;
 
-    for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (objects[i]->hit(r, t_min, closest_so_far, temp_rec)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
             rec = temp_rec;
+
+            // A list holding one object only wraps it, and leaves its members' ids alone.
+            if (objects.size() > 1)
+                rec.object_id = static_cast<int>(i);
         }
     }
 
@@ -54,6 +63,24 @@ bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& re
 }
 
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
+
+// The inside of a list is the union of the insides of its objects.
+bool hittable_list::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    bool found = false;
+    for (const auto& object : objects)
+        found |= object->intervals(r, t_min, t_max, out);
+    return found;
+}
+
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
     if (objects.empty()) return false;
 
@@ -0,0 +1,96 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "affine.h"
+#include "hittable.h"
+
+
+// A placement of a shared object (typically a flat_bvh over its primitives, the bottom level
+// of the hierarchy) under an affine transform. Any number of instances may point at the same
+// object; a flat_bvh over the instances forms the top level.
+class instance : public hittable {
+    public:
+        instance(shared_ptr<hittable> p, const affine& object_to_world);
+
+        // The box is cached, over [0, 1] to begin with. Fits it to where the object is during
+        // [time0, time1], after the object itself has been refitted.
+        void fit_bounds(double time0, double time1);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+            return ptr->occluded(object_r, t_min, t_max);
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bbox;
+            return hasbox;
+        }
+
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override {
+            ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+            return ptr->intervals(object_r, t_min, t_max, out);
+        }
+
+    public:
+        shared_ptr<hittable> ptr;
+        affine to_world;
+        affine to_object;
+        bool hasbox;
+        aabb bbox;
+};
+
+
+instance::instance(shared_ptr<hittable> p, const affine& object_to_world)
+    : ptr(p), to_world(object_to_world), to_object(object_to_world.inverse())
+{
+    fit_bounds(0, 1);
+}
+
+
+void instance::fit_bounds(double time0, double time1) {
+    hasbox = ptr->bounding_box(time0, time1, bbox);
+    if (hasbox)
+        bbox = to_world.bounds(bbox);
+}
+
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    // The direction is mapped but not renormalised, so distances along the ray are the same
+    // in both spaces.
+    ray object_r(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+
+    if (!ptr->hit(object_r, t_min, t_max, rec))
+        return false;
+
+    // The closest hit within the instance is finished in object space, before moving it out.
+    rec.finalize(object_r);
+    auto outward_normal = rec.front_face ? rec.normal : -rec.normal;
+
+    rec.p = to_world.point(rec.p);
+    rec.set_face_normal(r, unit_vector(to_object.transpose_vector(outward_normal)));
+
+    // Texture rates are per object space distance; rescale them by the object space length
+    // of a world space step along the ray.
+    auto scale = object_r.direction().length() / r.direction().length();
+    rec.u_rate *= scale;
+    rec.v_rate *= scale;
+
+    return true;
+}
+
+
+#endif
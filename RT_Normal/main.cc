@@ -11,27 +11,55 @@
 
 #include "rtweekend.h"
 
+#include "accumulation.h"
+#include "animation.h"
+#include "baked_texture.h"
 #include "box.h"
 #include "bvh.h"
+#include "bvh_cache.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "color.h"
 #include "constant_medium.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "finalize.h"
+#include "forked_render.h"
+#include "framebuffer.h"
+#include "heterogeneous_medium.h"
 #include "hittable_list.h"
+#include "instance.h"
 #include "material.h"
 #include "moving_sphere.h"
+#include "numa.h"
+#include "options.h"
+#include "perlin.h"
+#include "preview.h"
+#include "render_pool.h"
+#include "scene_arena.h"
 #include "sphere.h"
 #include "texture.h"
+#include "texture_cache.h"
+#include "triangle_mesh.h"
 
 #include <thread>
 #include <atomic>
 #include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 
 using namespace std::chrono_literals;
 
 
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
+// When `features` is given, it receives what this ray hits first, for the denoiser and the
+// output layers. `emitted_here`, if given, receives the light emitted where the ray lands.
+color ray_color(
+    const ray& r, const color& background, const hittable& world, int depth,
+    first_hit_features* features = nullptr, color* emitted_here = nullptr
+) {
     hit_record rec;
 
     // If we've exceeded the ray bounce limit, no more light is gathered.
@@ -39,26 +67,49 @@ color ray_color(const ray& r, const color& background, const hittable& world, in
         return color(0,0,0);
 
     // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
+    if (!world.hit(r, 0.001, infinity, rec)) {
+        if (features)
+            *features = { background, vec3(0,0,0), 0.0, -1, -1, background };
+        if (emitted_here)
+            *emitted_here = background;
         return background;
+    }
+
+    // Only the closest hit has its surface worked out.
+    rec.finalize(r);
 
     ray scattered;
     color attenuation;
     color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    if (emitted_here)
+        *emitted_here = emitted;
+
+    if (features)
+        *features = { rec.mat_ptr->feature_albedo(rec), rec.normal,
+                      rec.t * r.direction().length(), rec.mat_ptr->id, rec.object_id, emitted };
 
     if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
         return emitted;
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth-1);
+    if (!features)
+        return emitted + attenuation * ray_color(scattered, background, world, depth-1);
+
+    // Light the first bounce finds at an emitter or the background is direct; whatever it
+    // gathers beyond that is indirect.
+    color bounce_emitted(0,0,0);
+    auto incoming = ray_color(scattered, background, world, depth-1, nullptr, &bounce_emitted);
+    features->direct += attenuation * bounce_emitted;
+
+    return emitted + attenuation * incoming;
 }
 
 
 hittable_list random_scene() {
     hittable_list world;
 
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    auto checker = arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
 
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
+    world.add(arena_shared<sphere>(point3(0,-1000,0), 1000, arena_shared<lambertian>(checker)));
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -71,52 +122,52 @@ hittable_list random_scene() {
                 /*if (choose_mat < 0.8) {*/
                     // diffuse
                     /*auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena_shared<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0,.5), 0);
-                    world.add(make_shared<moving_sphere>(
+                    world.add(arena_shared<moving_sphere>(
                         center, center2, 0.0, 1.0, 0.2, sphere_material));*/
                 //} else if (choose_mat < 0.95) {
                 //    // metal
                 //    auto albedo = color::random(0.5, 1);
                 //    auto fuzz = random_double(0, 0.5);
-                //    sphere_material = make_shared<metal>(albedo, fuzz);
-                //    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                //    sphere_material = arena_shared<metal>(albedo, fuzz);
+                //    world.add(arena_shared<sphere>(center, 0.2, sphere_material));
                 //} else {
                 //    // glass
-                //    sphere_material = make_shared<dielectric>(1.5);
-                //    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                //    sphere_material = arena_shared<dielectric>(1.5);
+                //    world.add(arena_shared<sphere>(center, 0.2, sphere_material));
                 //}
             //}
             shared_ptr<material> sphere_material;
             auto albedo = color::random() * color::random();
-            sphere_material = make_shared<lambertian>(albedo);
+            sphere_material = arena_shared<lambertian>(albedo);
             auto center2 = center + vec3(0, random_double(0, .5), 0);
-            world.add(make_shared<moving_sphere>(
+            world.add(arena_shared<moving_sphere>(
                 center, center2, 0.0, 1.0, 0.2, sphere_material));
 
         }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+    auto material1 = arena_shared<dielectric>(1.5);
+    world.add(arena_shared<sphere>(point3(0, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+    auto material2 = arena_shared<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(arena_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = arena_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    return hittable_list(make_shared<bvh_node>(world, 0.0, 1.0));
+    return hittable_list(load_or_build_bvh(world, 0.0, 1.0));
 }
 
 
 hittable_list two_spheres() {
     hittable_list objects;
 
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    auto checker = arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
 
-    objects.add(make_shared<sphere>(point3(0,-10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    objects.add(arena_shared<sphere>(point3(0,-10, 0), 10, arena_shared<lambertian>(checker)));
+    objects.add(arena_shared<sphere>(point3(0, 10, 0), 10, arena_shared<lambertian>(checker)));
 
     return objects;
 }
@@ -125,18 +176,18 @@ hittable_list two_spheres() {
 hittable_list two_perlin_spheres() {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = arena_shared<noise_texture>(4);
+    objects.add(arena_shared<sphere>(point3(0,-1000,0), 1000, arena_shared<lambertian>(pertext)));
+    objects.add(arena_shared<sphere>(point3(0,2,0), 2, arena_shared<lambertian>(pertext)));
 
     return objects;
 }
 
 
 hittable_list earth() {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0,0,0), 2, earth_surface);
+    auto earth_texture = load_image_texture("earthmap.jpg");
+    auto earth_surface = arena_shared<lambertian>(earth_texture);
+    auto globe = arena_shared<sphere>(point3(0,0,0), 2, earth_surface);
 
     return hittable_list(globe);
 }
@@ -145,13 +196,13 @@ hittable_list earth() {
 hittable_list simple_light() {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = arena_shared<noise_texture>(4);
+    objects.add(arena_shared<sphere>(point3(0,-1000,0), 1000, arena_shared<lambertian>(pertext)));
+    objects.add(arena_shared<sphere>(point3(0,2,0), 2, arena_shared<lambertian>(pertext)));
 
-    auto difflight = make_shared<diffuse_light>(color(4,4,4));
-    objects.add(make_shared<sphere>(point3(0,7,0), 2, difflight));
-    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    auto difflight = arena_shared<diffuse_light>(color(4,4,4));
+    objects.add(arena_shared<sphere>(point3(0,7,0), 2, difflight));
+    objects.add(arena_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
 
     return objects;
 }
@@ -160,26 +211,26 @@ hittable_list simple_light() {
 hittable_list cornell_box() {
     hittable_list objects;
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
-
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
-
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    auto red   = arena_shared<lambertian>(color(.65, .05, .05));
+    auto white = arena_shared<lambertian>(color(.73, .73, .73));
+    auto green = arena_shared<lambertian>(color(.12, .45, .15));
+    auto light = arena_shared<diffuse_light>(color(15, 15, 15));
+
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_shared<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<hittable> box1 = arena_shared<box>(point3(0,0,0), point3(165,330,165), white);
+    box1 = arena_shared<rotate_y>(box1, 15);
+    box1 = arena_shared<translate>(box1, vec3(265,0,295));
     objects.add(box1);
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    shared_ptr<hittable> box2 = arena_shared<box>(point3(0,0,0), point3(165,165,165), white);
+    box2 = arena_shared<rotate_y>(box2, -18);
+    box2 = arena_shared<translate>(box2, vec3(130,0,65));
     objects.add(box2);
 
     return objects;
@@ -189,28 +240,28 @@ hittable_list cornell_box() {
 hittable_list cornell_smoke() {
     hittable_list objects;
 
-    auto red   = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+    auto red   = arena_shared<lambertian>(color(.65, .05, .05));
+    auto white = arena_shared<lambertian>(color(.73, .73, .73));
+    auto green = arena_shared<lambertian>(color(.12, .45, .15));
+    auto light = arena_shared<diffuse_light>(color(7, 7, 7));
 
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_shared<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_shared<xy_rect>(0, 555, 0, 555, 555, white));
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0,0,0), point3(165,330,165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265,0,295));
+    shared_ptr<hittable> box1 = arena_shared<box>(point3(0,0,0), point3(165,330,165), white);
+    box1 = arena_shared<rotate_y>(box1, 15);
+    box1 = arena_shared<translate>(box1, vec3(265,0,295));
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0,0,0), point3(165,165,165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130,0,65));
+    shared_ptr<hittable> box2 = arena_shared<box>(point3(0,0,0), point3(165,165,165), white);
+    box2 = arena_shared<rotate_y>(box2, -18);
+    box2 = arena_shared<translate>(box2, vec3(130,0,65));
 
-    objects.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
-    objects.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
+    objects.add(arena_shared<constant_medium>(box1, 0.01, color(0,0,0)));
+    objects.add(arena_shared<constant_medium>(box2, 0.01, color(1,1,1)));
 
     return objects;
 }
@@ -220,104 +271,204 @@ hittable_list final_scene() {
     hittable_list boxes1;
     hittable_list objects;
 
-    auto white = make_shared<lambertian>(color{ .73f, .73f, .73f });
-    auto random_col = make_shared<lambertian>(color{ random_double(), 0, random_double() });
+    auto white = arena_shared<lambertian>(color{ .73f, .73f, .73f });
+    auto random_col = arena_shared<lambertian>(color{ random_double(), 0, random_double() });
 
     for (int i = 0; i < 10; i++)
     {
         for (int j = 0; j < 10; j++)
         {
-            shared_ptr<hittable> t = make_shared<sphere>(point3{ (float)(i * 50), 0.f, (float)(j * 50) }, random_double(30.f, 80.f), random_col);
-            objects.add(make_shared<constant_medium>(t, 0.01f, color{ random_double_messenne(), 0, random_double_messenne() }));
+            shared_ptr<hittable> t = arena_shared<sphere>(point3{ (float)(i * 50), 0.f, (float)(j * 50) }, random_double(30.f, 80.f), random_col);
+            objects.add(arena_shared<constant_medium>(t, 0.01f, color{ random_double_messenne(), 0, random_double_messenne() }));
         }
     }
 
     //hittable_list objects;
 
-    auto light = make_shared<diffuse_light>(color(10, 10, 10));
-    objects.add(make_shared<xz_rect>(123, 323, 147, 312, 554, light));
+    auto light = arena_shared<diffuse_light>(color(10, 10, 10));
+    objects.add(arena_shared<xz_rect>(123, 323, 147, 312, 554, light));
 
     auto center1 = point3(400, 400, 200);
     auto center2 = center1 + vec3(30,0,0);
-    auto moving_sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+    auto moving_sphere_material = arena_shared<lambertian>(color(0.7, 0.3, 0.1));
+    objects.add(arena_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
 
-    objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    objects.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
+    objects.add(arena_shared<sphere>(point3(260, 150, 45), 50, arena_shared<dielectric>(1.5)));
+    objects.add(arena_shared<sphere>(
+        point3(0, 150, 145), 50, arena_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
     ));
 
-    auto boundary = make_shared<sphere>(point3(360,150,145), 70, make_shared<dielectric>(1.5));
+    auto boundary = arena_shared<sphere>(point3(360,150,145), 70, arena_shared<dielectric>(1.5));
     objects.add(boundary);
-    objects.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0,0,0), 5000, make_shared<dielectric>(1.5));
-    objects.add(make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
+    objects.add(arena_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    boundary = arena_shared<sphere>(point3(0,0,0), 5000, arena_shared<dielectric>(1.5));
+    objects.add(arena_shared<constant_medium>(boundary, .0001, color(1,1,1)));
 
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-    objects.add(make_shared<sphere>(point3(400,200,400), 100, emat));
-    auto pertext = make_shared<noise_texture>(0.1);
-    objects.add(make_shared<sphere>(point3(220,280,300), 80, make_shared<lambertian>(pertext)));
+    auto emat = arena_shared<lambertian>(load_image_texture("earthmap.jpg"));
+    objects.add(arena_shared<sphere>(point3(400,200,400), 100, emat));
+    auto pertext = arena_shared<noise_texture>(0.1);
+    objects.add(arena_shared<sphere>(point3(220,280,300), 80, arena_shared<lambertian>(pertext)));
 
     hittable_list boxes2;
-    //auto white = make_shared<lambertian>(color(.73, .73, .73));
+    //auto white = arena_shared<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0,165), 10, white));
+        boxes2.add(arena_shared<sphere>(point3::random(0,165), 10, white));
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
-            vec3(-100,270,395)
-        )
-    );
+    objects.add(arena_shared<instance>(
+        load_or_build_bvh(boxes2, 0.0, 1.0),
+        affine::translation(vec3(-100,270,395)) * affine::rotation_y(15)
+    ));
+
+    return hittable_list(load_or_build_bvh(objects, 0.0, 1.0));
+}
+
+
+hittable_list mesh_scene() {
+    hittable_list objects;
+
+    auto checker = arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    objects.add(arena_shared<sphere>(point3(0,-1000,0), 1000, arena_shared<lambertian>(checker)));
+
+    auto mesh = load_obj("mesh.obj", arena_shared<lambertian>(color(0.8, 0.5, 0.3)));
+    if (mesh)
+        objects.add(mesh);
 
     return objects;
 }
 
-void DrawPixel(int nSamplesPerPixel, int nImageWidth, int nImageHeight, int startHeight, int endHeight, int nMaxDepth, hittable_list world, camera cam, std::vector<color>& oColours, color background, std::atomic<int>& scan_lines_remianing)
-{
-    
-    
-    for (int i = startHeight; i <= endHeight; i++)
-    {
-        scan_lines_remianing--;
-        for (int j = 0; j < nImageWidth; j++)
-        {
-            color pixelColour{ 0.f, 0.f, 0.f };
-            for (int k = 0; k < nSamplesPerPixel; k++)
-            {
-                auto u = (j + random_double()) / (nImageWidth - 1);
-                auto v = (i + random_double()) / (nImageHeight - 1);
-                ray r = cam.get_ray(u, v);
-                pixelColour += ray_color(r, background, world, nMaxDepth);
-            }
 
-            auto r = pixelColour.x();
-            auto g = pixelColour.y();
-            auto b = pixelColour.z();
+hittable_list instanced_clusters() {
+    // One cluster of 1000 spheres is built once (the bottom level) and placed about 100k times
+    // by instances, which get their own BVH (the top level).
+    auto white = arena_shared<lambertian>(color(.73, .73, .73));
+    hittable_list cluster;
+    for (int j = 0; j < 1000; j++)
+        cluster.add(arena_shared<sphere>(point3::random(0,165), 10, white));
+    auto blas = load_or_build_bvh(cluster, 0.0, 1.0);
+
+    const int n = 317;
+    hittable_list instances;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            auto placement = affine::translation(vec3(2.5*i, 0, 2.5*j))
+                           * affine::rotation_y(random_double(0, 360))
+                           * affine::scaling(0.01);
+            instances.add(arena_shared<instance>(blas, placement));
+        }
+    }
+    auto tlas = load_or_build_bvh(instances, 0.0, 1.0);
+
+    std::cerr << "Instancing: " << instances.objects.size() << " instances of "
+              << cluster.objects.size() << " spheres; bottom level "
+              << (blas->node_count()*sizeof(flat_bvh_node) + cluster.objects.size()*sizeof(sphere)) / 1024
+              << " KiB, instances "
+              << instances.objects.size()*sizeof(instance) / 1024 << " KiB, top level "
+              << tlas->node_count()*sizeof(flat_bvh_node) / 1024 << " KiB\n";
+
+    hittable_list objects;
+    auto checker = arena_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    objects.add(arena_shared<sphere>(point3(0,-10000,0), 10000, arena_shared<lambertian>(checker)));
+    objects.add(tlas);
+
+    return objects;
+}
+
+
+// A cloud: a ball of density roughed up by perlin turbulence, baked into a density grid.
+// `sigma` is the density at the centre of the ball.
+shared_ptr<density_grid> cloud_density(
+    const point3& center, double radius, int resolution, double sigma
+) {
+    auto r = vec3(radius, radius, radius);
+    auto grid = arena_shared<density_grid>(aabb(center - r, center + r), resolution, resolution, resolution);
+
+    perlin noise;
+    grid->fill([&](const point3& p) {
+        auto shape = 1 - (p - center).length() / radius;
+        auto detail = noise.turb(p * (4 / radius));
+        return sigma * (shape + 0.7*detail - 0.45);
+    });
+
+    return grid;
+}
+
+
+hittable_list cornell_cloud() {
+    hittable_list objects;
+
+    auto red   = arena_shared<lambertian>(color(.65, .05, .05));
+    auto white = arena_shared<lambertian>(color(.73, .73, .73));
+    auto green = arena_shared<lambertian>(color(.12, .45, .15));
+    auto light = arena_shared<diffuse_light>(color(7, 7, 7));
+
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena_shared<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    auto density = cloud_density(point3(278, 278, 278), 200, 64, 0.1);
+    auto boundary = arena_shared<box>(density->bounds().min(), density->bounds().max(), white);
+    objects.add(arena_shared<heterogeneous_medium>(boundary, density, color(.9, .9, .9)));
+
+    return objects;
+}
+
+
+hittable_list sphere_field(int n) {
+    hittable_list world;
 
-            // Replace NaN components with zero. See explanation in Ray Tracing: The Rest of Your Life.
-            if (r != r) r = 0.0;
-            if (g != g) g = 0.0;
-            if (b != b) b = 0.0;
+    auto material = arena_shared<lambertian>(color(0.5, 0.5, 0.5));
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            point3 center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+            world.add(arena_shared<sphere>(center, 0.2, material));
+        }
+    }
 
-            // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-            auto scale = 1.0 / nSamplesPerPixel;
-            r = sqrt(scale * r);
-            g = sqrt(scale * g);
-            b = sqrt(scale * b);
+    return hittable_list(load_or_build_bvh(world, 0.0, 1.0));
+}
 
-            color out = { static_cast<double>(256 * clamp(r, 0.0, 0.999)),
-                static_cast<double>(256 * clamp(g, 0.0, 0.999)),
-                static_cast<double>(256 * clamp(b, 0.0, 0.999)) };
 
-            oColours.push_back(out);
+shared_ptr<triangle_mesh> torus_mesh(
+    double major_radius, double minor_radius, int rings, int sides, shared_ptr<material> m
+) {
+    std::vector<mesh_float3> positions, normals;
+    std::vector<uint32_t> indices;
+
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < sides; j++) {
+            auto phi = 2*pi*i / rings;
+            auto theta = 2*pi*j / sides;
+            vec3 normal(cos(theta)*cos(phi), sin(theta), cos(theta)*sin(phi));
+            point3 ring_center(major_radius*cos(phi), 0, major_radius*sin(phi));
+            positions.push_back(ring_center + minor_radius*normal);
+            normals.push_back(normal);
+
+            uint32_t a = i*sides + j;
+            uint32_t b = ((i+1) % rings)*sides + j;
+            uint32_t c = ((i+1) % rings)*sides + (j+1) % sides;
+            uint32_t d = i*sides + (j+1) % sides;
+            indices.insert(indices.end(), { a, b, c, a, c, d });
         }
     }
 
+    return arena_shared<triangle_mesh>(positions, normals, std::vector<mesh_float2>(), indices, m);
 }
 
+
+template <typename F>
+double time_ms(F&& f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
 void print_lines_remaining(std::atomic<int>& scan_lines_remaining)
 {
 
@@ -330,107 +481,471 @@ void print_lines_remaining(std::atomic<int>& scan_lines_remaining)
 }
 
 
-int main() {
+// Where each pixel's random sequence starts, for renders that do not resume a checkpoint.
+const uint64_t render_seed = 1;
+
+
+// Adds up to `samples` samples to each pixel in rows [row_begin, row_end) of `sums`, counting
+// top down, stopping at `target` samples per pixel. Samples are path traced unless `preview`
+// asks for a preview. First-hit features, which cost extra texture lookups, are only gathered
+// with `collect_features`, for the denoiser and the output layers.
+void render_rows(
+    const hittable& world, const camera& cam, const color& background, int max_depth,
+    int target, int samples, int row_begin, int row_end, accumulation_buffer& sums,
+    std::atomic<int>& scan_lines_remaining, bool collect_features = false,
+    const preview_settings& preview = {}
+) {
+    for (int y = row_begin; y < row_end; y++) {
+        for (int x = 0; x < sums.width; x++) {
+            auto& pixel = sums.pixels[sums.index(x, y)];
+            random_state() = pixel.random;
+
+            auto end = std::min(pixel.samples + samples, target);
+            while (pixel.samples < end) {
+                auto u = (x + random_double()) / (sums.width - 1);
+                auto v = (sums.height - 1 - y + random_double()) / (sums.height - 1);
+
+                first_hit_features features;
+                auto wanted = collect_features ? &features : nullptr;
+                auto r = cam.get_ray(u, v);
+                auto sample = preview.enabled()
+                    ? preview_color(r, background, world, preview, wanted)
+                    : ray_color(r, background, world, max_depth, wanted);
+
+                // Replace NaN components with zero. See explanation in Ray Tracing: The Rest
+                // of Your Life.
+                for (int c = 0; c < 3; c++) {
+                    if (sample[c] != sample[c]) sample[c] = 0.0;
+                    if (features.direct[c] != features.direct[c]) features.direct[c] = 0.0;
+                }
+
+                pixel.add(sample, features);
+            }
 
-    // Image
+            pixel.random = random_state();
+        }
+        scan_lines_remaining--;
+    }
+}
+
+
+// render_rows, with the rows shared out among the threads of `pool`.
+void render_rows_threaded(
+    const hittable& world, const camera& cam, const color& background, int max_depth,
+    int target, int samples, int row_begin, int row_end, accumulation_buffer& sums,
+    std::atomic<int>& scan_lines_remaining, render_pool& pool, bool collect_features = false,
+    const preview_settings& preview = {}
+) {
+    auto placement = pool.placement();
+    pool.for_rows(row_begin, row_end, [&](int thread, int start, int end) {
+        const auto& thread_world = placement ? placement->world_for(thread, world) : world;
+        render_rows(thread_world, cam, background, max_depth, target, samples, start, end, sums,
+                    scan_lines_remaining, collect_features, preview);
+    });
+}
+
+
+// Renders until every pixel of `sums` has `target` samples, a few samples per pixel at a time,
+// so that a checkpoint can be written between passes. The passes run on `pool`, or on a pool
+// of their own if none is given.
+void render_progressive(
+    const hittable& world, const camera& cam, const color& background, int max_depth,
+    int target, accumulation_buffer& sums, const checkpoint_schedule& checkpoint = {},
+    bool show_progress = true, render_pool* pool = nullptr, bool collect_features = false,
+    const preview_settings& preview = {}
+) {
+    std::unique_ptr<render_pool> own_pool;
+    if (!pool) {
+        own_pool = std::make_unique<render_pool>();
+        pool = own_pool.get();
+    }
+
+    int samples_per_pass = 4;
+    if (checkpoint.samples > 0)
+        samples_per_pass = std::min(samples_per_pass, checkpoint.samples);
+
+    auto done = sums.samples_done();
+    auto passes = std::max(target - done + samples_per_pass - 1, 0) / samples_per_pass;
+    std::atomic<int> scan_lines_remaining = passes * sums.height;
+
+    std::thread progress;
+    if (show_progress)
+        progress = std::thread(print_lines_remaining, std::ref(scan_lines_remaining));
+
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    auto last_checkpoint_samples = done;
+
+    for (int pass = 0; pass < passes; pass++) {
+        render_rows_threaded(world, cam, background, max_depth, target, samples_per_pass, 0,
+                             sums.height, sums, scan_lines_remaining, *pool, collect_features,
+                             preview);
+
+        if (checkpoint.filename.empty())
+            continue;
+
+        done = sums.samples_done();
+        auto minutes = std::chrono::duration<double, std::ratio<60>>(
+            std::chrono::steady_clock::now() - last_checkpoint).count();
+        bool last = pass + 1 == passes;
+        bool due = (checkpoint.minutes > 0 && minutes >= checkpoint.minutes)
+                || (checkpoint.samples > 0 && done - last_checkpoint_samples >= checkpoint.samples);
+
+        if (last || due) {
+            if (!write_checkpoint(checkpoint.filename, sums, checkpoint.render_key))
+                std::cerr << "\nWARNING: Could not write checkpoint '" << checkpoint.filename
+                          << "'.\n";
+            last_checkpoint = std::chrono::steady_clock::now();
+            last_checkpoint_samples = done;
+        }
+    }
+
+    scan_lines_remaining = 0;
+    if (progress.joinable())
+        progress.join();
+}
+
+
+framebuffer render(
+    const hittable& world, const camera& cam, const color& background, int image_width,
+    int image_height, int samples_per_pixel, int max_depth, bool show_progress = true,
+    bool collect_features = false
+) {
+    accumulation_buffer sums(image_width, image_height, render_seed);
+    render_progressive(world, cam, background, max_depth, samples_per_pixel, sums, {},
+                       show_progress, nullptr, collect_features);
+    return sums.resolve();
+}
 
-    auto aspect_ratio = 16.0 / 9.0;
+// One of the scenes above and how main looks at it.
+struct scene_setup {
+    hittable_list world;
+    double aspect_ratio = 16.0 / 9.0;
     int image_width = 600;
     int samples_per_pixel = 100;
     int max_depth = 50;
+    point3 lookfrom;
+    point3 lookat;
+    double vfov = 40.0;
+    double aperture = 0.0;
+    color background = color(0,0,0);
+    preview_settings preview;
+
+    int image_height() const { return static_cast<int>(image_width / aspect_ratio); }
+
+    // Renders a preview instead, at fewer samples per pixel. Ambient occlusion reaches a
+    // tenth of the way to the point looked at unless `distance` is given, and the clay key
+    // light shines from above and behind the camera.
+    void use_preview(preview_mode mode, double distance = 0) {
+        auto to_camera = lookfrom - lookat;
+        preview.mode = mode;
+        preview.distance = distance > 0 ? distance : 0.1 * to_camera.length();
+        preview.key_light = unit_vector(unit_vector(to_camera) + vec3(0,1,0));
+        samples_per_pixel = 16;
+    }
 
-    // World
+    camera make_camera(int image_height, double time0 = 0.0, double time1 = 1.0) const {
+        const vec3 vup(0,1,0);
+        const auto dist_to_focus = 10.0;
 
-    hittable_list world;
+        camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, time0,
+                   time1);
+        cam.set_image_height(image_height);
+        return cam;
+    }
+};
 
-    point3 lookfrom;
-    point3 lookat;
-    auto vfov = 40.0;
-    auto aperture = 0.0;
-    color background(0,0,0);
 
-    switch (1) {
+scene_setup select_scene(int id) {
+    scene_setup scene;
+    material::restart_numbering();
+
+    switch (id) {
         case 1:
-            world = random_scene();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13,2,3);
-            lookat = point3(0,0,0);
-            vfov = 20.0;
-            aperture = 0.1;
+            scene.world = random_scene();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(13,2,3);
+            scene.lookat = point3(0,0,0);
+            scene.vfov = 20.0;
+            scene.aperture = 0.1;
             break;
 
         case 2:
-            world = two_spheres();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13,2,3);
-            lookat = point3(0,0,0);
-            vfov = 20.0;
+            scene.world = two_spheres();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(13,2,3);
+            scene.lookat = point3(0,0,0);
+            scene.vfov = 20.0;
             break;
 
         case 3:
-            world = two_perlin_spheres();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13,2,3);
-            lookat = point3(0,0,0);
-            vfov = 20.0;
+            scene.world = two_perlin_spheres();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(13,2,3);
+            scene.lookat = point3(0,0,0);
+            scene.vfov = 20.0;
             break;
 
         case 4:
-            world = earth();
-            background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(0,0,12);
-            lookat = point3(0,0,0);
-            vfov = 20.0;
+            scene.world = earth();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(0,0,12);
+            scene.lookat = point3(0,0,0);
+            scene.vfov = 20.0;
             break;
 
         case 5:
-            world = simple_light();
-            samples_per_pixel = 400;
-            lookfrom = point3(26,3,6);
-            lookat = point3(0,2,0);
-            vfov = 20.0;
+            scene.world = simple_light();
+            scene.samples_per_pixel = 400;
+            scene.lookfrom = point3(26,3,6);
+            scene.lookat = point3(0,2,0);
+            scene.vfov = 20.0;
             break;
 
         default:
         case 6:
-            world = cornell_box();
-            aspect_ratio = 1.0;
-            image_width = 600;
-            samples_per_pixel = 100;
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
+            scene.world = cornell_box();
+            scene.aspect_ratio = 1.0;
+            scene.image_width = 600;
+            scene.samples_per_pixel = 100;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 40.0;
             break;
 
         case 7:
-            world = cornell_smoke();
-            aspect_ratio = 1.0;
-            image_width = 600;
-            samples_per_pixel = 200;
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
+            scene.world = cornell_smoke();
+            scene.aspect_ratio = 1.0;
+            scene.image_width = 600;
+            scene.samples_per_pixel = 200;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 40.0;
             break;
 
         case 8:
-            world = final_scene();
-            aspect_ratio = 1.0;
-            image_width = 800;
-            samples_per_pixel = 100;
-            lookfrom = point3(478, 278, -600);
-            lookat = point3(278, 278, 0);
+            scene.world = final_scene();
+            scene.aspect_ratio = 1.0;
+            scene.image_width = 800;
+            scene.samples_per_pixel = 100;
+            scene.lookfrom = point3(478, 278, -600);
+            scene.lookat = point3(278, 278, 0);
             //background = color(0.50, 0.0, .50);
-            vfov = 40.0;
+            scene.vfov = 40.0;
+            break;
+
+        case 9:
+            scene.world = mesh_scene();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(0,2,8);
+            scene.lookat = point3(0,1,0);
+            scene.vfov = 30.0;
+            break;
+
+        case 10:
+            scene.world = instanced_clusters();
+            scene.background = color(0.70, 0.80, 1.00);
+            scene.lookfrom = point3(-30, 40, -30);
+            scene.lookat = point3(200, 0, 200);
+            scene.vfov = 40.0;
+            break;
+
+        case 11:
+            scene.world = cornell_cloud();
+            scene.aspect_ratio = 1.0;
+            scene.image_width = 600;
+            scene.samples_per_pixel = 200;
+            scene.lookfrom = point3(278, 278, -800);
+            scene.lookat = point3(278, 278, 0);
+            scene.vfov = 40.0;
             break;
     }
 
-    // Camera
+    return scene;
+}
+
+
+// Identifies one render: a checkpoint, or a worker's copy of the scene, only belongs with the
+// render that has the same key. The samples per pixel are left out, so that a finished render
+// can be resumed to take more.
+uint64_t render_key(
+    int scene, int width, int height, int max_depth, int bake_textures, bool features,
+    const hittable_list& world
+) {
+    scene_hasher key;
+    key.add(static_cast<uint64_t>(checkpoint_version));
+    for (auto setting : { scene, width, height, max_depth, bake_textures, int(features) })
+        key.add(static_cast<uint64_t>(setting));
+    key.add(render_seed);
+    key.add(scene_hash(world.objects, 0.0, 1.0));
+    return key.result();
+}
+
+
+// Takes part in a render run by a coordinator elsewhere, rebuilding the scene from the id and
+// settings that the coordinator sends.
+bool run_render_worker(const std::string& address) {
+    scene_setup setup;
+    camera cam;
+    int max_depth = 0;
+    bool features = false;
+    render_pool pool;
+
+    auto prepare = [&](const render_job& job) {
+        setup = select_scene(job.scene);
+        finalize_scene(setup.world, job.bake_textures);
+        cam = setup.make_camera(job.height);
+        max_depth = job.max_depth;
+        features = job.features != 0;
+        return render_key(job.scene, job.width, job.height, job.max_depth, job.bake_textures,
+                          features, setup.world);
+    };
+
+    auto render = [&](int row_begin, int row_end, int target, accumulation_buffer& sums) {
+        std::atomic<int> rows_remaining = row_end - row_begin;
+        render_rows_threaded(setup.world, cam, setup.background, max_depth, target, target,
+                             row_begin, row_end, sums, rows_remaining, pool, features);
+    };
+
+    return run_worker(address, prepare, render);
+}
+
+
+
+// Renders frames [first_frame, last_frame] of a fly-through of `setup` along `path`, writing
+// each to `prefix`. The scene is built once and the threads of `pool` serve every frame, and
+// each frame is denoised and written while the next one renders. With a positive
+// `frame_time`, frame f is exposed over [f, f+1] * frame_time, so that moving objects carry
+// on moving from frame to frame, and the scene's BVHs are refitted to each frame. Otherwise
+// every frame sees the scene's own shutter interval. Returns false if a frame could not be
+// written.
+bool render_animation(
+    scene_setup& setup, const camera_path& path, int first_frame, int last_frame, int samples,
+    const std::string& prefix, bool denoise_frames, render_pool& pool, bool show_progress = true,
+    double frame_time = 0
+) {
+    const int image_width = setup.image_width;
+    const int image_height = setup.image_height();
+    const int frame_count = last_frame - first_frame + 1;
+    frame_writer writer;
+    flat_bvh_updater updater;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = first_frame; frame <= last_frame; frame++) {
+        auto key = path.at(frame);
+        setup.lookfrom = key.lookfrom;
+        setup.lookat = key.lookat;
+        setup.vfov = key.vfov;
+
+        auto time0 = 0.0, time1 = 1.0;
+        if (frame_time > 0) {
+            time0 = frame * frame_time;
+            time1 = time0 + frame_time;
+            updater.update(setup.world, time0, time1);
+
+            // Threads on other NUMA nodes trace their own copies of the trees.
+            if (auto placement = pool.placement()) {
+                for (auto& node_world : placement->node_worlds)
+                    if (auto list = std::dynamic_pointer_cast<hittable_list>(node_world))
+                        updater.update(*list, time0, time1);
+            }
+        }
+        auto cam = setup.make_camera(image_height, time0, time1);
+
+        // Each frame gets its own random sequences, so that the noise does not stay fixed to
+        // the screen as the camera moves.
+        auto frame_ms = time_ms([&] {
+            accumulation_buffer sums(image_width, image_height, render_seed + frame);
+            render_progressive(setup.world, cam, setup.background, setup.max_depth, samples,
+                               sums, {}, false, &pool, denoise_frames, setup.preview);
+            writer.write(sums.resolve(), frame_filename(prefix, frame), denoise_frames);
+        });
+
+        if (show_progress)
+            std::cerr << "\rFrame " << frame << " (" << frame - first_frame + 1 << " of "
+                      << frame_count << "): " << static_cast<int>(frame_ms) << " ms   "
+                      << std::flush;
+    }
+    auto written = writer.finish();
+
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    if (show_progress) {
+        std::cerr << "\n" << frame_count << " frames in " << seconds.count() << " s, "
+                  << frame_count / seconds.count() << " frames per second\n";
+        if (updater.refits > 0)
+            std::cerr << "BVH updates: " << updater.refits << " refits averaging "
+                      << updater.refit_ms / updater.refits << " ms, " << updater.rebuilds
+                      << " rebuilds averaging "
+                      << (updater.rebuilds ? updater.rebuild_ms / updater.rebuilds : 0.0)
+                      << " ms\n";
+    }
+    return written;
+}
+
+
+// The benchmarks time the scenes and render functions above, so they come after them.
+#include "benchmarks.h"
+
 
-    const vec3 vup(0,1,0);
-    const auto dist_to_focus = 10.0;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
+int main(int argc, char* argv[]) {
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+    auto options = parse_options(argc, argv);
+    bvh_cache_directory = options.bvh_cache;
+    texture_cache_directory = options.texture_cache;
+
+    if (!options.bench.empty()) {
+        if (run_benchmark(options.bench))
+            return 0;
+        std::cerr << "Unknown benchmark '" << options.bench << "'.\n";
+        return 1;
+    }
+
+    if (!options.worker.empty())
+        return run_render_worker(options.worker) ? 0 : 1;
+
+    auto preview = preview_mode::none;
+    if (!options.preview.empty() && !preview_settings::parse(options.preview, preview)) {
+        std::cerr << "ERROR: Unknown preview '" << options.preview << "', expected ao or clay.\n";
+        return 1;
+    }
+
+    // World
+
+    // Objects made while the scene is built and finalized go into the arena, which lives on
+    // for as long as they do.
+    scene_setup setup;
+    {
+        shared_ptr<scene_arena> arena;
+        if (options.scene_arena)
+            arena = make_shared<scene_arena>(options.huge_pages);
+        scene_arena_scope scope(arena);
+
+        setup = select_scene(options.scene);
+        finalize_scene(setup.world, options.bake_textures);
+
+        if (arena)
+            std::cerr << "Scene arena: " << arena->bytes_used() / 1024 << " KiB in "
+                      << arena->block_count() << " blocks\n";
+    }
+
+    if (preview != preview_mode::none)
+        setup.use_preview(preview, options.ao_distance);
+
+    auto& world = setup.world;
+    const auto& background = setup.background;
+    const int max_depth = setup.max_depth;
+
+    auto samples_per_pixel = setup.samples_per_pixel;
+    if (options.samples_per_pixel > 0)
+        samples_per_pixel = options.samples_per_pixel;
+
+    // Only the denoiser and the output layers look at the first-hit features.
+    const bool collect_features = options.denoise || !options.aov_prefix.empty();
+
+    // Camera
+
+    const int image_width = setup.image_width;
+    const int image_height = setup.image_height();
+    auto cam = setup.make_camera(image_height);
 
     // Render
 
@@ -452,29 +967,97 @@ int main() {
     //    }
     //}
 
-    std::atomic<int> scan_lines_remaining = image_height;
+    checkpoint_schedule checkpoint;
+    checkpoint.filename = options.checkpoint;
+    checkpoint.render_key = render_key(options.scene, image_width, image_height, max_depth,
+                                       options.bake_textures, collect_features, world);
+    checkpoint.minutes = options.checkpoint_minutes;
+    checkpoint.samples = options.checkpoint_samples;
+
+    // Pinned threads set up their own rows of the framebuffer, so that its pages are placed on
+    // their nodes.
+    thread_placement placement;
+    bool pinned = options.pin || options.replicate_bvh;
+    if (pinned) {
+        auto topology = numa_topology::detect();
+        placement = thread_placement::make(topology, topology.cpu_count(), topology.node_count(),
+                                           true);
+        if (options.replicate_bvh)
+            replicate_scene_per_node(placement, world);
+        std::cerr << "Pinned " << placement.thread_count() << " threads over "
+                  << topology.node_count() << " NUMA nodes\n";
+    }
 
-    const int num_threads = std::thread::hardware_concurrency();
-    std::vector<std::vector<color>> thread_outputs(num_threads);
-    std::vector<std::thread> threads(num_threads + 1);
-    for (size_t i = 0; i < num_threads; i++)
-    {
-        int k = i + 1;
-        int threadHeight = ceilf(image_height / num_threads);
-        int threadIndex = threadHeight * i;
-        int endHeight = threadHeight + threadIndex;
-        int startHeight = endHeight - threadHeight;
-        thread_outputs[i].reserve(threadHeight* image_width);
-        threads[i] = std::thread(&DrawPixel, samples_per_pixel, image_width, image_height, startHeight, endHeight, max_depth, world, cam, std::ref(thread_outputs[i]), background, std::ref(scan_lines_remaining));
+    // Only animations and the threaded render use worker threads. The coordinator and forked
+    // renders start none, so render processes are not forked from a process full of threads.
+    std::unique_ptr<render_pool> pool;
+    bool threaded = options.serve.empty() && options.processes == 0;
+    if (threaded || !options.camera_path.empty())
+        pool = std::make_unique<render_pool>(pinned ? &placement : nullptr);
+
+    if (!options.camera_path.empty()) {
+        camera_path path;
+        std::string error;
+        if (!camera_path::read(options.camera_path, path, error)) {
+            std::cerr << "ERROR: " << error << '\n';
+            return 1;
+        }
 
-    }
+        auto first_frame = options.first_frame;
+        auto last_frame = options.last_frame;
+        if (first_frame < 0) {
+            first_frame = static_cast<int>(std::ceil(path.first_frame()));
+            last_frame = static_cast<int>(std::floor(path.last_frame()));
+        }
 
-    threads[num_threads] = std::thread(print_lines_remaining, std::ref(scan_lines_remaining));
+        return render_animation(setup, path, first_frame, last_frame, samples_per_pixel,
+                                options.frame_prefix, options.denoise, *pool, true,
+                                options.frame_time) ? 0 : 1;
+    }
+    accumulation_buffer sums(image_width, image_height, render_seed, !(pinned && pool));
+    if (pinned && pool)
+        pool->for_rows(0, image_height, [&](int, int start, int end) {
+            sums.initialize_rows(start, end);
+        });
+
+    if (options.resume) {
+        if (!read_checkpoint(options.checkpoint, sums, checkpoint.render_key)) {
+            std::cerr << "ERROR: Could not resume from checkpoint '" << options.checkpoint
+                      << "'. It is missing, damaged or from a different render.\n";
+            return 1;
+        }
+        std::cerr << "Resuming at " << sums.samples_done() << " of " << samples_per_pixel
+                  << " samples per pixel\n";
+    }
 
-    for (size_t i = 0; i < num_threads + 1; i++)
-    {
-        threads[i].join();
+    if (!options.serve.empty()) {
+        render_job job = { options.scene, image_width, image_height, max_depth,
+                           options.bake_textures, samples_per_pixel, 0,
+                           collect_features ? 1u : 0u, checkpoint.render_key };
+        render_coordinator coordinator(job, sums, checkpoint);
+        if (!coordinator.run(options.serve)) {
+            std::cerr << "ERROR: Could not listen on '" << options.serve << "'.\n";
+            return 1;
+        }
+    } else if (options.processes > 0) {
+        auto render_band = [&](int row_begin, int row_end, accumulation_buffer& band_sums) {
+            std::atomic<int> rows_remaining = row_end - row_begin;
+            render_rows(world, cam, background, max_depth, samples_per_pixel, samples_per_pixel,
+                        row_begin, row_end, band_sums, rows_remaining, collect_features,
+                        setup.preview);
+        };
+        if (!render_forked(sums, options.processes, 8, render_band, print_lines_remaining)) {
+            std::cerr << "ERROR: Could not start render processes.\n";
+            return 1;
+        }
+        if (!checkpoint.filename.empty()
+            && !write_checkpoint(checkpoint.filename, sums, checkpoint.render_key))
+            std::cerr << "WARNING: Could not write checkpoint '" << checkpoint.filename << "'.\n";
+    } else {
+        render_progressive(world, cam, background, max_depth, samples_per_pixel, sums,
+                           checkpoint, true, pool.get(), collect_features, setup.preview);
     }
+    auto image = sums.resolve();
 
     auto t2 = std::chrono::high_resolution_clock::now();
 
@@ -482,18 +1065,22 @@ int main() {
 
     std::cerr << "Time Taken: " << t3 << std::endl;
 
-    std::vector<color> finished;
-    for (size_t i = 0; i < num_threads; i++)
-    {
-        finished.insert(finished.end(), thread_outputs[i].begin(), thread_outputs[i].end());
-    }
-    
-    std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-    for (int i = finished.size() - 1; i >= 0; i--)
-    {
-        std::cout << (int)finished[i].x() << ' ' << (int)finished[i].y() << ' ' << (int)finished[i].z() << std::endl;
+    // Layers are written before denoising, so that direct and indirect light add up to the
+    // unfiltered image.
+    if (!options.aov_prefix.empty() && !image.write_layers(options.aov_prefix))
+        std::cerr << "ERROR: Could not write output layers to '" << options.aov_prefix
+                  << ".*'.\n";
+
+    if (options.denoise) {
+        auto start = std::chrono::high_resolution_clock::now();
+        denoise(image);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start);
+        std::cerr << "Denoised in " << elapsed.count() << " ms\n";
     }
 
+    image.write_ppm(std::cout);
+
     std::cerr << "\nDone.\n";
     
 }
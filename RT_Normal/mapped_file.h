@@ -0,0 +1,186 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#ifdef _WIN32
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+
+// A read-only view of a whole file. Pages are brought in by the OS on first access and are
+// shared through the page cache with every other process mapping the same file.
+class mapped_file {
+    public:
+        mapped_file(const char* filename);
+        ~mapped_file();
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        bool valid() const { return bytes != nullptr; }
+        const unsigned char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const unsigned char* bytes = nullptr;
+        size_t length = 0;
+
+#ifdef _WIN32
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#endif
+};
+
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const char* filename) {
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+        return;
+
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+        return;
+
+    bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (bytes)
+        length = static_cast<size_t>(file_size.QuadPart);
+}
+
+
+mapped_file::~mapped_file() {
+    if (bytes) UnmapViewOfFile(bytes);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+#else
+
+mapped_file::mapped_file(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            bytes = static_cast<const unsigned char*>(p);
+            length = static_cast<size_t>(st.st_size);
+        }
+    }
+
+    // The mapping keeps its own reference to the file.
+    close(fd);
+}
+
+
+mapped_file::~mapped_file() {
+    if (bytes)
+        munmap(const_cast<unsigned char*>(bytes), length);
+}
+
+#endif
+
+
+// Creates a new, empty file next to `filename` with a name no other writer is using: this
+// process's id and a counter, with the file opened exclusively so that a name left behind by
+// an earlier process is skipped. Returns false if none could be created.
+inline bool create_temporary_file(const std::string& filename, std::string& temp_name) {
+    static std::atomic<unsigned> counter{0};
+#ifdef _WIN32
+    auto pid = static_cast<unsigned long>(GetCurrentProcessId());
+#else
+    auto pid = static_cast<unsigned long>(getpid());
+#endif
+
+    for (int attempt = 0; attempt < 100; attempt++) {
+        temp_name = filename + "." + std::to_string(pid) + "." + std::to_string(counter++)
+                  + ".tmp";
+#ifdef _WIN32
+        HANDLE file = CreateFileA(temp_name.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+            return true;
+        }
+        if (GetLastError() != ERROR_FILE_EXISTS)
+            return false;
+#else
+        int fd = open(temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        if (errno != EEXIST)
+            return false;
+#endif
+    }
+
+    return false;
+}
+
+
+// Writes `filename` through write(out), which fills an open binary stream. The data goes to a
+// temporary file of this writer's own that is renamed over `filename` once complete, so that
+// readers see the old file or the whole new one, even with other processes writing the same
+// file at once. Returns false, leaving `filename` alone, if anything fails.
+template <typename Write>
+bool write_file_atomically(const std::string& filename, Write&& write) {
+    std::string temp_name;
+    if (!create_temporary_file(filename, temp_name))
+        return false;
+
+    bool written = false;
+    {
+        std::ofstream out(temp_name, std::ios::binary | std::ios::trunc);
+        if (out) {
+            write(out);
+            out.flush();
+            written = static_cast<bool>(out);
+        }
+    }
+
+    std::error_code ec;
+    if (written)
+        std::filesystem::rename(temp_name, filename, ec);
+    if (!written || ec) {
+        std::filesystem::remove(temp_name, ec);
+        return false;
+    }
+    return true;
+}
+
+
+#endif
@@ -14,11 +14,14 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "scene_arena.h"
 #include "texture.h"
 
 
 class material {
     public:
+        material() : id(next_id()++) {}
+
         virtual color emitted(double u, double v, const point3& p) const {
             return color(0,0,0);
         }
@@ -26,12 +29,33 @@ class material {
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
         ) const = 0;
+
+        // The surface colour at a hit, apart from lighting. The denoiser divides it out before
+        // filtering so that texture detail is not blurred, and multiplies it back afterwards.
+        virtual color feature_albedo(const hit_record& rec) const {
+            return color(1,1,1);
+        }
+
+        // Starts numbering the materials made on this thread from 0 again. select_scene does
+        // this for every scene, so that a scene's ids do not depend on what was built before
+        // it, and a render worker numbers them as the coordinator did.
+        static void restart_numbering() { next_id() = 0; }
+
+    public:
+        // Numbers materials in the order they are made, for the material ID output layer.
+        int id;
+
+    private:
+        static int& next_id() {
+            thread_local int count = 0;
+            return count;
+        }
 };
 
 
 class lambertian : public material {
     public:
-        lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
+        lambertian(const color& a) : albedo(arena_shared<solid_color>(a)) {}
         lambertian(shared_ptr<texture> a) : albedo(a) {}
 
         virtual bool scatter(
@@ -44,10 +68,16 @@ class lambertian : public material {
                 scatter_direction = rec.normal;
 
             scattered = ray(rec.p, scatter_direction, r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            double du, dv;
+            rec.footprint(r_in, du, dv);
+            attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, du, dv);
             return true;
         }
 
+        virtual color feature_albedo(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -66,6 +96,10 @@ class metal : public material {
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        virtual color feature_albedo(const hit_record& rec) const override {
+            return albedo;
+        }
+
     public:
         color albedo;
         double fuzz;
@@ -114,7 +148,7 @@ class dielectric : public material {
 class diffuse_light : public material {
     public:
         diffuse_light(shared_ptr<texture> a) : emit(a) {}
-        diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+        diffuse_light(color c) : emit(arena_shared<solid_color>(c)) {}
 
         virtual bool scatter(
             const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
@@ -133,7 +167,7 @@ class diffuse_light : public material {
 
 class isotropic : public material {
     public:
-        isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
+        isotropic(color c) : albedo(arena_shared<solid_color>(c)) {}
         isotropic(shared_ptr<texture> a) : albedo(a) {}
 
         virtual bool scatter(
@@ -144,6 +178,10 @@ class isotropic : public material {
             return true;
         }
 
+        virtual color feature_albedo(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -29,6 +29,11 @@ class moving_sphere : public hittable {
 
         virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
         point3 center(double time) const;
 
     public:
@@ -75,11 +80,36 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     }
 
     rec.t = root;
+    rec.pending = this;
+
+    return true;
+}
+
+
+void moving_sphere::finalize_hit(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
     rec.mat_ptr = mat_ptr;
+}
+
+
+bool moving_sphere::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    vec3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto t0 = fmax((-half_b - sqrtd) / a, t_min);
+    auto t1 = fmin((-half_b + sqrtd) / a, t_max);
+    if (t0 >= t1)
+        return false;
 
+    out.add(t0, t1);
     return true;
 }
 
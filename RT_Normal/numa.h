@@ -0,0 +1,193 @@
+#ifndef NUMA_H
+#define NUMA_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "flat_bvh.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+
+// Which CPUs belong to which NUMA node, read from sysfs. Elsewhere, or where sysfs says
+// nothing, every CPU counts as one node.
+struct numa_topology {
+    std::vector<std::vector<int>> node_cpus;
+
+    int node_count() const { return static_cast<int>(node_cpus.size()); }
+
+    int cpu_count() const {
+        size_t count = 0;
+        for (const auto& cpus : node_cpus)
+            count += cpus.size();
+        return static_cast<int>(count);
+    }
+
+    static numa_topology detect();
+};
+
+
+// Parses a sysfs CPU list such as "0-3,8-11".
+std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::stringstream ranges(text);
+    std::string range;
+
+    while (std::getline(ranges, range, ',')) {
+        if (range.empty() || range == "\n")
+            continue;
+        auto dash = range.find('-');
+        auto first = std::atoi(range.c_str());
+        auto last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+
+    return cpus;
+}
+
+
+numa_topology numa_topology::detect() {
+    numa_topology topology;
+
+#ifdef __linux__
+    for (int node = 0; ; node++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in)
+            break;
+
+        std::string text;
+        std::getline(in, text);
+        auto cpus = parse_cpu_list(text);
+        if (!cpus.empty())
+            topology.node_cpus.push_back(cpus);
+    }
+#endif
+
+    if (topology.node_cpus.empty()) {
+        std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+        for (size_t i = 0; i < cpus.size(); i++)
+            cpus[i] = static_cast<int>(i);
+        topology.node_cpus.push_back(cpus);
+    }
+
+    return topology;
+}
+
+
+// Binds the calling thread to one CPU. Returns false where that is not supported.
+inline bool pin_current_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+
+// Where each render thread runs, and the copy of the scene it traces. Thread i is pinned to
+// cpus[i] on node nodes[i], and, if there are any, traces node_worlds[nodes[i]].
+struct thread_placement {
+    std::vector<int> cpus;
+    std::vector<int> nodes;
+    std::vector<shared_ptr<hittable>> node_worlds;
+
+    int thread_count() const { return static_cast<int>(cpus.size()); }
+
+    const hittable& world_for(int thread, const hittable& shared_world) const {
+        return node_worlds.empty() ? shared_world : *node_worlds[nodes[thread]];
+    }
+
+    // `thread_count` threads over the first `node_limit` nodes. Spreading deals threads to
+    // the nodes in turn; otherwise each node is filled before the next is used.
+    static thread_placement make(
+        const numa_topology& topology, int thread_count, int node_limit, bool spread);
+};
+
+
+thread_placement thread_placement::make(
+    const numa_topology& topology, int thread_count, int node_limit, bool spread
+) {
+    thread_placement placement;
+    auto node_count = std::clamp(node_limit, 1, topology.node_count());
+
+    std::vector<size_t> used(node_count, 0);
+    int node = 0;
+    for (int thread = 0; thread < thread_count; thread++) {
+        // Past one thread per CPU, CPUs are reused in the same order.
+        const auto& cpus = topology.node_cpus[node];
+        placement.cpus.push_back(cpus[used[node] % cpus.size()]);
+        placement.nodes.push_back(node);
+        used[node]++;
+
+        if (spread || used[node] % cpus.size() == 0)
+            node = (node + 1) % node_count;
+    }
+
+    return placement;
+}
+
+
+// A copy of `world` whose top-level BVHs have their own nodes. Objects and nested trees stay
+// shared. Called from a thread pinned to a node, the copied nodes land on that node.
+shared_ptr<hittable> replicate_scene(const hittable_list& world) {
+    auto copy = make_shared<hittable_list>();
+
+    for (const auto& object : world.objects) {
+        if (auto bvh = dynamic_cast<const flat_bvh*>(object.get()))
+            copy->add(bvh->replicate());
+        else if (auto list = dynamic_cast<const hittable_list*>(object.get()))
+            copy->add(replicate_scene(*list));
+        else
+            copy->add(object);
+    }
+
+    return copy;
+}
+
+
+// Makes one copy of the scene per node used by `placement`, each built by a thread pinned to
+// that node.
+void replicate_scene_per_node(thread_placement& placement, const hittable_list& world) {
+    auto node_count = 1 + *std::max_element(placement.nodes.begin(), placement.nodes.end());
+    placement.node_worlds.assign(node_count, nullptr);
+
+    for (int node = 0; node < node_count; node++) {
+        auto thread = std::find(placement.nodes.begin(), placement.nodes.end(), node)
+                    - placement.nodes.begin();
+        if (thread == placement.thread_count())
+            continue;
+
+        auto cpu = placement.cpus[thread];
+        std::thread([&, node, cpu] {
+            pin_current_thread(cpu);
+            placement.node_worlds[node] = replicate_scene(world);
+        }).join();
+    }
+}
+
+
+#endif
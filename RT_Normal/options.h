@@ -0,0 +1,201 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+
+struct render_options {
+    int scene = 1;                       // which of the scenes in main.cc to render
+    std::string bvh_cache = "bvh_cache"; // directory for cached BVHs, empty to disable
+    std::string texture_cache = "texture_cache"; // converted image textures, empty to disable
+    std::string bench;                   // run the named benchmark instead of rendering
+    int bake_textures = 0;               // lattice resolution for baked procedural textures
+    bool denoise = false;                // filter the image guided by first-hit features
+    std::string aov_prefix;              // where to write the extra output layers, if anywhere
+    int samples_per_pixel = 0;           // overrides the scene's own count when positive
+    std::string checkpoint;              // file to save progress to, empty for none
+    double checkpoint_minutes = 10;      // save at least this often
+    int checkpoint_samples = 0;          // and after this many samples per pixel, if positive
+    bool resume = false;                 // continue from the checkpoint file
+    std::string serve;                   // hand the render out to workers connecting here
+    std::string worker;                  // render jobs for the coordinator at this address
+    int processes = 0;                   // render in this many forked processes, if positive
+    bool pin = false;                    // pin render threads to CPUs, spread over NUMA nodes
+    bool replicate_bvh = false;          // and give each node its own copy of the top-level BVH
+    std::string camera_path;             // render an animation along this path, if given
+    int first_frame = -1;                // the frames to render, or all of the path if negative
+    int last_frame = -1;
+    std::string frame_prefix = "frame";  // where to write the frames
+    double frame_time = 0;               // scene time per frame, 0 to keep every frame at [0, 1]
+    bool scene_arena = false;            // build the scene's objects into one arena
+    bool huge_pages = false;             // and back the arena with huge pages
+    std::string preview;                 // "ao" or "clay" for a quick preview, empty for none
+    double ao_distance = 0;              // reach of ambient occlusion, or chosen by the scene
+};
+
+
+void print_usage(const char* program) {
+    std::cerr
+        << "Usage: " << program << " [options] > image.ppm\n"
+        << "  --scene N          scene to render (1-11)\n"
+        << "  --bvh-cache DIR    directory for cached acceleration structures\n"
+        << "  --no-bvh-cache     always build acceleration structures from scratch\n"
+        << "  --texture-cache DIR\n"
+        << "                     directory for converted image textures\n"
+        << "  --no-texture-cache always decode image textures from scratch\n"
+        << "  --bake-textures N  bake procedural textures into lattices of about N points a side\n"
+        << "  --denoise          filter sampling noise out of the finished image\n"
+        << "  --aovs PREFIX      also write depth, normal, albedo, ids, direct and indirect light\n"
+        << "                     and sample counts to PREFIX.<layer>.pfm\n"
+        << "  --spp N            samples per pixel, instead of the scene's own count\n"
+        << "  --checkpoint FILE  save progress to FILE while rendering, and when done\n"
+        << "  --checkpoint-minutes N\n"
+        << "                     save progress every N minutes (default 10)\n"
+        << "  --checkpoint-samples N\n"
+        << "                     save progress after every N samples per pixel\n"
+        << "  --resume           continue the render saved in the checkpoint file, up to the\n"
+        << "                     samples per pixel asked for\n"
+        << "  --serve ADDRESS    coordinate a render done by worker processes that connect to\n"
+        << "                     ADDRESS, a Unix socket path or tcp:HOST:PORT\n"
+        << "  --worker ADDRESS   render jobs for the coordinator at ADDRESS until it is done\n"
+        << "  --fork N           render in N forked processes sharing the framebuffer\n"
+        << "  --pin              pin render threads to CPUs spread over the NUMA nodes, each\n"
+        << "                     setting up its own part of the framebuffer\n"
+        << "  --replicate-bvh    as --pin, with a copy of the top-level BVH on each node\n"
+        << "  --camera-path FILE render an animation along the camera keyframes in FILE, one\n"
+        << "                     \"frame  lookfrom x y z  lookat x y z  vfov\" per line\n"
+        << "  --frames FIRST-LAST\n"
+        << "                     the frames to render (default: all of the camera path)\n"
+        << "  --frame-prefix PREFIX\n"
+        << "                     write frames to PREFIX.NNNN.ppm (default: frame)\n"
+        << "  --frame-time T     expose frame N over scene time [N, N+1] * T, so that moving\n"
+        << "                     objects keep moving, refitting BVHs to each frame\n"
+        << "  --arena            build the scene's objects into one contiguous arena\n"
+        << "  --huge-pages       as --arena, with the arena on huge pages where available\n"
+        << "  --preview MODE     render a quick grey preview of the scene's layout instead:\n"
+        << "                     ao (ambient occlusion) or clay (lit grey diffuse), at 16\n"
+        << "                     samples per pixel unless --spp is given\n"
+        << "  --ao-distance D    how far ambient occlusion looks (default: a tenth of the\n"
+        << "                     distance from the camera to the point it looks at)\n"
+        << "  --bench NAME       run a benchmark instead of rendering (startup, triangles,\n"
+        << "                     transforms, motion, volumes, media,\n"
+        << "                     perlin, textures, mipmap,\n"
+        << "                     texture-cache, texture-batch, denoise, fork, numa,\n"
+        << "                     animation, refit, arena, shadow)\n";
+}
+
+
+render_options parse_options(int argc, char* argv[]) {
+    render_options options;
+
+    for (int i = 1; i < argc; i++) {
+        auto arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (!std::strcmp(arg, "--scene") && has_value) {
+            options.scene = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--bvh-cache") && has_value) {
+            options.bvh_cache = argv[++i];
+        } else if (!std::strcmp(arg, "--no-bvh-cache")) {
+            options.bvh_cache.clear();
+        } else if (!std::strcmp(arg, "--texture-cache") && has_value) {
+            options.texture_cache = argv[++i];
+        } else if (!std::strcmp(arg, "--no-texture-cache")) {
+            options.texture_cache.clear();
+        } else if (!std::strcmp(arg, "--bake-textures") && has_value) {
+            options.bake_textures = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--denoise")) {
+            options.denoise = true;
+        } else if (!std::strcmp(arg, "--aovs") && has_value) {
+            options.aov_prefix = argv[++i];
+        } else if (!std::strcmp(arg, "--spp") && has_value) {
+            options.samples_per_pixel = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--checkpoint") && has_value) {
+            options.checkpoint = argv[++i];
+        } else if (!std::strcmp(arg, "--checkpoint-minutes") && has_value) {
+            options.checkpoint_minutes = std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--checkpoint-samples") && has_value) {
+            options.checkpoint_samples = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--resume")) {
+            options.resume = true;
+        } else if (!std::strcmp(arg, "--serve") && has_value) {
+            options.serve = argv[++i];
+        } else if (!std::strcmp(arg, "--worker") && has_value) {
+            options.worker = argv[++i];
+        } else if (!std::strcmp(arg, "--fork") && has_value) {
+            options.processes = std::atoi(argv[++i]);
+        } else if (!std::strcmp(arg, "--pin")) {
+            options.pin = true;
+        } else if (!std::strcmp(arg, "--replicate-bvh")) {
+            options.replicate_bvh = true;
+        } else if (!std::strcmp(arg, "--camera-path") && has_value) {
+            options.camera_path = argv[++i];
+        } else if (!std::strcmp(arg, "--frames") && has_value) {
+            auto range = argv[++i];
+            options.first_frame = options.last_frame = std::atoi(range);
+            if (auto dash = std::strchr(range + 1, '-'))
+                options.last_frame = std::atoi(dash + 1);
+        } else if (!std::strcmp(arg, "--frame-prefix") && has_value) {
+            options.frame_prefix = argv[++i];
+        } else if (!std::strcmp(arg, "--frame-time") && has_value) {
+            options.frame_time = std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--arena")) {
+            options.scene_arena = true;
+        } else if (!std::strcmp(arg, "--huge-pages")) {
+            options.scene_arena = options.huge_pages = true;
+        } else if (!std::strcmp(arg, "--preview") && has_value) {
+            options.preview = argv[++i];
+        } else if (!std::strcmp(arg, "--ao-distance") && has_value) {
+            options.ao_distance = std::atof(argv[++i]);
+        } else if (!std::strcmp(arg, "--bench") && has_value) {
+            options.bench = argv[++i];
+        } else {
+            std::cerr << "Unknown or incomplete option '" << arg << "'.\n";
+            print_usage(argv[0]);
+            std::exit(1);
+        }
+    }
+
+    if (options.resume && options.checkpoint.empty()) {
+        std::cerr << "--resume needs a --checkpoint file.\n";
+        print_usage(argv[0]);
+        std::exit(1);
+    }
+
+    if (!options.camera_path.empty()
+        && (!options.checkpoint.empty() || !options.serve.empty() || options.processes > 0
+            || !options.aov_prefix.empty())) {
+        std::cerr << "--camera-path cannot be combined with --checkpoint, --serve, --fork or "
+                     "--aovs.\n";
+        print_usage(argv[0]);
+        std::exit(1);
+    }
+
+    if (!options.preview.empty() && (!options.checkpoint.empty() || !options.serve.empty())) {
+        std::cerr << "--preview cannot be combined with --checkpoint or --serve.\n";
+        print_usage(argv[0]);
+        std::exit(1);
+    }
+
+    if (options.first_frame < -1 || options.last_frame < options.first_frame) {
+        std::cerr << "--frames needs FIRST-LAST with 0 <= FIRST <= LAST.\n";
+        print_usage(argv[0]);
+        std::exit(1);
+    }
+
+    return options;
+}
+
+
+#endif
@@ -13,108 +13,342 @@
 
 #include "rtweekend.h"
 
+#include "simd.h"
 
+#include <algorithm>
+#include <random>
 
+
+// Gradient and permutation tables shared by every perlin object. Gradients are padded to four
+// floats so that one aligned load fetches a whole gradient.
+struct alignas(64) perlin_tables {
+    static const int point_count = 256;
+
+    float gradient[point_count][4];
+    int perm[3][point_count];
+
+    perlin_tables();
+};
+
+
+perlin_tables::perlin_tables() {
+    // A private generator keeps the tables the same from run to run and leaves the sequence
+    // behind random_double() alone.
+    std::mt19937 gen(2016);
+    std::uniform_real_distribution<double> uniform(-1, 1);
+
+    for (int i = 0; i < point_count; i++) {
+        auto g = unit_vector(vec3(uniform(gen), uniform(gen), uniform(gen)));
+        gradient[i][0] = static_cast<float>(g.x());
+        gradient[i][1] = static_cast<float>(g.y());
+        gradient[i][2] = static_cast<float>(g.z());
+        gradient[i][3] = 0;
+    }
+
+    for (auto& p : perm) {
+        for (int i = 0; i < point_count; i++)
+            p[i] = i;
+        for (int i = point_count-1; i > 0; i--)
+            std::swap(p[i], p[std::uniform_int_distribution<int>(0, i)(gen)]);
+    }
+}
+
+
+inline const perlin_tables& shared_perlin_tables() {
+    static const perlin_tables tables;
+    return tables;
+}
+
+
+// Gradient noise over the shared tables. Noise is evaluated four points at a time: the
+// octaves of one turbulence lookup together, or the same octave of four different points in
+// the batch functions.
 class perlin {
     public:
-        perlin() {
-            ranvec = new vec3[point_count];
-            for (int i = 0; i < point_count; ++i) {
-                ranvec[i] = unit_vector(vec3::random(-1,1));
+        perlin() : tables(&shared_perlin_tables()) {}
+
+        double noise(const point3& p) const;
+
+        double turb(const point3& p, int depth=7) const;
+
+        // out[i] = noise(points[i]) and out[i] = turb(points[i], depth) for count points.
+        void noise_batch(const point3* points, double* out, size_t count) const;
+        void turb_batch(const point3* points, double* out, size_t count, int depth=7) const;
+
+        // The same with the points given as separate x, y and z arrays.
+        void turb_batch(
+            const double* x, const double* y, const double* z, double* out, size_t count,
+            int depth=7) const;
+
+        // One octave at a time in double precision, as a reference for the batched paths.
+        double turb_scalar(const point3& p, int depth=7) const;
+
+    private:
+        void noise4(const double x[4], const double y[4], const double z[4], float out[4]) const;
+
+        template <typename PointAt>
+        void turb_lanes(PointAt&& point_at, double* out, size_t count, int depth) const;
+
+    private:
+        const perlin_tables* tables;
+};
+
+
+double perlin::noise(const point3& p) const {
+    const int mask = perlin_tables::point_count - 1;
+
+    auto u = p.x() - floor(p.x());
+    auto v = p.y() - floor(p.y());
+    auto w = p.z() - floor(p.z());
+    auto i = static_cast<int>(floor(p.x()));
+    auto j = static_cast<int>(floor(p.y()));
+    auto k = static_cast<int>(floor(p.z()));
+
+    auto uu = u*u*(3-2*u);
+    auto vv = v*v*(3-2*v);
+    auto ww = w*w*(3-2*w);
+    auto accum = 0.0;
+
+    for (int di=0; di < 2; di++)
+        for (int dj=0; dj < 2; dj++)
+            for (int dk=0; dk < 2; dk++) {
+                const auto& g = tables->gradient[
+                    tables->perm[0][(i+di) & mask] ^
+                    tables->perm[1][(j+dj) & mask] ^
+                    tables->perm[2][(k+dk) & mask]
+                ];
+                auto dot = g[0]*(u-di) + g[1]*(v-dj) + g[2]*(w-dk);
+                accum += (di*uu + (1-di)*(1-uu))*
+                    (dj*vv + (1-dj)*(1-vv))*
+                    (dk*ww + (1-dk)*(1-ww))*dot;
             }
 
-            perm_x = perlin_generate_perm();
-            perm_y = perlin_generate_perm();
-            perm_z = perlin_generate_perm();
-        }
+    return accum;
+}
+
+
+void perlin::noise4(const double x[4], const double y[4], const double z[4], float out[4]) const {
+    const int mask = perlin_tables::point_count - 1;
+
+#ifdef RTW_SSE
+    // Lattice cell and offset within it for each lane, computed two doubles at a time.
+    auto split = [](const double* c, __m128i& cell, __m128& frac) {
+        auto lo = _mm_loadu_pd(c), hi = _mm_loadu_pd(c + 2);
+        auto ilo = _mm_cvttpd_epi32(lo), ihi = _mm_cvttpd_epi32(hi);
+        auto flo = _mm_cvtepi32_pd(ilo), fhi = _mm_cvtepi32_pd(ihi);
+
+        // Truncation rounds negative values up; step those back down a cell.
+        auto adjust_lo = _mm_and_pd(_mm_cmpgt_pd(flo, lo), _mm_set1_pd(1.0));
+        auto adjust_hi = _mm_and_pd(_mm_cmpgt_pd(fhi, hi), _mm_set1_pd(1.0));
+        flo = _mm_sub_pd(flo, adjust_lo);
+        fhi = _mm_sub_pd(fhi, adjust_hi);
+
+        cell = _mm_unpacklo_epi64(_mm_cvttpd_epi32(flo), _mm_cvttpd_epi32(fhi));
+        frac = _mm_movelh_ps(_mm_cvtpd_ps(_mm_sub_pd(lo, flo)), _mm_cvtpd_ps(_mm_sub_pd(hi, fhi)));
+    };
 
-        ~perlin() {
-            delete[] ranvec;
-            delete[] perm_x;
-            delete[] perm_y;
-            delete[] perm_z;
+    __m128i ci, cj, ck;
+    __m128 u, v, w;
+    split(x, ci, u);
+    split(y, cj, v);
+    split(z, ck, w);
+
+    // Permutation lookups are gathers, which SSE2 has to do one lane at a time.
+    alignas(16) int cell[3][4];
+    const auto m = _mm_set1_epi32(mask);
+    _mm_store_si128(reinterpret_cast<__m128i*>(cell[0]), _mm_and_si128(ci, m));
+    _mm_store_si128(reinterpret_cast<__m128i*>(cell[1]), _mm_and_si128(cj, m));
+    _mm_store_si128(reinterpret_cast<__m128i*>(cell[2]), _mm_and_si128(ck, m));
+
+    alignas(16) int hashed[3][2][4];
+    for (int a = 0; a < 3; a++) {
+        const auto* perm = tables->perm[a];
+        for (int l = 0; l < 4; l++) {
+            hashed[a][0][l] = perm[cell[a][l]];
+            hashed[a][1][l] = perm[(cell[a][l] + 1) & mask];
         }
+    }
+
+    auto load = [&](int a, int d) {
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(hashed[a][d]));
+    };
+    __m128i px[2] = { load(0, 0), load(0, 1) };
+    __m128i py[2] = { load(1, 0), load(1, 1) };
+    __m128i pz[2] = { load(2, 0), load(2, 1) };
+
+    // Corner c of a cell is offset by (c>>2, (c>>1)&1, c&1).
+    alignas(16) int corner[8][4];
+    for (int c = 0; c < 8; c++) {
+        auto h = _mm_xor_si128(_mm_xor_si128(px[c >> 2], py[(c >> 1) & 1]), pz[c & 1]);
+        _mm_store_si128(reinterpret_cast<__m128i*>(corner[c]), h);
+    }
+
+    const auto one = _mm_set1_ps(1.0f);
+    const auto three = _mm_set1_ps(3.0f);
+    const auto two = _mm_set1_ps(2.0f);
+
+    auto um = _mm_sub_ps(u, one), vm = _mm_sub_ps(v, one), wm = _mm_sub_ps(w, one);
+
+    auto fade = [&](__m128 t) {
+        return _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t)));
+    };
+    auto uu = fade(u), vv = fade(v), ww = fade(w);
+
+    __m128 d[8];
+    for (int c = 0; c < 8; c++) {
+        auto g0 = _mm_load_ps(tables->gradient[corner[c][0]]);
+        auto g1 = _mm_load_ps(tables->gradient[corner[c][1]]);
+        auto g2 = _mm_load_ps(tables->gradient[corner[c][2]]);
+        auto g3 = _mm_load_ps(tables->gradient[corner[c][3]]);
+        _MM_TRANSPOSE4_PS(g0, g1, g2, g3);
+
+        d[c] = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(g0, (c & 4) ? um : u),
+            _mm_mul_ps(g1, (c & 2) ? vm : v)),
+            _mm_mul_ps(g2, (c & 1) ? wm : w));
+    }
 
-        double noise(const point3& p) const {
-            auto u = p.x() - floor(p.x());
-            auto v = p.y() - floor(p.y());
-            auto w = p.z() - floor(p.z());
-            auto i = static_cast<int>(floor(p.x()));
-            auto j = static_cast<int>(floor(p.y()));
-            auto k = static_cast<int>(floor(p.z()));
-            vec3 c[2][2][2];
-
-            for (int di=0; di < 2; di++)
-                for (int dj=0; dj < 2; dj++)
-                    for (int dk=0; dk < 2; dk++)
-                        c[di][dj][dk] = ranvec[
-                            perm_x[(i+di) & 255] ^
-                            perm_y[(j+dj) & 255] ^
-                            perm_z[(k+dk) & 255]
-                        ];
-
-            return perlin_interp(c, u, v, w);
+    auto lerp = [](__m128 a, __m128 b, __m128 t) {
+        return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+    };
+    auto a0 = lerp(d[0], d[1], ww), a1 = lerp(d[2], d[3], ww);
+    auto a2 = lerp(d[4], d[5], ww), a3 = lerp(d[6], d[7], ww);
+    _mm_storeu_ps(out, lerp(lerp(a0, a1, vv), lerp(a2, a3, vv), uu));
+#else
+    for (int l = 0; l < 4; l++) {
+        auto xf = floor(x[l]), yf = floor(y[l]), zf = floor(z[l]);
+        auto u = static_cast<float>(x[l] - xf);
+        auto v = static_cast<float>(y[l] - yf);
+        auto w = static_cast<float>(z[l] - zf);
+        auto i = static_cast<int>(xf), j = static_cast<int>(yf), k = static_cast<int>(zf);
+        float uu = u*u*(3-2*u), vv = v*v*(3-2*v), ww = w*w*(3-2*w);
+
+        float d[8];
+        for (int c = 0; c < 8; c++) {
+            const auto& g = tables->gradient[
+                tables->perm[0][(i + (c >> 2)) & mask] ^
+                tables->perm[1][(j + ((c >> 1) & 1)) & mask] ^
+                tables->perm[2][(k + (c & 1)) & mask]
+            ];
+            d[c] = g[0]*(u - (c >> 2)) + g[1]*(v - ((c >> 1) & 1)) + g[2]*(w - (c & 1));
         }
 
-        double turb(const point3& p, int depth=7) const {
-            auto accum = 0.0;
-            auto temp_p = p;
-            auto weight = 1.0;
+        auto lerp = [](float a, float b, float t) { return a + t*(b - a); };
+        auto a0 = lerp(d[0], d[1], ww), a1 = lerp(d[2], d[3], ww);
+        auto a2 = lerp(d[4], d[5], ww), a3 = lerp(d[6], d[7], ww);
+        out[l] = lerp(lerp(a0, a1, vv), lerp(a2, a3, vv), uu);
+    }
+#endif
+}
+
 
-            for (int i = 0; i < depth; i++) {
-                accum += weight * noise(temp_p);
-                weight *= 0.5;
-                temp_p *= 2;
-            }
+double perlin::turb(const point3& p, int depth) const {
+    // Octave o samples p * 2^o with weight 2^-o; four octaves go through noise4 together.
+    double x[4], y[4], z[4];
+    float n[4];
+    auto accum = 0.0;
 
-            return fabs(accum);
+    auto scale = 1.0;
+    auto weight = 1.0;
+
+    for (int first = 0; first < depth; first += 4) {
+        auto lanes = std::min(4, depth - first);
+        auto lane_scale = scale;
+        for (int l = 0; l < 4; l++) {
+            x[l] = lane_scale * p.x();
+            y[l] = lane_scale * p.y();
+            z[l] = lane_scale * p.z();
+            if (l + 1 < lanes)
+                lane_scale *= 2;
         }
 
-    private:
-        static const int point_count = 256;
-        vec3* ranvec;
-        int* perm_x;
-        int* perm_y;
-        int* perm_z;
+        noise4(x, y, z, n);
+        for (int l = 0; l < lanes; l++) {
+            accum += weight * n[l];
+            weight *= 0.5;
+        }
+        scale *= 16;
+    }
 
-        static int* perlin_generate_perm() {
-            auto p = new int[point_count];
+    return fabs(accum);
+}
 
-            for (int i = 0; i < point_count; i++)
-                p[i] = i;
 
-            permute(p, point_count);
+void perlin::noise_batch(const point3* points, double* out, size_t count) const {
+    double x[4], y[4], z[4];
+    float n[4];
 
-            return p;
+    for (size_t start = 0; start < count; start += 4) {
+        auto lanes = std::min<size_t>(4, count - start);
+        for (size_t l = 0; l < 4; l++) {
+            const auto& p = points[start + std::min(l, lanes - 1)];
+            x[l] = p.x();  y[l] = p.y();  z[l] = p.z();
         }
 
-        static void permute(int* p, int n) {
-            for (int i = n-1; i > 0; i--) {
-                int target = random_int(0,i);
-                int tmp = p[i];
-                p[i] = p[target];
-                p[target] = tmp;
+        noise4(x, y, z, n);
+        for (size_t l = 0; l < lanes; l++)
+            out[start + l] = n[l];
+    }
+}
+
+
+template <typename PointAt>
+void perlin::turb_lanes(PointAt&& point_at, double* out, size_t count, int depth) const {
+    double x[4], y[4], z[4];
+    float n[4];
+
+    for (size_t start = 0; start < count; start += 4) {
+        auto lanes = std::min<size_t>(4, count - start);
+        double accum[4] = { 0, 0, 0, 0 };
+
+        auto scale = 1.0;
+        auto weight = 1.0;
+
+        for (int octave = 0; octave < depth; octave++) {
+            for (size_t l = 0; l < 4; l++) {
+                auto p = point_at(start + std::min(l, lanes - 1));
+                x[l] = scale * p.x();  y[l] = scale * p.y();  z[l] = scale * p.z();
             }
-        }
 
-        static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
-            auto uu = u*u*(3-2*u);
-            auto vv = v*v*(3-2*v);
-            auto ww = w*w*(3-2*w);
-            auto accum = 0.0;
-
-            for (int i=0; i < 2; i++)
-                for (int j=0; j < 2; j++)
-                    for (int k=0; k < 2; k++) {
-                        vec3 weight_v(u-i, v-j, w-k);
-                        accum += (i*uu + (1-i)*(1-uu))*
-                            (j*vv + (1-j)*(1-vv))*
-                            (k*ww + (1-k)*(1-ww))*dot(c[i][j][k], weight_v);
-                    }
-
-            return accum;
+            noise4(x, y, z, n);
+            for (size_t l = 0; l < 4; l++)
+                accum[l] += weight * n[l];
+
+            scale *= 2;
+            weight *= 0.5;
         }
-};
+
+        for (size_t l = 0; l < lanes; l++)
+            out[start + l] = fabs(accum[l]);
+    }
+}
+
+
+void perlin::turb_batch(const point3* points, double* out, size_t count, int depth) const {
+    turb_lanes([=](size_t i) { return points[i]; }, out, count, depth);
+}
+
+
+void perlin::turb_batch(
+    const double* x, const double* y, const double* z, double* out, size_t count, int depth
+) const {
+    turb_lanes([=](size_t i) { return point3(x[i], y[i], z[i]); }, out, count, depth);
+}
+
+
+double perlin::turb_scalar(const point3& p, int depth) const {
+    auto accum = 0.0;
+    auto temp_p = p;
+    auto weight = 1.0;
+
+    for (int i = 0; i < depth; i++) {
+        accum += weight * noise(temp_p);
+        weight *= 0.5;
+        temp_p *= 2;
+    }
+
+    return fabs(accum);
+}
 
 
 #endif
@@ -0,0 +1,105 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <string>
+
+
+// Quick looks at a scene's layout instead of a path-traced render. Every surface is the same
+// grey, and each sample takes one camera ray and one or two visibility rays that stop at the
+// first blocker, so a preview is ready after a few samples per pixel.
+enum class preview_mode {
+    none,
+    ambient_occlusion,  // how open each point is within `distance` of it
+    clay,               // grey diffuse lit once by a white sky and a key light
+};
+
+
+struct preview_settings {
+    preview_mode mode = preview_mode::none;
+    double distance = infinity;     // reach of ambient occlusion rays
+    vec3 key_light = vec3(0,1,0);   // unit direction towards the clay key light
+
+    bool enabled() const { return mode != preview_mode::none; }
+
+    // Parses "ao" or "clay". Returns false for anything else.
+    static bool parse(const std::string& name, preview_mode& mode);
+};
+
+
+bool preview_settings::parse(const std::string& name, preview_mode& mode) {
+    if (name == "ao")
+        mode = preview_mode::ambient_occlusion;
+    else if (name == "clay")
+        mode = preview_mode::clay;
+    else
+        return false;
+    return true;
+}
+
+
+// The preview counterpart of ray_color. Lights show as their own colour, scaled down to at
+// most white, so that they can be placed too; media are drawn where their free paths end.
+color preview_color(
+    const ray& r, const color& background, const hittable& world,
+    const preview_settings& preview, first_hit_features* features = nullptr
+) {
+    const color grey(0.7, 0.7, 0.7);
+
+    hit_record rec;
+    if (!world.hit(r, 0.001, infinity, rec)) {
+        if (features)
+            *features = { background, vec3(0,0,0), 0.0, -1, -1, background };
+        return background;
+    }
+
+    rec.finalize(r);
+
+    color result;
+    auto emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    auto brightest = fmax(emitted.x(), fmax(emitted.y(), emitted.z()));
+    if (brightest > 0) {
+        result = emitted / fmax(brightest, 1.0);
+    } else {
+        // Cosine weighted, as a diffuse surface would scatter.
+        auto direction = rec.normal + random_unit_vector();
+        if (direction.near_zero())
+            direction = rec.normal;
+        ray probe(rec.p, unit_vector(direction), r.time());
+
+        if (preview.mode == preview_mode::ambient_occlusion) {
+            auto open = world.occluded(probe, 0.001, preview.distance) ? 0.0 : 1.0;
+            result = color(open, open, open);
+        } else {
+            auto sky = world.occluded(probe, 0.001, infinity) ? 0.0 : 0.6;
+            auto facing = dot(rec.normal, preview.key_light);
+            auto key = 0.0;
+            if (facing > 0 && !world.occluded(ray(rec.p, preview.key_light, r.time()),
+                                              0.001, infinity))
+                key = 0.8 * facing;
+            result = grey * (sky + key);
+        }
+    }
+
+    if (features)
+        *features = { grey, rec.normal, rec.t * r.direction().length(), rec.mat_ptr->id,
+                      rec.object_id, result };
+
+    return result;
+}
+
+
+#endif
@@ -37,6 +37,7 @@ class ray {
         point3 orig;
         vec3 dir;
         double tm;
+        double spread = 0;  // width of the ray's cone per unit t, 0 for an infinitely thin ray
 };
 
 #endif
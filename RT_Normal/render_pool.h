@@ -0,0 +1,132 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "numa.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Render threads that are started once and kept waiting between passes, so that a render of
+// many passes, or of many frames, does not start a new set of threads for each one. Threads
+// are pinned where the placement says, if one is given.
+class render_pool {
+    public:
+        explicit render_pool(const thread_placement* placement = nullptr);
+        ~render_pool();
+
+        render_pool(const render_pool&) = delete;
+        render_pool& operator=(const render_pool&) = delete;
+
+        int thread_count() const { return static_cast<int>(threads.size()); }
+        const thread_placement* placement() const { return placement_; }
+
+        // Splits rows [row_begin, row_end) into a run for each thread, calls body(thread,
+        // start, end) for each run on its thread, and returns when all are done. A thread
+        // always gets the same rows, so it finds them in the memory it first wrote them to.
+        template <typename Body>
+        void for_rows(int row_begin, int row_end, Body&& body);
+
+    private:
+        void run(const std::function<void(int thread)>& task);
+        void work(int thread);
+
+        const thread_placement* placement_;
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable started;
+        std::condition_variable finished;
+        const std::function<void(int)>* task = nullptr;
+        uint64_t generation = 0;
+        int busy = 0;
+        bool stopping = false;
+};
+
+
+render_pool::render_pool(const thread_placement* placement) : placement_(placement) {
+    auto count = placement
+        ? placement->thread_count()
+        : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    for (int thread = 0; thread < count; thread++)
+        threads.emplace_back(&render_pool::work, this, thread);
+}
+
+
+render_pool::~render_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    started.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+
+template <typename Body>
+void render_pool::for_rows(int row_begin, int row_end, Body&& body) {
+    const int rows_per_thread = (row_end - row_begin + thread_count() - 1) / thread_count();
+
+    run([&](int thread) {
+        auto start = row_begin + thread * rows_per_thread;
+        auto end = std::min(start + rows_per_thread, row_end);
+        if (start < end)
+            body(thread, start, end);
+    });
+}
+
+
+void render_pool::run(const std::function<void(int)>& new_task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    task = &new_task;
+    busy = thread_count();
+    generation++;
+    started.notify_all();
+
+    finished.wait(lock, [&] { return busy == 0; });
+    task = nullptr;
+}
+
+
+void render_pool::work(int thread) {
+    if (placement_)
+        pin_current_thread(placement_->cpus[thread]);
+
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        started.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping)
+            return;
+        seen = generation;
+
+        auto current = task;
+        lock.unlock();
+        (*current)(thread);
+        lock.lock();
+
+        if (--busy == 0)
+            finished.notify_one();
+    }
+}
+
+
+#endif
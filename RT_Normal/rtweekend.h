@@ -10,6 +10,7 @@
 //==============================================================================================
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -39,9 +40,33 @@ inline double clamp(double x, double min, double max) {
     return x;
 }
 
+// Random numbers come from a splitmix64 sequence. Its whole state is one word per thread, so
+// threads never contend for it, and the renderer can give each pixel a sequence of its own
+// that is saved and restored exactly.
+inline uint64_t& random_state() {
+    thread_local uint64_t state = 0x853c49e6748fea9bull;
+    return state;
+}
+
+inline void seed_random(uint64_t seed) {
+    random_state() = seed;
+}
+
+const uint64_t random_increment = 0x9e3779b97f4a7c15ull;
+
+inline uint64_t random_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t random_bits() {
+    return random_mix(random_state() += random_increment);
+}
+
 inline double random_double() {
     // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    return (random_bits() >> 11) * (1.0 / 9007199254740992.0);
 }
 
 inline double random_double_messenne() {
@@ -0,0 +1,245 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+#endif
+
+
+// Memory for the objects of one scene. Primitives, materials, textures and BVH nodes made
+// while the arena is current are packed one after another into large blocks, instead of being
+// scattered over the heap, and freeing them costs nothing: the blocks go back all at once when
+// the last object holding the arena is destroyed. Blocks are returned to the system rather
+// than kept for reuse as freed heap memory is, so tearing down a small scene can take longer
+// than on the heap. With huge pages, blocks are 2 MiB aligned and advised to the kernel as
+// huge page candidates, so that traversal misses the TLB less.
+class scene_arena {
+    public:
+        static const size_t huge_page_size = size_t(2) << 20;
+
+        explicit scene_arena(bool huge_pages = false, size_t block_size = huge_page_size)
+            : use_huge_pages(huge_pages), block_bytes(block_size) {}
+
+        ~scene_arena();
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        void* allocate(size_t bytes, size_t alignment);
+
+        size_t bytes_used() const { return used; }
+        size_t bytes_reserved() const { return reserved; }
+        size_t block_count() const { return blocks.size(); }
+
+    private:
+        struct block {
+            unsigned char* data;
+            size_t size;
+            bool mapped;
+        };
+
+        void add_block(size_t min_bytes);
+
+        bool use_huge_pages;
+        size_t block_bytes;
+
+        std::mutex mutex;
+        std::vector<block> blocks;
+        unsigned char* next = nullptr;
+        unsigned char* end = nullptr;
+        size_t used = 0;
+        size_t reserved = 0;
+};
+
+
+scene_arena::~scene_arena() {
+    for (auto& b : blocks) {
+#ifdef __linux__
+        if (b.mapped) {
+            munmap(b.data, b.size);
+            continue;
+        }
+#endif
+        ::operator delete(b.data);
+    }
+}
+
+
+void* scene_arena::allocate(size_t bytes, size_t alignment) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto aligned = [&] {
+        auto address = reinterpret_cast<uintptr_t>(next);
+        return reinterpret_cast<unsigned char*>((address + alignment - 1) & ~(alignment - 1));
+    };
+
+    if (!next || aligned() + bytes > end)
+        add_block(bytes + alignment);
+
+    auto p = aligned();
+    next = p + bytes;
+    used += bytes;
+    return p;
+}
+
+
+void scene_arena::add_block(size_t min_bytes) {
+    auto size = std::max(block_bytes, min_bytes);
+    block b = { nullptr, size, false };
+
+#ifdef __linux__
+    if (use_huge_pages) {
+        // Map a page more than needed and trim it, to start on a huge page boundary.
+        size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+        auto length = size + huge_page_size;
+        auto memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+        if (memory != MAP_FAILED) {
+            auto start = reinterpret_cast<uintptr_t>(memory);
+            auto aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+            if (aligned > start)
+                munmap(memory, aligned - start);
+            if (aligned + size < start + length)
+                munmap(reinterpret_cast<void*>(aligned + size), start + length - aligned - size);
+            madvise(reinterpret_cast<void*>(aligned), size, MADV_HUGEPAGE);
+            b = { reinterpret_cast<unsigned char*>(aligned), size, true };
+        }
+    }
+#endif
+
+    if (!b.data)
+        b.data = static_cast<unsigned char*>(::operator new(b.size));
+
+    blocks.push_back(b);
+    next = b.data;
+    end = b.data + b.size;
+    reserved += b.size;
+}
+
+
+// Hands out arena memory to std::allocate_shared. Each object's control block keeps the arena
+// alive, and giving memory back does nothing, since the arena frees it all together.
+template <typename T>
+struct arena_allocator {
+    using value_type = T;
+
+    explicit arena_allocator(shared_ptr<scene_arena> a) : arena(std::move(a)) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const { return arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const { return arena != other.arena; }
+
+    shared_ptr<scene_arena> arena;
+};
+
+
+// The arena that scene objects made on this thread go into, if any.
+inline shared_ptr<scene_arena>& current_scene_arena() {
+    thread_local shared_ptr<scene_arena> arena;
+    return arena;
+}
+
+
+// Makes `arena` current on this thread for as long as the scope lives.
+class scene_arena_scope {
+    public:
+        explicit scene_arena_scope(shared_ptr<scene_arena> arena)
+            : saved(std::move(current_scene_arena()))
+        {
+            current_scene_arena() = std::move(arena);
+        }
+
+        ~scene_arena_scope() { current_scene_arena() = std::move(saved); }
+
+        scene_arena_scope(const scene_arena_scope&) = delete;
+        scene_arena_scope& operator=(const scene_arena_scope&) = delete;
+
+    private:
+        shared_ptr<scene_arena> saved;
+};
+
+
+// A standard allocator over the scene arena that was current when it was made, or over the
+// heap when there was none. It backs the large arrays that scene objects own, such as BVH
+// nodes and mesh buffers, so that they sit in the arena next to the objects themselves.
+// Containers take their allocator along when they are moved, swapped or assigned.
+template <typename T>
+struct scene_allocator {
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    scene_allocator() : arena(current_scene_arena()) {}
+
+    template <typename U>
+    scene_allocator(const scene_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena)
+            return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (!arena)
+            std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const scene_allocator<U>& other) const { return arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const scene_allocator<U>& other) const { return arena != other.arena; }
+
+    shared_ptr<scene_arena> arena;
+};
+
+// A vector in the current scene arena. Growing one a step at a time leaves the outgrown
+// buffers behind in the arena, so fill it with a known size where possible.
+template <typename T>
+using scene_vector = std::vector<T, scene_allocator<T>>;
+
+
+// make_shared for the objects a scene is built from: in the current scene arena if there is
+// one, and on the heap otherwise.
+template <typename T, typename... Args>
+shared_ptr<T> arena_shared(Args&&... args) {
+    if (auto& arena = current_scene_arena())
+        return std::allocate_shared<T>(arena_allocator<T>(arena), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef SIMD_H
+#define SIMD_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+// RTW_SSE is defined when SSE2 intrinsics can be used. Every SIMD kernel also has a plain C++
+// path, so the renderer still builds for targets without it.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define RTW_SSE 1
+    #include <emmintrin.h>
+#endif
+
+
+#endif
@@ -28,11 +28,25 @@ class sphere : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool intervals(
+            const ray& r, double t_min, double t_max, ray_intervals& out) const override;
+
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
     public:
         point3 center;
         double radius;
         shared_ptr<material> mat_ptr;
 
+    public:
+        // The inverse of get_sphere_uv: the point on the unit sphere with texture coordinates
+        // (u, v).
+        static point3 sphere_point(double u, double v) {
+            auto theta = v * pi;
+            auto phi = u * 2*pi;
+            return point3(-sin(theta)*cos(phi), -cos(theta), sin(theta)*sin(phi));
+        }
+
     private:
         static void get_sphere_uv(const point3& p, double& u, double& v) {
             // p: a given point on the sphere of radius one, centered at the origin.
@@ -78,12 +92,43 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
     }
 
     rec.t = root;
+    rec.pending = this;
+
+    return true;
+}
+
+
+void sphere::finalize_hit(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
+
+    // u runs once around a circle of latitude, v along half a circle of longitude.
+    auto y = outward_normal.y();
+    rec.u_rate = 1 / (2*pi * fabs(radius) * sqrt(fmax(1 - y*y, 1e-6)));
+    rec.v_rate = 1 / (pi * fabs(radius));
     rec.mat_ptr = mat_ptr;
+}
+
+
+bool sphere::intervals(const ray& r, double t_min, double t_max, ray_intervals& out) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius*radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    // Both roots at once: the ray is inside between them.
+    auto t0 = fmax((-half_b - sqrtd) / a, t_min);
+    auto t1 = fmin((-half_b + sqrtd) / a, t_max);
+    if (t0 >= t1)
+        return false;
 
+    out.add(t0, t1);
     return true;
 }
 
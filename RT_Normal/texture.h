@@ -15,13 +15,86 @@
 
 #include "perlin.h"
 #include "rtw_stb_image.h"
+#include "scene_arena.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
+#include <vector>
+
+
+// A batch of shading points for texture::value_batch, with one array per coordinate. du and
+// dv are footprints as for filtered_value, and may be null when there are none.
+struct texture_query {
+    size_t count = 0;
+    const double* u = nullptr;
+    const double* v = nullptr;
+    const double* x = nullptr;
+    const double* y = nullptr;
+    const double* z = nullptr;
+    const double* du = nullptr;
+    const double* dv = nullptr;
+
+    point3 p(size_t i) const { return point3(x[i], y[i], z[i]); }
+};
 
 
 class texture  {
     public:
         virtual color value(double u, double v, const vec3& p) const = 0;
+
+        // The average over a footprint du by dv wide in texture coordinates. Textures that
+        // cannot prefilter just return the value at the centre.
+        virtual color filtered_value(
+            double u, double v, const vec3& p, double du, double dv
+        ) const {
+            return value(u, v, p);
+        }
+
+        // Colours for every point of a query, written to one array per channel. This looks
+        // the points up one at a time; textures override it to share work across the batch.
+        virtual void value_batch(const texture_query& q, double* r, double* g, double* b) const {
+            for (size_t i = 0; i < q.count; i++) {
+                auto c = q.du ? filtered_value(q.u[i], q.v[i], q.p(i), q.du[i], q.dv[i])
+                              : value(q.u[i], q.v[i], q.p(i));
+                r[i] = c.x();
+                g[i] = c.y();
+                b[i] = c.z();
+            }
+        }
+};
+
+
+// The points of a query at chosen indices, copied into arrays of their own.
+class texture_subquery {
+    public:
+        const texture_query& gather(const texture_query& q, const std::vector<size_t>& indices) {
+            auto n = indices.size();
+            storage.resize(7 * n);
+
+            auto column = [&](int k, const double* source) -> const double* {
+                if (!source)
+                    return nullptr;
+                auto out = storage.data() + k*n;
+                for (size_t i = 0; i < n; i++)
+                    out[i] = source[indices[i]];
+                return out;
+            };
+
+            query.count = n;
+            query.u = column(0, q.u);
+            query.v = column(1, q.v);
+            query.x = column(2, q.x);
+            query.y = column(3, q.y);
+            query.z = column(4, q.z);
+            query.du = column(5, q.du);
+            query.dv = column(6, q.dv);
+            return query;
+        }
+
+    private:
+        texture_query query;
+        std::vector<double> storage;
 };
 
 
@@ -37,6 +110,14 @@ class solid_color : public texture {
             return color_value;
         }
 
+        virtual void value_batch(
+            const texture_query& q, double* r, double* g, double* b
+        ) const override {
+            std::fill(r, r + q.count, color_value.x());
+            std::fill(g, g + q.count, color_value.y());
+            std::fill(b, b + q.count, color_value.z());
+        }
+
     private:
         color color_value;
 };
@@ -50,7 +131,7 @@ class checker_texture : public texture {
             : even(_even), odd(_odd) {}
 
         checker_texture(color c1, color c2)
-            : even(make_shared<solid_color>(c1)) , odd(make_shared<solid_color>(c2)) {}
+            : even(arena_shared<solid_color>(c1)) , odd(arena_shared<solid_color>(c2)) {}
 
         virtual color value(double u, double v, const vec3& p) const override {
             auto sines = sin(10*p.x())*sin(10*p.y())*sin(10*p.z());
@@ -60,12 +141,55 @@ class checker_texture : public texture {
                 return even->value(u, v, p);
         }
 
+        virtual void value_batch(
+            const texture_query& q, double* r, double* g, double* b
+        ) const override;
+
     public:
         shared_ptr<texture> odd;
         shared_ptr<texture> even;
 };
 
 
+void checker_texture::value_batch(
+    const texture_query& q, double* r, double* g, double* b
+) const {
+    // Splits the batch by parity, so that each side is asked once for all of its points.
+    // sin(a) is negative when floor(a/pi) is odd, so the product of the three sines is
+    // negative when the sum of the three floors is odd, unless one of the sines is zero.
+    std::vector<size_t> sides[2];
+    const auto scale = 10 / pi;
+    for (size_t i = 0; i < q.count; i++) {
+        auto sx = scale*q.x[i], sy = scale*q.y[i], sz = scale*q.z[i];
+        auto fx = floor(sx), fy = floor(sy), fz = floor(sz);
+        auto parity = (static_cast<long long>(fx) + static_cast<long long>(fy)
+                       + static_cast<long long>(fz)) & 1;
+        bool on_edge = sx == fx || sy == fy || sz == fz;
+        sides[parity && !on_edge].push_back(i);
+    }
+
+    texture_subquery subquery;
+    std::vector<double> colors;
+
+    for (int side = 0; side < 2; side++) {
+        const auto& indices = sides[side];
+        auto n = indices.size();
+        if (n == 0)
+            continue;
+
+        colors.resize(3 * n);
+        const auto& tex = side ? *odd : *even;
+        tex.value_batch(subquery.gather(q, indices), &colors[0], &colors[n], &colors[2*n]);
+
+        for (size_t i = 0; i < n; i++) {
+            r[indices[i]] = colors[i];
+            g[indices[i]] = colors[n + i];
+            b[indices[i]] = colors[2*n + i];
+        }
+    }
+}
+
+
 class noise_texture : public texture {
     public:
         noise_texture() {}
@@ -77,64 +201,227 @@ class noise_texture : public texture {
             return color(1,1,1)*0.5*(1 + sin(scale*p.z() + 10*noise.turb(p)));
         }
 
+        virtual void value_batch(
+            const texture_query& q, double* r, double* g, double* b
+        ) const override {
+            // Turbulence for the whole batch first, four points at a time.
+            std::vector<double> turbulence(q.count);
+            noise.turb_batch(q.x, q.y, q.z, turbulence.data(), q.count);
+
+            for (size_t i = 0; i < q.count; i++)
+                r[i] = g[i] = b[i] = 0.5*(1 + sin(scale*q.z[i] + 10*turbulence[i]));
+        }
+
     public:
         perlin noise;
         double scale;
 };
 
 
+// An image converted at load time into a mip pyramid of 8-bit RGBA texels. Each level is
+// stored in 4x4 texel tiles of one 64-byte cache line, so the texels a bilinear lookup needs
+// are usually in the same line. Lookups blend bilinearly within the two levels whose texel
+// size brackets the footprint, and linearly between them.
 class image_texture : public texture {
     public:
         const static int bytes_per_pixel = 3;
+        const static int tile_size = 4;
+
+        // One level of the pyramid. Its texels are owned by the texture or by a mapped file.
+        struct mip_level {
+            int width, height;
+            int tiles_across;
+            const uint32_t* texels;
+
+            static size_t texel_count(int width, int height) {
+                auto across = size_t(width + tile_size - 1) / tile_size;
+                auto down = size_t(height + tile_size - 1) / tile_size;
+                return across * down * tile_size*tile_size;
+            }
+
+            size_t index(int i, int j) const {
+                auto tile = size_t(j / tile_size) * tiles_across + i / tile_size;
+                auto within = (j % tile_size) * tile_size + i % tile_size;
+                return tile * tile_size*tile_size + within;
+            }
+
+            uint32_t at(int i, int j) const { return texels[index(i, j)]; }
+        };
+
+        image_texture() {}
 
-        image_texture()
-          : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+        // The levels point into the texture's own storage, which a copy would not have.
+        image_texture(const image_texture&) = delete;
+        image_texture& operator=(const image_texture&) = delete;
 
         image_texture(const char* filename) {
             auto components_per_pixel = bytes_per_pixel;
+            int width, height;
 
-            data = stbi_load(
+            auto data = stbi_load(
                 filename, &width, &height, &components_per_pixel, components_per_pixel);
 
             if (!data) {
                 std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-                width = height = 0;
+                return;
             }
 
-            bytes_per_scanline = bytes_per_pixel * width;
+            build_levels(data, width, height);
+            STBI_FREE(data);
         }
 
-        ~image_texture() {
-            STBI_FREE(data);
+        // From tightly packed 8-bit RGB rows, top row first.
+        image_texture(const unsigned char* pixels, int width, int height) {
+            build_levels(pixels, width, height);
         }
 
+        // Adopts levels built earlier, whose texels `owner` keeps alive.
+        image_texture(std::vector<mip_level> mips, shared_ptr<const void> owner)
+            : levels(std::move(mips)), external(owner) {}
+
         virtual color value(double u, double v, const vec3& p) const override {
-            // If we have no texture data, then return solid cyan as a debugging aid.
-            if (data == nullptr)
-                return color(0,1,1);
+            return filtered_value(u, v, p, 0, 0);
+        }
 
-            // Clamp input texture coordinates to [0,1] x [1,0]
-            u = clamp(u, 0.0, 1.0);
-            v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
+        virtual color filtered_value(
+            double u, double v, const vec3& p, double du, double dv
+        ) const override;
+
+        virtual void value_batch(
+            const texture_query& q, double* r, double* g, double* b
+        ) const override {
+            // The lookups themselves are independent, but skip the virtual call for each.
+            for (size_t i = 0; i < q.count; i++) {
+                auto du = q.du ? q.du[i] : 0.0;
+                auto dv = q.dv ? q.dv[i] : 0.0;
+                auto c = image_texture::filtered_value(q.u[i], q.v[i], q.p(i), du, dv);
+                r[i] = c.x();
+                g[i] = c.y();
+                b[i] = c.z();
+            }
+        }
 
-            auto i = static_cast<int>(u * width);
-            auto j = static_cast<int>(v * height);
+        const std::vector<mip_level>& mip_levels() const { return levels; }
+        int level_count() const { return static_cast<int>(levels.size()); }
 
-            // Clamp integer mapping, since actual coordinates should be less than 1.0
-            if (i >= width)  i = width-1;
-            if (j >= height) j = height-1;
+    private:
+        void build_levels(const unsigned char* pixels, int width, int height);
+        color bilinear(const mip_level& level, double u, double v) const;
+
+    private:
+        std::vector<mip_level> levels;
+        std::vector<uint32_t> storage;      // every level's texels, unless adopted
+        shared_ptr<const void> external;
+};
 
-            const auto color_scale = 1.0 / 255.0;
-            auto pixel = data + j*bytes_per_scanline + i*bytes_per_pixel;
 
-            return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+void image_texture::build_levels(const unsigned char* pixels, int width, int height) {
+    // Each level halves the one above, down to a single texel. All of them share one block
+    // of storage, laid out from the top level down.
+    std::vector<size_t> offsets;
+    size_t total = 0;
+    for (int w = width, h = height; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+        levels.push_back({ w, h, (w + tile_size - 1) / tile_size, nullptr });
+        offsets.push_back(total);
+        total += mip_level::texel_count(w, h);
+        if (w == 1 && h == 1)
+            break;
+    }
+
+    storage.assign(total, 0);
+    for (size_t l = 0; l < levels.size(); l++)
+        levels[l].texels = storage.data() + offsets[l];
+
+    auto texel = [&](size_t l, int i, int j) -> uint32_t& {
+        return storage[offsets[l] + levels[l].index(i, j)];
+    };
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            auto pixel = pixels + (size_t(j) * width + i) * bytes_per_pixel;
+            texel(0, i, j) = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16) | (0xffu << 24);
         }
+    }
+
+    // Each level averages 2x2 blocks of the one above, repeating the last row or column of
+    // odd sized levels.
+    for (size_t l = 1; l < levels.size(); l++) {
+        const auto& above = levels[l-1];
+        const auto& level = levels[l];
+
+        for (int j = 0; j < level.height; j++) {
+            for (int i = 0; i < level.width; i++) {
+                int i0 = std::min(2*i, above.width - 1), i1 = std::min(2*i + 1, above.width - 1);
+                int j0 = std::min(2*j, above.height - 1), j1 = std::min(2*j + 1, above.height - 1);
+                uint32_t corners[4] = {
+                    above.at(i0, j0), above.at(i1, j0), above.at(i0, j1), above.at(i1, j1)
+                };
+
+                uint32_t average = 0;
+                for (int shift = 0; shift < 32; shift += 8) {
+                    uint32_t sum = 2;
+                    for (auto c : corners)
+                        sum += (c >> shift) & 0xff;
+                    average |= (sum / 4) << shift;
+                }
+                texel(l, i, j) = average;
+            }
+        }
+    }
+}
 
-    private:
-        unsigned char *data;
-        int width, height;
-        int bytes_per_scanline;
-};
+
+color image_texture::bilinear(const mip_level& level, double u, double v) const {
+    // Texel centres sit at half-integer positions.
+    auto x = u * level.width - 0.5;
+    auto y = v * level.height - 0.5;
+    auto xf = floor(x), yf = floor(y);
+    auto fx = x - xf, fy = y - yf;
+
+    int i0 = std::clamp(static_cast<int>(xf), 0, level.width - 1);
+    int i1 = std::clamp(static_cast<int>(xf) + 1, 0, level.width - 1);
+    int j0 = std::clamp(static_cast<int>(yf), 0, level.height - 1);
+    int j1 = std::clamp(static_cast<int>(yf) + 1, 0, level.height - 1);
+
+    auto unpack = [](uint32_t texel) {
+        return color(texel & 0xff, (texel >> 8) & 0xff, (texel >> 16) & 0xff);
+    };
+
+    auto top = (1-fx) * unpack(level.at(i0, j0)) + fx * unpack(level.at(i1, j0));
+    auto bottom = (1-fx) * unpack(level.at(i0, j1)) + fx * unpack(level.at(i1, j1));
+
+    const auto color_scale = 1.0 / 255.0;
+    return color_scale * ((1-fy) * top + fy * bottom);
+}
+
+
+color image_texture::filtered_value(
+    double u, double v, const vec3& p, double du, double dv
+) const {
+    // If we have no texture data, then return solid cyan as a debugging aid.
+    if (levels.empty())
+        return color(0,1,1);
+
+    // Clamp input texture coordinates to [0,1] x [1,0]
+    u = clamp(u, 0.0, 1.0);
+    v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
+
+    // The level where one texel is as wide as the footprint.
+    const auto& top = levels.front();
+    auto texels = fmax(du * top.width, dv * top.height);
+    if (!(texels > 1))
+        return bilinear(top, u, v);
+
+    auto lod = fmin(log2(texels), double(levels.size() - 1));
+    auto level = static_cast<int>(lod);
+    auto blend = lod - level;
+
+    auto result = bilinear(levels[level], u, v);
+    if (blend > 0 && level + 1 < static_cast<int>(levels.size()))
+        result = (1-blend) * result + blend * bilinear(levels[level + 1], u, v);
+
+    return result;
+}
 
 
 #endif
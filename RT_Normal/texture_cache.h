@@ -0,0 +1,216 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "bvh_cache.h"
+#include "mapped_file.h"
+#include "texture.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Directory holding converted image textures. An empty string disables the cache.
+inline std::string texture_cache_directory = "texture_cache";
+
+
+// Layout of a cache file: this header, a texture_cache_level for each mip level at
+// level_offset, and each level's tiled texels at its own 64-byte aligned offset. Everything
+// is stored in native byte order.
+struct texture_cache_header {
+    char magic[8];
+    uint64_t source_hash;
+    uint32_t version;
+    uint32_t level_count;
+    uint32_t level_offset;
+    uint32_t pad[9];
+};
+
+struct texture_cache_level {
+    uint32_t width;
+    uint32_t height;
+    uint64_t offset;
+};
+
+static_assert(sizeof(texture_cache_header) == 64, "the level table follows aligned");
+
+const char texture_cache_magic[8] = { 'R', 'T', 'T', 'E', 'X', 'C', 0, 1 };
+const uint32_t texture_cache_version = 1;
+
+
+// Identifies a source image by path, size and modification time, so that editing the image
+// invalidates its converted copy without reading the image to find out. Returns 0 if the
+// image does not exist.
+uint64_t texture_source_hash(const std::string& filename) {
+    std::error_code ec;
+    auto path = std::filesystem::weakly_canonical(filename, ec);
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return 0;
+    auto modified = std::filesystem::last_write_time(path, ec);
+    if (ec)
+        return 0;
+
+    scene_hasher h;
+    h.add(static_cast<uint64_t>(texture_cache_version));
+    h.add(path.string().c_str());
+    h.add(static_cast<uint64_t>(size));
+    h.add(static_cast<uint64_t>(modified.time_since_epoch().count()));
+    return h.result();
+}
+
+
+std::string texture_cache_filename(uint64_t hash) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.tex", static_cast<unsigned long long>(hash));
+    return (std::filesystem::path(texture_cache_directory) / name).string();
+}
+
+
+bool write_texture_cache(const std::string& filename, const image_texture& tex, uint64_t hash) {
+    const auto& levels = tex.mip_levels();
+
+    texture_cache_header header = {};
+    std::memcpy(header.magic, texture_cache_magic, sizeof(header.magic));
+    header.source_hash = hash;
+    header.version = texture_cache_version;
+    header.level_count = static_cast<uint32_t>(levels.size());
+    header.level_offset = sizeof(texture_cache_header);
+
+    std::vector<texture_cache_level> table(levels.size());
+    uint64_t end = header.level_offset + table.size() * sizeof(texture_cache_level);
+    for (size_t l = 0; l < levels.size(); l++) {
+        end = (end + 63) & ~uint64_t(63);
+        table[l].width = levels[l].width;
+        table[l].height = levels[l].height;
+        table[l].offset = end;
+        end += image_texture::mip_level::texel_count(levels[l].width, levels[l].height)
+             * sizeof(uint32_t);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(filename).parent_path(), ec);
+
+    return write_file_atomically(filename, [&](std::ofstream& out) {
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()),
+                  table.size() * sizeof(texture_cache_level));
+
+        for (size_t l = 0; l < levels.size(); l++) {
+            auto position = static_cast<uint64_t>(out.tellp());
+            const char zeros[64] = {};
+            out.write(zeros, static_cast<std::streamsize>(table[l].offset - position));
+
+            auto count = image_texture::mip_level::texel_count(levels[l].width, levels[l].height);
+            out.write(reinterpret_cast<const char*>(levels[l].texels), count * sizeof(uint32_t));
+        }
+    });
+}
+
+
+// Maps a cache file and checks that it holds a complete pyramid for the source with `hash`.
+// Returns null if the file is missing, stale or damaged.
+shared_ptr<image_texture> read_texture_cache(const std::string& filename, uint64_t hash) {
+    auto file = make_shared<mapped_file>(filename.c_str());
+    if (!file->valid() || file->size() < sizeof(texture_cache_header))
+        return nullptr;
+
+    texture_cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    if (std::memcmp(header.magic, texture_cache_magic, sizeof(header.magic)) != 0
+        || header.version != texture_cache_version
+        || header.source_hash != hash
+        || header.level_count == 0 || header.level_count > 32
+        || header.level_offset % alignof(texture_cache_level) != 0
+        || file->size() < header.level_offset + header.level_count * sizeof(texture_cache_level))
+        return nullptr;
+
+    auto table = reinterpret_cast<const texture_cache_level*>(file->data() + header.level_offset);
+
+    std::vector<image_texture::mip_level> levels;
+    for (uint32_t l = 0; l < header.level_count; l++) {
+        int width = static_cast<int>(table[l].width);
+        int height = static_cast<int>(table[l].height);
+
+        // Sizes must follow the same halving as image_texture builds, ending at one texel.
+        bool size_ok = l == 0
+            ? width > 0 && height > 0 && width <= 65536 && height <= 65536
+            : width == std::max(levels.back().width / 2, 1)
+              && height == std::max(levels.back().height / 2, 1);
+        bool last = l + 1 == header.level_count;
+        if (!size_ok || last != (width == 1 && height == 1))
+            return nullptr;
+
+        auto bytes = image_texture::mip_level::texel_count(width, height) * sizeof(uint32_t);
+        if (table[l].offset % 64 != 0 || table[l].offset + bytes > file->size())
+            return nullptr;
+
+        auto texels = reinterpret_cast<const uint32_t*>(file->data() + table[l].offset);
+        auto tiles_across = (width + image_texture::tile_size - 1) / image_texture::tile_size;
+        levels.push_back({ width, height, tiles_across, texels });
+    }
+
+    return make_shared<image_texture>(std::move(levels), file);
+}
+
+
+// Returns the image texture for `filename`. Each image is converted once: every material
+// that names it shares one texture, and later runs, or other processes rendering at the same
+// time, map the converted pyramid from the texture cache instead of decoding the image again.
+shared_ptr<image_texture> load_image_texture(const std::string& filename) {
+    static std::unordered_map<std::string, std::weak_ptr<image_texture>> loaded;
+
+    std::error_code ec;
+    auto key = std::filesystem::weakly_canonical(filename, ec).string();
+    if (ec)
+        key = filename;
+
+    if (auto existing = loaded[key].lock())
+        return existing;
+
+    auto hash = texture_source_hash(filename);
+    shared_ptr<image_texture> tex;
+
+    if (!texture_cache_directory.empty() && hash != 0) {
+        auto cache_name = texture_cache_filename(hash);
+        tex = read_texture_cache(cache_name, hash);
+
+        if (!tex) {
+            auto decoded = make_shared<image_texture>(filename.c_str());
+            if (decoded->level_count() > 0 && !write_texture_cache(cache_name, *decoded, hash))
+                std::cerr << "WARNING: Could not write texture cache file '" << cache_name
+                          << "'.\n";
+
+            // Mapping the file just written puts even the first run's texels in the page
+            // cache, rather than in a private copy.
+            tex = read_texture_cache(cache_name, hash);
+            if (!tex)
+                tex = decoded;
+        }
+    } else {
+        tex = make_shared<image_texture>(filename.c_str());
+    }
+
+    loaded[key] = tex;
+    return tex;
+}
+
+
+#endif
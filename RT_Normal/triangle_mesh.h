@@ -0,0 +1,697 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+//==============================================================================================
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "flat_bvh.h"
+#include "hittable.h"
+#include "scene_arena.h"
+#include "simd.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Vertex attributes are stored in single precision to keep large meshes small; all
+// intersection arithmetic is still done in double.
+struct mesh_float3 {
+    float x, y, z;
+
+    mesh_float3() : x(0), y(0), z(0) {}
+    mesh_float3(const vec3& v)
+        : x(static_cast<float>(v.x())), y(static_cast<float>(v.y())), z(static_cast<float>(v.z())) {}
+
+    vec3 to_vec3() const { return vec3(x, y, z); }
+};
+
+struct mesh_float2 {
+    float u, v;
+};
+
+
+// Four triangles of a BVH leaf in SoA form: a, b and c hold the three vertices, one row per
+// axis. Unused lanes are all zero, which makes them degenerate, so they never report a hit.
+struct alignas(16) triangle_packet {
+    float a[3][4];
+    float b[3][4];
+    float c[3][4];
+    uint32_t tri[4];
+};
+
+
+// Per-ray constants of the 4-wide test: the origin, and the axis permutation and shear of
+// the watertight test in triangle_mesh::setup_ray.
+struct packet_ray {
+    float o[3];
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+
+// Intersects a ray with all four triangles of a packet at once, using the same sheared edge
+// tests as the scalar watertight test. Each vertex is transformed by the same operations
+// whichever triangle it belongs to, so two triangles sharing an edge compute its edge function
+// with opposite signs and a ray cannot slip between them. Returns the lane of the closest hit
+// in (t_min, t_max), or -1, and sets t and the barycentrics of vertices 1 and 2.
+inline int intersect_packet(
+    const triangle_packet& p, const packet_ray& r, float t_min, float t_max,
+    float& t, float& b1, float& b2
+) {
+#ifdef RTW_SSE
+    const __m128 zero = _mm_setzero_ps();
+
+    const __m128 ox = _mm_set1_ps(r.o[r.kx]), oy = _mm_set1_ps(r.o[r.ky]), oz = _mm_set1_ps(r.o[r.kz]);
+    const __m128 sx = _mm_set1_ps(r.sx), sy = _mm_set1_ps(r.sy), sz = _mm_set1_ps(r.sz);
+
+    // Vertices relative to the origin, sheared so that the ray runs down +z.
+    const __m128 az = _mm_sub_ps(_mm_load_ps(p.a[r.kz]), oz);
+    const __m128 bz = _mm_sub_ps(_mm_load_ps(p.b[r.kz]), oz);
+    const __m128 cz = _mm_sub_ps(_mm_load_ps(p.c[r.kz]), oz);
+    const __m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.a[r.kx]), ox), _mm_mul_ps(sx, az));
+    const __m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.a[r.ky]), oy), _mm_mul_ps(sy, az));
+    const __m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.b[r.kx]), ox), _mm_mul_ps(sx, bz));
+    const __m128 by = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.b[r.ky]), oy), _mm_mul_ps(sy, bz));
+    const __m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.c[r.kx]), ox), _mm_mul_ps(sx, cz));
+    const __m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(p.c[r.ky]), oy), _mm_mul_ps(sy, cz));
+
+    // Edge functions; the ray passes inside when none of them has a sign opposite to another.
+    const __m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+    const __m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+    const __m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+    const __m128 any_neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+                                     _mm_cmplt_ps(w, zero));
+    const __m128 any_pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+                                     _mm_cmpgt_ps(w, zero));
+
+    const __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+    const __m128 tz = _mm_mul_ps(sz, _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)),
+                                                _mm_mul_ps(w, cz)));
+    const __m128 tt = _mm_div_ps(tz, det);
+
+    __m128 mask = _mm_andnot_ps(_mm_and_ps(any_neg, any_pos), _mm_cmpneq_ps(det, zero));
+    mask = _mm_and_ps(mask, _mm_cmpgt_ps(tt, _mm_set1_ps(t_min)));
+    mask = _mm_and_ps(mask, _mm_cmplt_ps(tt, _mm_set1_ps(t_max)));
+
+    const int hits = _mm_movemask_ps(mask);
+    if (hits == 0)
+        return -1;
+
+    // Closest hit: horizontal minimum over the hit lanes, then the first lane holding it.
+    const __m128 t_hit = _mm_or_ps(_mm_and_ps(mask, tt),
+                                   _mm_andnot_ps(mask, _mm_set1_ps(std::numeric_limits<float>::infinity())));
+    __m128 t_min4 = _mm_min_ps(t_hit, _mm_shuffle_ps(t_hit, t_hit, _MM_SHUFFLE(2, 3, 0, 1)));
+    t_min4 = _mm_min_ps(t_min4, _mm_shuffle_ps(t_min4, t_min4, _MM_SHUFFLE(1, 0, 3, 2)));
+    const int closest = hits & _mm_movemask_ps(_mm_cmpeq_ps(t_hit, t_min4));
+
+    int lane = 0;
+    while (!(closest & (1 << lane)))
+        lane++;
+
+    alignas(16) float ts[4], vs[4], ws[4], dets[4];
+    _mm_store_ps(ts, tt);
+    _mm_store_ps(vs, v);
+    _mm_store_ps(ws, w);
+    _mm_store_ps(dets, det);
+
+    t = ts[lane];
+    b1 = vs[lane] / dets[lane];
+    b2 = ws[lane] / dets[lane];
+    return lane;
+#else
+    int best = -1;
+    for (int i = 0; i < 4; i++) {
+        const float az = p.a[r.kz][i] - r.o[r.kz];
+        const float bz = p.b[r.kz][i] - r.o[r.kz];
+        const float cz = p.c[r.kz][i] - r.o[r.kz];
+        const float ax = (p.a[r.kx][i] - r.o[r.kx]) - r.sx*az;
+        const float ay = (p.a[r.ky][i] - r.o[r.ky]) - r.sy*az;
+        const float bx = (p.b[r.kx][i] - r.o[r.kx]) - r.sx*bz;
+        const float by = (p.b[r.ky][i] - r.o[r.ky]) - r.sy*bz;
+        const float cx = (p.c[r.kx][i] - r.o[r.kx]) - r.sx*cz;
+        const float cy = (p.c[r.ky][i] - r.o[r.ky]) - r.sy*cz;
+
+        const float u = cx*by - cy*bx;
+        const float v = ax*cy - ay*cx;
+        const float w = bx*ay - by*ax;
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            continue;
+
+        const float det = u + v + w;
+        if (det == 0)
+            continue;
+
+        const float tt = r.sz*(u*az + v*bz + w*cz) / det;
+        if (tt <= t_min || tt >= t_max)
+            continue;
+
+        t_max = tt;
+        t = tt;
+        b1 = v / det;
+        b2 = w / det;
+        best = i;
+    }
+    return best;
+#endif
+}
+
+
+// A triangle mesh with shared vertex buffers and one index buffer (three indices per
+// triangle). Normals and texture coordinates are optional; when present there is one per
+// vertex. The mesh keeps its own BVH over triangles, so it goes into a hittable_list or
+// flat_bvh as a single object.
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh(
+            std::vector<mesh_float3> vertex_positions,
+            std::vector<mesh_float3> vertex_normals,
+            std::vector<mesh_float2> vertex_uvs,
+            std::vector<uint32_t> triangle_indices,
+            shared_ptr<material> m);
+
+        virtual bool hit(
+            const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+            return any_triangle(r, t_min, t_max, use_packets);
+        }
+
+        virtual void finalize_hit(const ray& r, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bbox;
+            return !nodes.empty();
+        }
+
+        // Finds the closest triangle along the ray, with either the packet kernel or the scalar
+        // watertight test. Sets the triangle index, distance and barycentrics of vertices 1 and 2.
+        bool closest_triangle(
+            const ray& r, double t_min, double t_max, bool packets,
+            size_t& tri, double& t, double& b1, double& b2) const;
+
+        // True if any triangle crosses the ray between t_min and t_max. Traversal stops at the
+        // first one found.
+        bool any_triangle(const ray& r, double t_min, double t_max, bool packets) const;
+
+        size_t triangle_count() const { return indices.size() / 3; }
+        size_t memory_bytes() const;
+        void print_stats(std::ostream& out) const;
+
+    public:
+        // In the scene arena when there is one, like the mesh itself.
+        scene_vector<mesh_float3> positions;
+        scene_vector<mesh_float3> normals;
+        scene_vector<mesh_float2> uvs;
+        scene_vector<uint32_t> indices;     // reordered so BVH leaves reference runs of triangles
+        scene_vector<flat_bvh_node> nodes;  // aux of a leaf is the index of its first packet
+        scene_vector<triangle_packet> packets;
+        shared_ptr<material> mat_ptr;
+        aabb bbox;
+        double build_ms = 0;
+        bool use_packets = true;
+
+    private:
+        // Per-ray constants of the watertight ray/triangle test.
+        struct ray_setup {
+            int kx, ky, kz;
+            double sx, sy, sz;
+        };
+
+        static ray_setup setup_ray(const ray& r);
+        static packet_ray setup_packet_ray(const ray& r);
+        bool hit_triangle(
+            const ray& r, const ray_setup& s, size_t tri, double t_min, double t_max,
+            double& t, double& b1, double& b2) const;
+};
+
+
+triangle_mesh::triangle_mesh(
+    std::vector<mesh_float3> vertex_positions,
+    std::vector<mesh_float3> vertex_normals,
+    std::vector<mesh_float2> vertex_uvs,
+    std::vector<uint32_t> triangle_indices,
+    shared_ptr<material> m
+) : positions(vertex_positions.begin(), vertex_positions.end()),
+    normals(vertex_normals.begin(), vertex_normals.end()),
+    uvs(vertex_uvs.begin(), vertex_uvs.end()),
+    mat_ptr(m)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+
+    auto tri_count = triangle_indices.size() / 3;
+    std::vector<aabb> boxes(tri_count);
+    for (size_t i = 0; i < tri_count; i++) {
+        auto a = positions[triangle_indices[3*i]].to_vec3();
+        auto b = positions[triangle_indices[3*i+1]].to_vec3();
+        auto c = positions[triangle_indices[3*i+2]].to_vec3();
+        auto lo = point3(fmin(a.x(), fmin(b.x(), c.x())), fmin(a.y(), fmin(b.y(), c.y())),
+                         fmin(a.z(), fmin(b.z(), c.z())));
+        auto hi = point3(fmax(a.x(), fmax(b.x(), c.x())), fmax(a.y(), fmax(b.y(), c.y())),
+                         fmax(a.z(), fmax(b.z(), c.z())));
+        boxes[i] = aabb(lo, hi);
+    }
+
+    flat_bvh_builder builder(boxes, 4, 4);
+    nodes.assign(builder.nodes.begin(), builder.nodes.end());
+
+    // Store the triangles in leaf order so a leaf is a contiguous run of the index buffer.
+    indices.resize(triangle_indices.size());
+    for (size_t i = 0; i < tri_count; i++) {
+        auto src = builder.order[i];
+        indices[3*i]   = triangle_indices[3*src];
+        indices[3*i+1] = triangle_indices[3*src+1];
+        indices[3*i+2] = triangle_indices[3*src+2];
+    }
+
+    size_t packet_count = 0;
+    for (const auto& node : nodes)
+        packet_count += (node.count + 3) / 4;
+    packets.reserve(packet_count);
+
+    for (auto& node : nodes) {
+        if (node.count == 0)
+            continue;
+
+        node.aux = static_cast<uint32_t>(packets.size());
+        for (uint32_t k = 0; k < node.count; k += 4) {
+            triangle_packet packet = {};
+            for (uint32_t lane = 0; lane < 4; lane++) {
+                if (k + lane >= node.count) {
+                    packet.tri[lane] = UINT32_MAX;
+                    continue;
+                }
+
+                auto tri = node.offset + k + lane;
+                const auto& a = positions[indices[3*tri]];
+                const auto& b = positions[indices[3*tri+1]];
+                const auto& c = positions[indices[3*tri+2]];
+                packet.a[0][lane] = a.x; packet.a[1][lane] = a.y; packet.a[2][lane] = a.z;
+                packet.b[0][lane] = b.x; packet.b[1][lane] = b.y; packet.b[2][lane] = b.z;
+                packet.c[0][lane] = c.x; packet.c[1][lane] = c.y; packet.c[2][lane] = c.z;
+                packet.tri[lane] = tri;
+            }
+            packets.push_back(packet);
+        }
+    }
+
+    if (!nodes.empty()) {
+        // Flat triangles have no thickness along one axis, so pad the box like the rects do.
+        const vec3 pad(0.0001, 0.0001, 0.0001);
+        bbox = aabb(point3(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]) - pad,
+                    point3(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]) + pad);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    build_ms = std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
+size_t triangle_mesh::memory_bytes() const {
+    return positions.size() * sizeof(mesh_float3)
+         + normals.size() * sizeof(mesh_float3)
+         + uvs.size() * sizeof(mesh_float2)
+         + indices.size() * sizeof(uint32_t)
+         + nodes.size() * sizeof(flat_bvh_node)
+         + packets.size() * sizeof(triangle_packet);
+}
+
+
+void triangle_mesh::print_stats(std::ostream& out) const {
+    auto tris = triangle_count();
+    out << "Mesh: " << tris << " triangles, " << positions.size() << " vertices, "
+        << memory_bytes() / 1024 << " KiB ("
+        << (tris ? static_cast<double>(memory_bytes()) / tris : 0.0) << " bytes/triangle), "
+        << "BVH " << nodes.size() << " nodes built in " << build_ms << " ms\n";
+}
+
+
+triangle_mesh::ray_setup triangle_mesh::setup_ray(const ray& r) {
+    // Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection" (JCGT 2013). The ray is
+    // sheared so that it points down +z; edge functions are then evaluated in 2D, which
+    // leaves no gaps between triangles sharing an edge.
+    const auto d = r.direction();
+    ray_setup s;
+
+    s.kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2)
+                                     : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+    s.kx = (s.kz + 1) % 3;
+    s.ky = (s.kx + 1) % 3;
+    if (d[s.kz] < 0)
+        std::swap(s.kx, s.ky);  // preserve winding
+
+    s.sx = d[s.kx] / d[s.kz];
+    s.sy = d[s.ky] / d[s.kz];
+    s.sz = 1.0 / d[s.kz];
+    return s;
+}
+
+
+packet_ray triangle_mesh::setup_packet_ray(const ray& r) {
+    const auto s = setup_ray(r);
+    const auto o = r.origin();
+    return {
+        { float(o.x()), float(o.y()), float(o.z()) },
+        s.kx, s.ky, s.kz,
+        float(s.sx), float(s.sy), float(s.sz)
+    };
+}
+
+
+bool triangle_mesh::hit_triangle(
+    const ray& r, const ray_setup& s, size_t tri, double t_min, double t_max,
+    double& t, double& b1, double& b2
+) const {
+    const auto o = r.origin();
+    const auto a = positions[indices[3*tri]].to_vec3() - o;
+    const auto b = positions[indices[3*tri+1]].to_vec3() - o;
+    const auto c = positions[indices[3*tri+2]].to_vec3() - o;
+
+    const auto ax = a[s.kx] - s.sx*a[s.kz];
+    const auto ay = a[s.ky] - s.sy*a[s.kz];
+    const auto bx = b[s.kx] - s.sx*b[s.kz];
+    const auto by = b[s.ky] - s.sy*b[s.kz];
+    const auto cx = c[s.kx] - s.sx*c[s.kz];
+    const auto cy = c[s.ky] - s.sy*c[s.kz];
+
+    const auto u = cx*by - cy*bx;
+    const auto v = ax*cy - ay*cx;
+    const auto w = bx*ay - by*ax;
+
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    const auto det = u + v + w;
+    if (det == 0)
+        return false;
+
+    const auto az = s.sz*a[s.kz];
+    const auto bz = s.sz*b[s.kz];
+    const auto cz = s.sz*c[s.kz];
+    t = (u*az + v*bz + w*cz) / det;
+
+    if (t < t_min || t > t_max)
+        return false;
+
+    b1 = v / det;
+    b2 = w / det;
+    return true;
+}
+
+
+bool triangle_mesh::closest_triangle(
+    const ray& r, double t_min, double t_max, bool packet_test,
+    size_t& tri, double& t, double& b1, double& b2
+) const {
+    if (nodes.empty())
+        return false;
+
+    if (packet_test) {
+        const auto setup = setup_packet_ray(r);
+
+        return traverse_flat_bvh(nodes.data(), r, t_min, t_max,
+            [&](const flat_bvh_node& leaf, double& closest) {
+                bool hit_leaf = false;
+                for (uint32_t k = 0; k < (leaf.count + 3) / 4; k++) {
+                    const auto& packet = packets[leaf.aux + k];
+                    float pt, pb1, pb2;
+                    int lane = intersect_packet(
+                        packet, setup, float(t_min), float(closest), pt, pb1, pb2);
+                    if (lane >= 0) {
+                        hit_leaf = true;
+                        closest = t = pt;
+                        tri = packet.tri[lane];
+                        b1 = pb1;
+                        b2 = pb2;
+                    }
+                }
+                return hit_leaf;
+            }
+        );
+    }
+
+    const auto setup = setup_ray(r);
+
+    return traverse_flat_bvh(nodes.data(), r, t_min, t_max,
+        [&](const flat_bvh_node& leaf, double& closest) {
+            bool hit_leaf = false;
+            for (uint32_t k = leaf.offset; k < leaf.offset + leaf.count; k++) {
+                double kt, kb1, kb2;
+                if (hit_triangle(r, setup, k, t_min, closest, kt, kb1, kb2)) {
+                    hit_leaf = true;
+                    closest = t = kt;
+                    tri = k;
+                    b1 = kb1;
+                    b2 = kb2;
+                }
+            }
+            return hit_leaf;
+        }
+    );
+}
+
+
+bool triangle_mesh::any_triangle(const ray& r, double t_min, double t_max, bool packet_test) const {
+    if (nodes.empty())
+        return false;
+
+    if (packet_test) {
+        const auto setup = setup_packet_ray(r);
+
+        return traverse_flat_bvh<true>(nodes.data(), r, t_min, t_max,
+            [&](const flat_bvh_node& leaf, double&) {
+                for (uint32_t k = 0; k < (leaf.count + 3) / 4; k++) {
+                    float pt, pb1, pb2;
+                    if (intersect_packet(packets[leaf.aux + k], setup, float(t_min), float(t_max),
+                                         pt, pb1, pb2) >= 0)
+                        return true;
+                }
+                return false;
+            }
+        );
+    }
+
+    const auto setup = setup_ray(r);
+
+    return traverse_flat_bvh<true>(nodes.data(), r, t_min, t_max,
+        [&](const flat_bvh_node& leaf, double&) {
+            for (uint32_t k = leaf.offset; k < leaf.offset + leaf.count; k++) {
+                double kt, kb1, kb2;
+                if (hit_triangle(r, setup, k, t_min, t_max, kt, kb1, kb2))
+                    return true;
+            }
+            return false;
+        }
+    );
+}
+
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    size_t best_tri;
+    double best_t, best_b1, best_b2;
+
+    if (!closest_triangle(r, t_min, t_max, use_packets, best_tri, best_t, best_b1, best_b2))
+        return false;
+
+    // The triangle and its barycentrics wait in the record until the hit is finalized.
+    rec.t = best_t;
+    rec.primitive = static_cast<uint32_t>(best_tri);
+    rec.u = best_b1;
+    rec.v = best_b2;
+    rec.pending = this;
+    return true;
+}
+
+
+void triangle_mesh::finalize_hit(const ray& r, hit_record& rec) const {
+    const auto best_tri = rec.primitive;
+    const auto best_b1 = rec.u;
+    const auto best_b2 = rec.v;
+
+    const auto i0 = indices[3*best_tri];
+    const auto i1 = indices[3*best_tri+1];
+    const auto i2 = indices[3*best_tri+2];
+    const auto b0 = 1 - best_b1 - best_b2;
+
+    const auto p0 = positions[i0].to_vec3();
+    const auto p1 = positions[i1].to_vec3();
+    const auto p2 = positions[i2].to_vec3();
+
+    rec.p = b0*p0 + best_b1*p1 + best_b2*p2;
+
+    // Which side was hit is decided by the triangle's winding. Interpolated normals only
+    // shade, and are flipped to the side the ray came from, as the geometric normal is.
+    rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+    if (!normals.empty()) {
+        auto shading_normal =
+            b0*normals[i0].to_vec3() + best_b1*normals[i1].to_vec3() + best_b2*normals[i2].to_vec3();
+        if (!shading_normal.near_zero()) {
+            shading_normal = unit_vector(shading_normal);
+            rec.normal = dot(shading_normal, rec.normal) < 0 ? -shading_normal : shading_normal;
+        }
+    }
+
+    if (uvs.empty()) {
+        rec.u = best_b1;
+        rec.v = best_b2;
+        rec.u_rate = rec.v_rate = 0;
+    } else {
+        rec.u = b0*uvs[i0].u + best_b1*uvs[i1].u + best_b2*uvs[i2].u;
+        rec.v = b0*uvs[i0].v + best_b1*uvs[i1].v + best_b2*uvs[i2].v;
+
+        // The same rate in u and v, from the ratio of the triangle's area in texture space to
+        // its area in the world.
+        auto du1 = uvs[i1].u - uvs[i0].u, dv1 = uvs[i1].v - uvs[i0].v;
+        auto du2 = uvs[i2].u - uvs[i0].u, dv2 = uvs[i2].v - uvs[i0].v;
+        auto world_area = cross(p1 - p0, p2 - p0).length();
+        auto uv_area = fabs(du1*dv2 - du2*dv1);
+        rec.u_rate = rec.v_rate = world_area > 0 ? sqrt(uv_area / world_area) : 0;
+    }
+
+    rec.mat_ptr = mat_ptr;
+}
+
+
+// Reads a Wavefront OBJ file line by line. Faces with more than three vertices are split into
+// fans, and every distinct position/texcoord/normal combination becomes one mesh vertex.
+// Positions are scaled and then offset as they are read. Returns null if nothing was loaded.
+shared_ptr<triangle_mesh> load_obj(
+    const char* filename, shared_ptr<material> m, double scale = 1.0, vec3 offset = vec3(0,0,0)
+) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "ERROR: Could not load mesh file '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    std::vector<vec3> obj_positions;
+    std::vector<vec3> obj_normals;
+    std::vector<mesh_float2> obj_uvs;
+
+    std::vector<mesh_float3> positions, normals;
+    std::vector<mesh_float2> uvs;
+    std::vector<uint32_t> indices;
+
+    struct key_hash {
+        size_t operator()(const std::pair<uint64_t, uint32_t>& k) const {
+            return std::hash<uint64_t>()(k.first * 0x9e3779b97f4a7c15ull ^ k.second);
+        }
+    };
+    std::unordered_map<std::pair<uint64_t, uint32_t>, uint32_t, key_hash> vertex_map;
+
+    bool any_uvs = false, any_normals = false;
+
+    // Resolves an OBJ index (1-based, or negative to count back from the end) to 0-based.
+    auto resolve = [](long index, size_t count) -> long {
+        return index > 0 ? index - 1 : static_cast<long>(count) + index;
+    };
+
+    auto vertex_for = [&](const std::string& token) -> long {
+        long vi = 0, ti = 0, ni = 0;
+        if (std::sscanf(token.c_str(), "%ld/%ld/%ld", &vi, &ti, &ni) != 3
+            && std::sscanf(token.c_str(), "%ld//%ld", &vi, &ni) != 2
+            && std::sscanf(token.c_str(), "%ld/%ld", &vi, &ti) != 2
+            && std::sscanf(token.c_str(), "%ld", &vi) != 1)
+            return -1;
+
+        auto v = resolve(vi, obj_positions.size());
+        auto t = ti ? resolve(ti, obj_uvs.size()) : -1;
+        auto n = ni ? resolve(ni, obj_normals.size()) : -1;
+        if (v < 0 || v >= static_cast<long>(obj_positions.size())
+            || (ti != 0 && (t < 0 || t >= static_cast<long>(obj_uvs.size())))
+            || (ni != 0 && (n < 0 || n >= static_cast<long>(obj_normals.size()))))
+            return -1;
+
+        auto key = std::make_pair((static_cast<uint64_t>(v) << 32) | static_cast<uint32_t>(t + 1),
+                                  static_cast<uint32_t>(n + 1));
+        auto found = vertex_map.find(key);
+        if (found != vertex_map.end())
+            return found->second;
+
+        auto index = static_cast<uint32_t>(positions.size());
+        positions.push_back(mesh_float3(obj_positions[v]));
+        uvs.push_back(t >= 0 ? obj_uvs[t] : mesh_float2{0, 0});
+        normals.push_back(n >= 0 ? mesh_float3(obj_normals[n]) : mesh_float3());
+        any_uvs |= t >= 0;
+        any_normals |= n >= 0;
+
+        vertex_map.emplace(key, index);
+        return index;
+    };
+
+    std::string line, type, token;
+    std::vector<long> face;
+    size_t bad_faces = 0;
+
+    while (std::getline(in, line)) {
+        std::istringstream ls(line);
+        if (!(ls >> type))
+            continue;
+
+        if (type == "v") {
+            double x = 0, y = 0, z = 0;
+            ls >> x >> y >> z;
+            obj_positions.push_back(scale * vec3(x, y, z) + offset);
+        } else if (type == "vn") {
+            double x = 0, y = 0, z = 0;
+            ls >> x >> y >> z;
+            obj_normals.push_back(vec3(x, y, z));
+        } else if (type == "vt") {
+            float u = 0, v = 0;
+            ls >> u >> v;
+            obj_uvs.push_back(mesh_float2{u, v});
+        } else if (type == "f") {
+            face.clear();
+            while (ls >> token)
+                face.push_back(vertex_for(token));
+
+            bool valid = face.size() >= 3;
+            for (auto index : face)
+                valid = valid && index >= 0;
+            if (!valid) {
+                bad_faces++;
+                continue;
+            }
+
+            for (size_t k = 1; k + 1 < face.size(); k++) {
+                indices.push_back(static_cast<uint32_t>(face[0]));
+                indices.push_back(static_cast<uint32_t>(face[k]));
+                indices.push_back(static_cast<uint32_t>(face[k+1]));
+            }
+        }
+    }
+
+    if (bad_faces)
+        std::cerr << "WARNING: Skipped " << bad_faces << " malformed faces in '" << filename << "'.\n";
+
+    if (indices.empty()) {
+        std::cerr << "ERROR: No triangles in mesh file '" << filename << "'.\n";
+        return nullptr;
+    }
+
+    if (!any_normals) normals.clear();
+    if (!any_uvs) uvs.clear();
+
+    auto mesh = arena_shared<triangle_mesh>(
+        std::move(positions), std::move(normals), std::move(uvs), std::move(indices), m);
+    mesh->print_stats(std::cerr);
+    return mesh;
+}
+
+
+#endif